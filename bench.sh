@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# Runs sqlitedis-bench against a redis-server started just for it, then
+# against redisvfs' in-process memory backend (the VFS without the
+# network) and the default unix VFS as baselines.  Run from the build
+# directory.  Prints a JSON object per workload per run, one per line.
+#
+# Arguments are passed on to sqlitedis-bench (workload names).  Set
+# REDIS_SERVER for a redis-server that isn't on the PATH, REDISVFS_OPTS
+# for extra URI parameters (e.g. "cache_blocks=0&writeback_blocks=64"),
+# and BENCH_ROWS/BENCH_OPS for the size of the run.
+
+set -e -o pipefail
+
+REDIS_SERVER=${REDIS_SERVER:-redis-server}
+TMP=$(mktemp -d)
+
+$REDIS_SERVER --port 0 --unixsocket "$TMP/redis.sock" --save "" --appendonly no \
+	--logfile "$TMP/redis.log" &
+REDIS_PID=$!
+trap 'kill $REDIS_PID 2>/dev/null; wait $REDIS_PID 2>/dev/null; rm -rf "$TMP"' EXIT
+
+for i in $(seq 50); do
+	[ -S "$TMP/redis.sock" ] && break
+	sleep 0.1
+done
+
+./sqlitedis-bench "file:bench?vfs=redisvfs&redis=unix:$TMP/redis.sock${REDISVFS_OPTS:+&$REDISVFS_OPTS}" "$@"
+./sqlitedis-bench "file:bench?vfs=redisvfs&backend=memory${REDISVFS_OPTS:+&$REDISVFS_OPTS}" "$@"
+./sqlitedis-bench "file:$TMP/bench.sqlite?vfs=unix" "$@"
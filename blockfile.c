@@ -0,0 +1,446 @@
+/* blockfile: a redis module with a data type for redisvfs files
+ *
+ *   MODULE LOAD /path/to/blockfile.so [page size]
+ *
+ * A blockfile key holds a whole file: its length and a sparse array of
+ * fixed size pages, NULL where nothing has been written (or only zeros).
+ * That is one key and one pointer per page, rather than a string key with
+ * its own name and headers for every block, and a read or write of any
+ * byte range is one command that never parses a block key.  The pointers
+ * are kept in chunks allocated as they are needed, so a write far past
+ * the end costs one chunk and not a pointer for every page before it.
+ *
+ *   BLOCKFILE.READ key offset count
+ *      Bytes [offset, offset+count) cut short at the end of the file.
+ *      Holes read as zeros.  "" if there is no such key
+ *   BLOCKFILE.WRITE key offset data
+ *      Creates the key if need be.  Pages written whole with zeros are
+ *      freed.  The length becomes at least offset+len(data), so an empty
+ *      write only raises it.  Replies with the length
+ *   BLOCKFILE.TRUNCATE key length
+ *      Sets the length, freeing the pages past it and zeroing the rest of
+ *      the last one.  Creates the key if need be.  Replies with the number
+ *      of pages freed
+ *   BLOCKFILE.LENGTH key
+ *      0 if there is no such key
+ *
+ * The page size (default 4096) is set for new keys when the module is
+ * loaded.  Keys keep the one they were made with.  A file can have as many
+ * pages as a sqlite database, which bounds its length.  redisvfs uses the
+ * module for a new database when the server has it (see layout=blockfile).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "redismodule.h"
+
+#define BLOCKFILE_ENCVER 0
+#define BLOCKFILE_DEFAULT_PAGESIZE 4096
+#define BLOCKFILE_MIN_PAGESIZE 512
+#define BLOCKFILE_MAX_PAGESIZE 65536
+// Same as sqlite's largest database
+#define BLOCKFILE_MAX_LENGTH (1LL << 48)
+// sqlite's most pages, so the chunk table is at most 8 MB
+#define BLOCKFILE_MAX_PAGES (1LL << 32)
+#define BLOCKFILE_CHUNK_PAGES 4096
+
+typedef struct BlockFile {
+    long long length;
+    long long pagesize;
+    uint64_t nchunks;   // slots in chunks
+    uint64_t used;      // pages that aren't NULL
+    char ***chunks;     // BLOCKFILE_CHUNK_PAGES pages each, or NULL
+} BlockFile;
+
+static RedisModuleType *BlockFileType;
+static long long blockfile_pagesize = BLOCKFILE_DEFAULT_PAGESIZE;
+
+
+/* pages */
+
+static BlockFile *blockfile_create(long long pagesize) {
+    BlockFile *bf = RedisModule_Calloc(1, sizeof(BlockFile));
+    bf->pagesize = pagesize;
+    return bf;
+}
+
+static void blockfile_free_chunk(BlockFile *bf, uint64_t c) {
+    char **chunk = bf->chunks[c];
+    for (int j=0; j<BLOCKFILE_CHUNK_PAGES; ++j) {
+        if (chunk[j]) {
+            RedisModule_Free(chunk[j]);
+            bf->used--;
+        }
+    }
+    RedisModule_Free(chunk);
+    bf->chunks[c] = NULL;
+}
+
+static void blockfile_free(void *value) {
+    BlockFile *bf = value;
+    for (uint64_t c=0; c<bf->nchunks; ++c)
+        if (bf->chunks[c])
+            blockfile_free_chunk(bf, c);
+    RedisModule_Free(bf->chunks);
+    RedisModule_Free(bf);
+}
+
+static inline long long blockfile_max_length(long long pagesize) {
+    long long max = pagesize * BLOCKFILE_MAX_PAGES;
+    return max < BLOCKFILE_MAX_LENGTH ? max : BLOCKFILE_MAX_LENGTH;
+}
+
+/* Page i, or NULL */
+static char *blockfile_page(BlockFile *bf, uint64_t i) {
+    uint64_t c = i / BLOCKFILE_CHUNK_PAGES;
+    if (c >= bf->nchunks || !bf->chunks[c])
+        return NULL;
+    return bf->chunks[c][i % BLOCKFILE_CHUNK_PAGES];
+}
+
+/* Where page i goes, making room for it.  pre: i < BLOCKFILE_MAX_PAGES */
+static char **blockfile_slot(BlockFile *bf, uint64_t i) {
+    uint64_t c = i / BLOCKFILE_CHUNK_PAGES;
+    if (c >= bf->nchunks) {
+        uint64_t cap = bf->nchunks ? bf->nchunks : 16;
+        while (cap <= c)
+            cap *= 2;
+        bf->chunks = RedisModule_Realloc(bf->chunks, cap * sizeof(char **));
+        memset(bf->chunks + bf->nchunks, 0, (cap - bf->nchunks) * sizeof(char **));
+        bf->nchunks = cap;
+    }
+    if (!bf->chunks[c])
+        bf->chunks[c] = RedisModule_Calloc(BLOCKFILE_CHUNK_PAGES, sizeof(char *));
+    return &bf->chunks[c][i % BLOCKFILE_CHUNK_PAGES];
+}
+
+static void blockfile_drop_page(BlockFile *bf, uint64_t i) {
+    uint64_t c = i / BLOCKFILE_CHUNK_PAGES;
+    if (c >= bf->nchunks || !bf->chunks[c])
+        return;
+    char **slot = &bf->chunks[c][i % BLOCKFILE_CHUNK_PAGES];
+    if (*slot) {
+        RedisModule_Free(*slot);
+        *slot = NULL;
+        bf->used--;
+    }
+}
+
+static int _is_zero(const char *buf, size_t len) {
+    for (size_t i=0; i<len; ++i)
+        if (buf[i])
+            return 0;
+    return 1;
+}
+
+static void blockfile_write(BlockFile *bf, long long offset, const char *data, size_t len) {
+    long long end = offset + (long long)len;
+    for (long long p=offset; p<end; ) {
+        uint64_t i = p / bf->pagesize;
+        long long first = p % bf->pagesize;
+        long long n = bf->pagesize - first;
+        if (n > end - p)
+            n = end - p;
+        const char *src = data + (p - offset);
+
+        char *page = blockfile_page(bf, i);
+        if (n == bf->pagesize && _is_zero(src, n)) {
+            blockfile_drop_page(bf, i);
+        } else if (page) {
+            memcpy(page + first, src, n);
+        } else if (!_is_zero(src, n)) {
+            page = RedisModule_Calloc(1, bf->pagesize);
+            *blockfile_slot(bf, i) = page;
+            bf->used++;
+            memcpy(page + first, src, n);
+        }
+        p += n;
+    }
+    if (end > bf->length)
+        bf->length = end;
+}
+
+/* Copy [offset, offset+len) to out.  pre: it is all inside the file */
+static void blockfile_read(BlockFile *bf, long long offset, char *out, size_t len) {
+    long long end = offset + (long long)len;
+    for (long long p=offset; p<end; ) {
+        uint64_t i = p / bf->pagesize;
+        long long first = p % bf->pagesize;
+        long long n = bf->pagesize - first;
+        if (n > end - p)
+            n = end - p;
+        const char *page = blockfile_page(bf, i);
+        if (page)
+            memcpy(out + (p - offset), page + first, n);
+        else
+            memset(out + (p - offset), 0, n);
+        p += n;
+    }
+}
+
+/* Returns the number of pages freed */
+static long long blockfile_truncate(BlockFile *bf, long long length) {
+    uint64_t before = bf->used;
+    uint64_t keep = (length + bf->pagesize - 1) / bf->pagesize;
+    uint64_t c = (keep + BLOCKFILE_CHUNK_PAGES - 1) / BLOCKFILE_CHUNK_PAGES;
+    // The rest of the chunk the new end falls in, then whole chunks
+    for (uint64_t i=keep; i<c * BLOCKFILE_CHUNK_PAGES; ++i)
+        blockfile_drop_page(bf, i);
+    uint64_t need = c;
+    for (; c<bf->nchunks; ++c)
+        if (bf->chunks[c])
+            blockfile_free_chunk(bf, c);
+    // Don't keep a big table for a file that got small
+    if (need == 0) {
+        RedisModule_Free(bf->chunks);
+        bf->chunks = NULL;
+        bf->nchunks = 0;
+    } else if (need * 4 < bf->nchunks) {
+        uint64_t cap = 16;
+        while (cap < need)
+            cap *= 2;
+        bf->chunks = RedisModule_Realloc(bf->chunks, cap * sizeof(char **));
+        bf->nchunks = cap;
+    }
+    // Growing again later has to read zeros here
+    long long tail = length % bf->pagesize;
+    char *last = tail ? blockfile_page(bf, keep-1) : NULL;
+    if (last)
+        memset(last + tail, 0, bf->pagesize - tail);
+    bf->length = length;
+    return before - bf->used;
+}
+
+
+/* commands */
+
+/* *bf is NULL if there is no such key.  Replies with an error and
+ * returns REDISMODULE_ERR if it isn't a blockfile */
+static int blockfile_open(RedisModuleCtx *ctx, RedisModuleString *name, int mode,
+        RedisModuleKey **key, BlockFile **bf) {
+    *key = RedisModule_OpenKey(ctx, name, mode);
+    *bf = NULL;
+    // Opened read only, a missing key is NULL
+    if (RedisModule_KeyType(*key) == REDISMODULE_KEYTYPE_EMPTY)
+        return REDISMODULE_OK;
+    if (RedisModule_ModuleTypeGetType(*key) != BlockFileType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    *bf = RedisModule_ModuleTypeGetValue(*key);
+    return REDISMODULE_OK;
+}
+
+/* Same for writing up to end, creating the key if need be.  Replies with
+ * an error and returns NULL if end is past the most the key can hold */
+static BlockFile *blockfile_open_write(RedisModuleCtx *ctx, RedisModuleString *name, long long end) {
+    RedisModuleKey *key;
+    BlockFile *bf;
+    if (blockfile_open(ctx, name, REDISMODULE_READ|REDISMODULE_WRITE, &key, &bf) == REDISMODULE_ERR)
+        return NULL;
+    if (end > blockfile_max_length(bf ? bf->pagesize : blockfile_pagesize)) {
+        RedisModule_ReplyWithError(ctx, "ERR offset out of range");
+        return NULL;
+    }
+    if (!bf) {
+        bf = blockfile_create(blockfile_pagesize);
+        RedisModule_ModuleTypeSetValue(key, BlockFileType, bf);
+    }
+    return bf;
+}
+
+static int _arg_offset(RedisModuleString *arg, long long *v) {
+    return RedisModule_StringToLongLong(arg, v) == REDISMODULE_OK && *v >= 0 && *v <= BLOCKFILE_MAX_LENGTH;
+}
+
+/* BLOCKFILE.READ key offset count */
+static int blockfile_read_cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+    RedisModule_AutoMemory(ctx);
+    long long offset, count;
+    if (!_arg_offset(argv[2], &offset) || !_arg_offset(argv[3], &count))
+        return RedisModule_ReplyWithError(ctx, "ERR offset or count out of range");
+
+    RedisModuleKey *key;
+    BlockFile *bf;
+    if (blockfile_open(ctx, argv[1], REDISMODULE_READ, &key, &bf) == REDISMODULE_ERR)
+        return REDISMODULE_OK;
+    if (!bf || offset >= bf->length)
+        return RedisModule_ReplyWithStringBuffer(ctx, "", 0);
+    if (count > bf->length - offset)
+        count = bf->length - offset;
+
+    char *buf = RedisModule_Alloc(count ? count : 1);
+    blockfile_read(bf, offset, buf, count);
+    RedisModule_ReplyWithStringBuffer(ctx, buf, count);
+    RedisModule_Free(buf);
+    return REDISMODULE_OK;
+}
+
+/* BLOCKFILE.WRITE key offset data */
+static int blockfile_write_cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+    RedisModule_AutoMemory(ctx);
+    long long offset;
+    size_t len;
+    const char *data = RedisModule_StringPtrLen(argv[3], &len);
+    if (!_arg_offset(argv[2], &offset) || offset + (long long)len > BLOCKFILE_MAX_LENGTH)
+        return RedisModule_ReplyWithError(ctx, "ERR offset out of range");
+
+    BlockFile *bf = blockfile_open_write(ctx, argv[1], offset + (long long)len);
+    if (!bf)
+        return REDISMODULE_OK;
+    blockfile_write(bf, offset, data, len);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, bf->length);
+}
+
+/* BLOCKFILE.TRUNCATE key length */
+static int blockfile_truncate_cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+    RedisModule_AutoMemory(ctx);
+    long long length;
+    if (!_arg_offset(argv[2], &length))
+        return RedisModule_ReplyWithError(ctx, "ERR length out of range");
+
+    BlockFile *bf = blockfile_open_write(ctx, argv[1], length);
+    if (!bf)
+        return REDISMODULE_OK;
+    long long freed = blockfile_truncate(bf, length);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, freed);
+}
+
+/* BLOCKFILE.LENGTH key */
+static int blockfile_length_cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+    RedisModule_AutoMemory(ctx);
+    RedisModuleKey *key;
+    BlockFile *bf;
+    if (blockfile_open(ctx, argv[1], REDISMODULE_READ, &key, &bf) == REDISMODULE_ERR)
+        return REDISMODULE_OK;
+    return RedisModule_ReplyWithLongLong(ctx, bf ? bf->length : 0);
+}
+
+
+/* type methods
+ *
+ * RDB: page size, length, number of pages, then each page as its index
+ * and contents.  AOF: a BLOCKFILE.WRITE per page, then a TRUNCATE for the
+ * exact length.
+ */
+
+static inline int _valid_pagesize(long long pagesize) {
+    return pagesize >= BLOCKFILE_MIN_PAGESIZE && pagesize <= BLOCKFILE_MAX_PAGESIZE &&
+        (pagesize & (pagesize - 1)) == 0;
+}
+
+/* Anything that couldn't have been saved is refused rather than trusted */
+static void *blockfile_rdb_load(RedisModuleIO *rdb, int encver) {
+    if (encver != BLOCKFILE_ENCVER)
+        return NULL;
+    uint64_t pagesize = RedisModule_LoadUnsigned(rdb);
+    if (!_valid_pagesize(pagesize))
+        return NULL;
+    BlockFile *bf = blockfile_create(pagesize);
+    bf->length = RedisModule_LoadSigned(rdb);
+    if (bf->length < 0 || bf->length > blockfile_max_length(bf->pagesize)) {
+        blockfile_free(bf);
+        return NULL;
+    }
+    uint64_t used = RedisModule_LoadUnsigned(rdb);
+    for (uint64_t n=0; n<used; ++n) {
+        uint64_t i = RedisModule_LoadUnsigned(rdb);
+        size_t len;
+        char *page = RedisModule_LoadStringBuffer(rdb, &len);
+        // Pages only exist inside the file
+        if ((long long)len != bf->pagesize || i >= BLOCKFILE_MAX_PAGES ||
+                (long long)i * bf->pagesize >= bf->length || blockfile_page(bf, i)) {
+            RedisModule_Free(page);
+            blockfile_free(bf);
+            return NULL;
+        }
+        *blockfile_slot(bf, i) = page;
+        bf->used++;
+    }
+    return bf;
+}
+
+static void blockfile_rdb_save(RedisModuleIO *rdb, void *value) {
+    BlockFile *bf = value;
+    RedisModule_SaveUnsigned(rdb, bf->pagesize);
+    RedisModule_SaveSigned(rdb, bf->length);
+    RedisModule_SaveUnsigned(rdb, bf->used);
+    for (uint64_t c=0; c<bf->nchunks; ++c) {
+        for (int j=0; bf->chunks[c] && j<BLOCKFILE_CHUNK_PAGES; ++j) {
+            if (bf->chunks[c][j]) {
+                RedisModule_SaveUnsigned(rdb, c * BLOCKFILE_CHUNK_PAGES + j);
+                RedisModule_SaveStringBuffer(rdb, bf->chunks[c][j], bf->pagesize);
+            }
+        }
+    }
+}
+
+static void blockfile_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    BlockFile *bf = value;
+    for (uint64_t c=0; c<bf->nchunks; ++c) {
+        for (int j=0; bf->chunks[c] && j<BLOCKFILE_CHUNK_PAGES; ++j) {
+            if (bf->chunks[c][j])
+                RedisModule_EmitAOF(aof, "BLOCKFILE.WRITE", "slb", key,
+                        (long long)((c * BLOCKFILE_CHUNK_PAGES + j) * bf->pagesize),
+                        bf->chunks[c][j], (size_t)bf->pagesize);
+        }
+    }
+    RedisModule_EmitAOF(aof, "BLOCKFILE.TRUNCATE", "sl", key, bf->length);
+}
+
+static size_t blockfile_mem_usage(const void *value) {
+    const BlockFile *bf = value;
+    size_t size = sizeof(BlockFile) + bf->nchunks * sizeof(char **) + bf->used * bf->pagesize;
+    for (uint64_t c=0; c<bf->nchunks; ++c)
+        if (bf->chunks[c])
+            size += BLOCKFILE_CHUNK_PAGES * sizeof(char *);
+    return size;
+}
+
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_Init(ctx, "blockfile", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (argc > 0) {
+        long long pagesize;
+        if (argc > 1 || RedisModule_StringToLongLong(argv[0], &pagesize) != REDISMODULE_OK ||
+                !_valid_pagesize(pagesize)) {
+            RedisModule_Log(ctx, "warning", "blockfile: the only argument is a power of two page size from %d to %d",
+                    BLOCKFILE_MIN_PAGESIZE, BLOCKFILE_MAX_PAGESIZE);
+            return REDISMODULE_ERR;
+        }
+        blockfile_pagesize = pagesize;
+    }
+
+    RedisModuleTypeMethods methods = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = blockfile_rdb_load,
+        .rdb_save = blockfile_rdb_save,
+        .aof_rewrite = blockfile_aof_rewrite,
+        .mem_usage = blockfile_mem_usage,
+        .free = blockfile_free,
+    };
+    // Type names are exactly 9 characters
+    BlockFileType = RedisModule_CreateDataType(ctx, "blockfile", BLOCKFILE_ENCVER, &methods);
+    if (BlockFileType == NULL)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "blockfile.read", blockfile_read_cmd, "readonly", 1, 1, 1) == REDISMODULE_ERR ||
+            RedisModule_CreateCommand(ctx, "blockfile.write", blockfile_write_cmd, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR ||
+            RedisModule_CreateCommand(ctx, "blockfile.truncate", blockfile_truncate_cmd, "write", 1, 1, 1) == REDISMODULE_ERR ||
+            RedisModule_CreateCommand(ctx, "blockfile.length", blockfile_length_cmd, "readonly fast", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    return REDISMODULE_OK;
+}
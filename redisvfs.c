@@ -7,48 +7,207 @@ SQLITE_EXTENSION_INIT1
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <hiredis/hiredis.h>
+#ifdef REDISVFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef REDISVFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "redisvfs.h"
 
+/* Idle connections, keyed by endpoint */
+struct RedisPooledConn {
+    redisContext *ctx;
+    char endpoint[REDISVFS_MAX_ENDPOINTLEN+1];
+    struct RedisPooledConn *next;
+};
+
+struct RedisConnPool {
+    sqlite3_mutex *mutex;
+    int nidle;
+    struct RedisPooledConn *idle;
+    // Shared connections (mux=1).  Their own mutex, as making one
+    // borrows from the pool
+    sqlite3_mutex *muxmutex;
+    struct RedisMux *muxes;
+};
+
+/* State hanging off redis_vfs.pAppData */
+typedef struct RedisVFSData {
+    sqlite3_vfs *parent;    // VFS we pass OS level calls through to
+    RedisConnPool pool;
+} RedisVFSData;
+
 // Debugging
 //
 // Reference the parent VFS that we reference in pAppData
-#define PARENT_VFS(vfs) ((sqlite3_vfs *)(vfs->pAppData))
+#define PARENT_VFS(vfs) (((RedisVFSData *)(vfs->pAppData))->parent)
+#define VFS_POOL(vfs) (&((RedisVFSData *)(vfs->pAppData))->pool)
+
+/* Monotonic clock for timing, in microseconds */
+static inline sqlite3_int64 _now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 /* keyspace helpers */
 
+/* Every block operation needs these, so no printf.  Neither terminates out */
+static inline int _u64_to_hex(uint64_t v, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = digits[v & 0xf];
+        v >>= 4;
+    } while (v);
+    for (int i=0; i<n; ++i)
+        out[i] = tmp[n-1-i];
+    return n;
+}
+static inline int _u64_to_dec(uint64_t v, char *out) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    for (int i=0; i<n; ++i)
+        out[i] = tmp[n-1-i];
+    return n;
+}
+
 /* pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
 static int get_blockkey(RedisFile *rf, int64_t offset, char *outkeyname) {
     // (REDISVFS_MAX_KEYLEN - REDISVFS_MAX_PREFIXLEN) = 32 characters
     // to encode the block number.  1 character for a delimiter, plus
-    // 14 bytes for hex encoding any block number for a 64 bit offset
-    // (given 1024 byte blocks) meeans we still have 17 bytes free
+    // at most 14 bytes for hex encoding any block number for a 64 bit offset
+    // (given blocks of at least 512 bytes) meeans we still have 17 bytes free
     // if we need to encode something else in the keyname later on.
-    int blocknum = offset / REDISVFS_BLOCKSIZE;
-    int written = snprintf(outkeyname, REDISVFS_KEYBUFLEN, "%s:%x", rf->keyprefix, blocknum);
+    int64_t blocknum = offset / rf->blocksize;
+    memcpy(outkeyname, rf->keybase, rf->keybaselen);
+    int written = rf->keybaselen + _u64_to_hex(blocknum, outkeyname + rf->keybaselen);
+    outkeyname[written] = '\0';
 
     assert(written < REDISVFS_KEYBUFLEN);
     return written;
 }
 
+/* Field name of a block within the file's hash, for layout=hash.
+ * Never collides with the "size" or "blocksize" fields
+ * pre: outfield is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_blockfield(RedisFile *rf, int64_t offset, char *outfield) {
+    int64_t blocknum = offset / rf->blocksize;
+    int written = _u64_to_hex(blocknum, outfield);
+    outfield[written] = '\0';
+    return written;
+}
+
 /* emulate file size tracking by storing the max value stored
  * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
 static int get_filesizekey(RedisFile *rf, char *outkeyname) {
-    int written = snprintf(outkeyname, REDISVFS_KEYBUFLEN, "%s:filelen", rf->keyprefix);
+    memcpy(outkeyname, rf->metabase, rf->metabaselen);
+    memcpy(outkeyname + rf->metabaselen, "size", 5);
+    int written = rf->metabaselen + 4;
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* sqlite file locks (see locking)
+ * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_lockkey(RedisFile *rf, char *outkeyname) {
+    memcpy(outkeyname, rf->metabase, rf->metabaselen);
+    memcpy(outkeyname + rf->metabaselen, "lock", 5);
+    int written = rf->metabaselen + 4;
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* Per database block size, so later opens agree on the layout
+ * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_blocksizekey(RedisFile *rf, char *outkeyname) {
+    memcpy(outkeyname, rf->metabase, rf->metabaselen);
+    memcpy(outkeyname + rf->metabaselen, "blocksize", 10);
+    int written = rf->metabaselen + 9;
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* Block compression codec of a database (see block compression)
+ * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_codeckey(RedisFile *rf, char *outkeyname) {
+    memcpy(outkeyname, rf->metabase, rf->metabaselen);
+    memcpy(outkeyname + rf->metabaselen, "codec", 6);
+    int written = rf->metabaselen + 5;
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* Rollback journal segments (see journal storage) are this followed by
+ * the segment number in decimal
+ * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_segmentbase(RedisFile *rf, char *outkeyname) {
+    memcpy(outkeyname, rf->metabase, rf->metabaselen);
+    memcpy(outkeyname + rf->metabaselen, "seg", 4);
+    int written = rf->metabaselen + 3;
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* Journal segment holding offset
+ * pre: outkeyname is exactly REDISVFS_MAX_KEYLEN+1 bytes */
+static int get_segmentkey(RedisFile *rf, int64_t offset, char *outkeyname) {
+    int written = get_segmentbase(rf, outkeyname);
+    written += _u64_to_dec(offset / REDISVFS_JOURNAL_SEGMENT, outkeyname + written);
+    outkeyname[written] = '\0';
     assert(written < REDISVFS_KEYBUFLEN);
     return written;
 }
 
-static inline int64_t _start_of_block(int64_t offset) {
-        return offset - (offset % REDISVFS_BLOCKSIZE);
+/* Inverse of get_blockkey.  Returns the block number encoded in a key,
+ * or -1 if it isn't a block key belonging to this file */
+static int64_t get_blocknum_from_key(RedisFile *rf, const char *key, size_t keylen) {
+    if (keylen <= rf->keyprefixlen+1 || keylen > REDISVFS_MAX_KEYLEN)
+        return -1;
+    if (memcmp(key, rf->keyprefix, rf->keyprefixlen) != 0 || key[rf->keyprefixlen] != ':')
+        return -1;
+
+    int64_t blocknum = 0;
+    for (size_t i=rf->keyprefixlen+1; i<keylen; ++i) {
+        char c = key[i];
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else return -1;  // e.g. the size key
+        blocknum = (blocknum << 4) | digit;
+    }
+    return blocknum;
+}
+
+static inline int64_t _start_of_block(RedisFile *rf, int64_t offset) {
+        return offset - (offset % rf->blocksize);
 }
-static inline int64_t _start_of_next_block(int64_t offset) {
-        return _start_of_block(offset) + REDISVFS_BLOCKSIZE;
+static inline int64_t _start_of_next_block(RedisFile *rf, int64_t offset) {
+        return _start_of_block(rf, offset) + rf->blocksize;
 }
 
 // Only used if we nest too much evil macro expansion of the debugreply macros
@@ -56,196 +215,5581 @@ static inline void redis_debugreplyarray (const redisReply *reply) {
     for (int i=0; i<reply->elements; ++i) redis_debugreply(reply->element[i]);
 }
 
-/* Make it easier to play fast and loose with redis pipelining */
-static int redis_discard_replies(RedisFile *rf, int ndiscards) {
-    for (int i=0; i<ndiscards; ++i) {
-        redisReply *reply;
-        if (redisGetReply(rf->redisctx, (void **)&reply) != REDIS_OK)
-            return REDIS_ERR;
-#if 0
-        DLOG("DISCARDING REPLY:");
-        redis_debugreply(reply);
-#endif
+/* reply sink
+ *
+ * hiredis normally builds a redisReply for every block read, copying the
+ * payload out of its read buffer into a fresh allocation which we then
+ * copy again into sqlite's buffer.  Every connection gets a set of reply
+ * object functions that, while a sink is armed on the reader, copy a top
+ * level bulk string straight to where it belongs instead.  Everything
+ * else (errors, nils, pushes, arrays) is built by hiredis as usual.
+ */
+
+typedef struct RedisReplySink {
+    // Handed back by redisGetReply in place of an allocated reply.
+    // str points at dst, len is the full length redis sent
+    redisReply reply;
+    char *dst;
+    size_t cap;     // at most this much is copied to dst
+} RedisReplySink;
+
+// hiredis' own reply functions, which we fall back to
+static redisReplyObjectFunctions *redis_reply_fallback;
+
+static void *redis_sink_createString(const redisReadTask *task, char *str, size_t len) {
+    RedisReplySink *sink = task->privdata;
+    if (!sink || task->parent || task->type != REDIS_REPLY_STRING)
+        return redis_reply_fallback->createString(task, str, len);
+
+    memcpy(sink->dst, str, len < sink->cap ? len : sink->cap);
+    memset(&sink->reply, 0, sizeof(redisReply));
+    sink->reply.type = REDIS_REPLY_STRING;
+    sink->reply.str = sink->dst;
+    sink->reply.len = len;
+    return &sink->reply;
+}
+static void *redis_sink_createArray(const redisReadTask *task, size_t elements) {
+    return redis_reply_fallback->createArray(task, elements);
+}
+static void *redis_sink_createInteger(const redisReadTask *task, long long value) {
+    return redis_reply_fallback->createInteger(task, value);
+}
+static void *redis_sink_createDouble(const redisReadTask *task, double value, char *str, size_t len) {
+    return redis_reply_fallback->createDouble(task, value, str, len);
+}
+static void *redis_sink_createNil(const redisReadTask *task) {
+    return redis_reply_fallback->createNil(task);
+}
+static void *redis_sink_createBool(const redisReadTask *task, int bval) {
+    return redis_reply_fallback->createBool(task, bval);
+}
+static void redis_sink_freeObject(void *reply) {
+    // A sink reply is complete as soon as it is created, so the reader
+    // never holds one it would need to free
+    redis_reply_fallback->freeObject(reply);
+}
+
+static redisReplyObjectFunctions redis_sink_functions = {
+    redis_sink_createString,
+    redis_sink_createArray,
+    redis_sink_createInteger,
+    redis_sink_createDouble,
+    redis_sink_createNil,
+    redis_sink_createBool,
+    redis_sink_freeObject,
+};
+
+static void redis_sink_install(redisContext *ctx) {
+    if (ctx->reader->fn == &redis_sink_functions)
+        return;
+    // Always hiredis' static default table, whichever context it came from
+    if (!redis_reply_fallback)
+        redis_reply_fallback = ctx->reader->fn;
+    ctx->reader->fn = &redis_sink_functions;
+    ctx->reader->privdata = NULL;
+}
+
+/* Read the next reply.  A bulk string goes to dst (up to cap bytes) and
+ * the reply returned is then &sink->reply, which must not be freed */
+static int redis_get_reply_into(redisContext *ctx, RedisReplySink *sink,
+        char *dst, size_t cap, redisReply **reply) {
+    sink->dst = dst;
+    sink->cap = cap;
+    ctx->reader->privdata = sink;
+    int ret = redisGetReply(ctx, (void **)reply);
+    ctx->reader->privdata = NULL;
+    return ret;
+}
+
+static inline void redis_reply_release(RedisReplySink *sink, redisReply *reply) {
+    if (reply != &sink->reply)
         freeReplyObject(reply);
-    }
-    return REDIS_OK;
 }
 
 
-/* redis blockio */
+/* I/O statistics
+ *
+ * Every command sent and reply read for a file goes through here or
+ * through the RESP encoder, so counting is a few additions per command.
+ * A round trip is counted when a reply is read with commands still
+ * unanswered that were sent since the last one, so a pipeline of any
+ * length is one.  Files add their counts to the VFS totals (under the
+ * same static mutex as the reclaim totals) from time to time rather than
+ * taking a lock per command.
+ */
 
-static int redis_queuecmd_whole_block_read(RedisFile *rf, const sqlite3_int64 offset) {
-    assert((offset % REDISVFS_BLOCKSIZE) == 0);
+static RedisIOStats redis_vfs_iostats;
 
-    char key[REDISVFS_KEYBUFLEN];
-    int keylen = get_blockkey(rf, offset, key);
+static inline void redis_iostats_sent(RedisFile *rf, size_t len) {
+    rf->iostats.bytes_out += len;
+    rf->iowaiting = true;
+}
 
-    return redisAppendCommandArgv(rf->redisctx, 2,
-            (const char *[]){ "GET", key },
-            (const size_t[]){ 3, keylen });
+static size_t _reply_size(const redisReply *reply) {
+    size_t n = reply->str ? reply->len : 0;
+    for (size_t i=0; i<reply->elements; ++i)
+        n += _reply_size(reply->element[i]);
+    return n;
 }
 
-/* caller is saying filesize is at least 'minfilesize'
- * appends 2 commands */
-static int redis_queue_increase_filesize_to(RedisFile *rf, int64_t minfilesize) {
-    char key[REDISVFS_KEYBUFLEN];
-    get_filesizekey(rf, key);
+static inline void redis_iostats_reply(RedisFile *rf, const redisReply *reply) {
+    if (rf->iowaiting) {
+        rf->iostats.round_trips++;
+        rf->iowaiting = false;
+    }
+    rf->iostats.bytes_in += _reply_size(reply);
+}
 
-    // We store filesize in an ordered set
-    //
-    // To get the filesize we peek the item with the highest cardinality
-    //
-    // If we have a lower bound on filesize, we just add the bound to the
-    // ordered set, and then remove (trim) all but the highest cardinality item.
-    //
-    // As the trim is both optional, and safe to rerun, there is no race with
-    // multiple interleved calls
-    int ret = redisAppendCommand(rf->redisctx, "ZADD %s %d %d", key, minfilesize, minfilesize);
-    if (ret == REDIS_ERR)
-        return ret;
+/* One call to a file method that started at start (us, monotonic) */
+static void redis_iostats_time(RedisLatencyStats *lat, sqlite3_int64 start) {
+    sqlite3_int64 us = _now_us() - start;
+    int bucket = 0;
+    while (bucket < REDISVFS_LATENCY_BUCKETS-1 && (us >> (bucket+1)) > 0)
+        ++bucket;
+    lat->calls++;
+    lat->total_us += us;
+    if (us > lat->max_us)
+        lat->max_us = us;
+    lat->hist[bucket]++;
+}
 
-    // Trim to only largest entry
-    return redisAppendCommand(rf->redisctx, "ZREMRANGEBYRANK %s %d %d", key, 0, -2);
+static void _latency_fold(RedisLatencyStats *total, const RedisLatencyStats *now, RedisLatencyStats *then) {
+    total->calls += now->calls - then->calls;
+    total->total_us += now->total_us - then->total_us;
+    if (now->max_us > total->max_us)
+        total->max_us = now->max_us;
+    for (int i=0; i<REDISVFS_LATENCY_BUCKETS; ++i)
+        total->hist[i] += now->hist[i] - then->hist[i];
+}
 
+/* Add whatever the file has counted since it last did to the VFS totals */
+static void redis_iostats_fold(RedisFile *rf) {
+    RedisIOStats *now = &rf->iostats, *then = &rf->iofolded;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    sqlite3_mutex_enter(mutex);
+    redis_vfs_iostats.commands += now->commands - then->commands;
+    redis_vfs_iostats.round_trips += now->round_trips - then->round_trips;
+    redis_vfs_iostats.bytes_out += now->bytes_out - then->bytes_out;
+    redis_vfs_iostats.bytes_in += now->bytes_in - then->bytes_in;
+    redis_vfs_iostats.short_reads += now->short_reads - then->short_reads;
+    _latency_fold(&redis_vfs_iostats.read, &now->read, &then->read);
+    _latency_fold(&redis_vfs_iostats.write, &now->write, &then->write);
+    _latency_fold(&redis_vfs_iostats.sync, &now->sync, &then->sync);
+    _latency_fold(&redis_vfs_iostats.filesize, &now->filesize, &then->filesize);
+    sqlite3_mutex_leave(mutex);
+    *then = *now;
 }
-static int redis_consume_increase_filesize_to(RedisFile *rf) {
-    return redis_discard_replies(rf, 2);
+
+static void redis_get_iostats(RedisIOStats *stats) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    sqlite3_mutex_enter(mutex);
+    *stats = redis_vfs_iostats;
+    sqlite3_mutex_leave(mutex);
 }
 
-// WARNING: Don't use in pipeline
-// Returns 0 if the file doesnt exist
-static int64_t redis_get_filesize(RedisFile *rf) {
-    char key[REDISVFS_KEYBUFLEN];
-    get_filesizekey(rf, key);
 
-    redisReply *reply;
-    if ((reply = redisCommand(rf->redisctx, "ZREVRANGE %s 0 0", key)) == NULL) {
-            return REDIS_ERR;
-    }
-    redis_debugreply(reply);
+/* connection pool
+ *
+ * Every file open (each journal, and every xDelete) used to pay for a new
+ * TCP connection to redis.  Instead files borrow a connection from the VFS
+ * for as long as they are open, and give it back on close for the next
+ * open to the same endpoint.
+ */
 
-    int64_t filesize;
-    if (reply->type != REDIS_REPLY_ARRAY) {
-            filesize = -1;
-    } else if (reply->elements == 0) {
-            filesize = 0;
-    } else if (reply->element[0]->type != REDIS_REPLY_STRING) {
-            filesize = -1;
+/* Anything to read on a connection nobody is using means it was closed
+ * under us or is out of step with its replies */
+static bool redis_conn_idle_ok(redisContext *ctx) {
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    return !ctx->err && poll(&pfd, 1, 0) == 0;
+}
+
+/* Where and how to connect, from the database URI:
+ *
+ *   redis=unix:/path/to/redis.sock   colocated server over a unix socket
+ *   redis=host[:port]                TCP (default 127.0.0.1:6379)
+ *   connect_timeout=MS, timeout=MS   0 (the default) waits forever
+ *   tcp_nodelay=0|1                  default 1
+ *   keepalive=SECS                   TCP keepalive interval, 0 is off
+ */
+typedef struct RedisEndpoint {
+    char name[REDISVFS_MAX_ENDPOINTLEN+1];  // "unix:/path" or "host:port". Also the pool key
+    char host[REDISVFS_MAX_HOSTLEN+1];
+    int port;
+    const char *unixpath;   // points into name, or NULL for TCP
+    int connect_timeout_ms;
+    int timeout_ms;
+    int keepalive;
+    bool nodelay;
+} RedisEndpoint;
+
+static int redis_endpoint_from_uri(const char *zName, RedisEndpoint *ep) {
+    memset(ep, 0, sizeof(RedisEndpoint));
+    snprintf(ep->host, sizeof(ep->host), "%s", REDISVFS_DEFAULT_HOST);
+    ep->port = REDISVFS_DEFAULT_PORT;
+
+    const char *redis = sqlite3_uri_parameter(zName, "redis");
+    if (redis && strncmp(redis, "unix:", 5) == 0) {
+        if (redis[5] == '\0' || strlen(redis) > REDISVFS_MAX_ENDPOINTLEN)
+            return REDIS_ERR;
+        snprintf(ep->name, sizeof(ep->name), "%s", redis);
+        ep->unixpath = ep->name + 5;
     } else {
-            filesize = atoll(reply->element[0]->str);
+        if (redis && *redis) {
+            const char *colon = strrchr(redis, ':');
+            size_t hostlen = colon ? (size_t)(colon - redis) : strlen(redis);
+            if (hostlen > REDISVFS_MAX_HOSTLEN)
+                return REDIS_ERR;
+            if (hostlen > 0) {
+                memcpy(ep->host, redis, hostlen);
+                ep->host[hostlen] = '\0';
+            }
+            if (colon) {
+                char *end;
+                long port = strtol(colon+1, &end, 10);
+                if (*end != '\0' || port <= 0 || port > 65535)
+                    return REDIS_ERR;
+                ep->port = port;
+            }
+        }
+        if (snprintf(ep->name, sizeof(ep->name), "%s:%d", ep->host, ep->port) >= (int)sizeof(ep->name))
+            return REDIS_ERR;
     }
-    freeReplyObject(reply);
-    return filesize;
+
+    ep->connect_timeout_ms = sqlite3_uri_int64(zName, "connect_timeout", 0);
+    ep->timeout_ms = sqlite3_uri_int64(zName, "timeout", 0);
+    ep->keepalive = sqlite3_uri_int64(zName, "keepalive", 0);
+    ep->nodelay = sqlite3_uri_boolean(zName, "tcp_nodelay", 1);
+    if (ep->connect_timeout_ms < 0 || ep->timeout_ms < 0 || ep->keepalive < 0)
+        return REDIS_ERR;
+    return REDIS_OK;
 }
 
-static int64_t redis_force_set_filesize(RedisFile *rf, int64_t filesize) {
-    assert(filesize >= 0);
-    char key[REDISVFS_KEYBUFLEN];
-    get_filesizekey(rf, key);
+static struct timeval _ms_to_timeval(int ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    return tv;
+}
 
-    if (redisAppendCommand(rf->redisctx, "MULTI") == REDIS_ERR)
+/* Per-open settings.  Applied every time a connection is handed out, as
+ * a pooled connection may have been set up by a file with a different URI */
+static int redis_conn_configure(redisContext *ctx, const RedisEndpoint *ep) {
+    if (redisSetTimeout(ctx, _ms_to_timeval(ep->timeout_ms)) != REDIS_OK)
         return REDIS_ERR;
-    if (redisAppendCommand(rf->redisctx, "DEL %s", key) == REDIS_ERR)
-        return REDIS_ERR;
-    if (redis_queue_increase_filesize_to(rf, filesize) == REDIS_ERR)
+    if (ep->unixpath)
+        return REDIS_OK;
+
+    int nodelay = ep->nodelay;
+    if (setsockopt(ctx->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) != 0)
         return REDIS_ERR;
-    if (redisAppendCommand(rf->redisctx, "EXEC") == REDIS_ERR)
+    if (ep->keepalive > 0) {
+#if HIREDIS_MAJOR > 1 || (HIREDIS_MAJOR == 1 && HIREDIS_MINOR >= 1)
+        return redisEnableKeepAliveWithInterval(ctx, ep->keepalive);
+#else
+        return redisEnableKeepAlive(ctx);
+#endif
+    }
+    int off = 0;
+    if (setsockopt(ctx->fd, SOL_SOCKET, SO_KEEPALIVE, &off, sizeof(off)) != 0)
         return REDIS_ERR;
+    return REDIS_OK;
+}
+
+static redisContext *redis_connect(const RedisEndpoint *ep) {
+    redisOptions options = {0};
+    struct timeval connect_tv = _ms_to_timeval(ep->connect_timeout_ms);
+    if (ep->unixpath)
+        REDIS_OPTIONS_SET_UNIX(&options, ep->unixpath);
+    else
+        REDIS_OPTIONS_SET_TCP(&options, ep->host, ep->port);
+    if (ep->connect_timeout_ms > 0)
+        options.connect_timeout = &connect_tv;
+    redisContext *ctx = redisConnectWithOptions(&options);
+    if (ctx && !ctx->err)
+        redis_sink_install(ctx);
+    return ctx;
+}
+
+static redisContext *redis_pool_get(RedisConnPool *pool, const RedisEndpoint *ep) {
+    redisContext *ctx = NULL;
+
+    sqlite3_mutex_enter(pool->mutex);
+    struct RedisPooledConn **pp = &pool->idle;
+    while (*pp) {
+        struct RedisPooledConn *conn = *pp;
+        if (strcmp(conn->endpoint, ep->name) != 0) {
+            pp = &conn->next;
+            continue;
+        }
+        *pp = conn->next;
+        pool->nidle--;
+
+        ctx = conn->ctx;
+        sqlite3_free(conn);
+        if (redis_conn_idle_ok(ctx)) {
+            DLOG("reusing connection to %s", ep->name);
+            break;
+        }
+        DLOG("dropping stale connection to %s", ep->name);
+        redisFree(ctx);
+        ctx = NULL;
+    }
+    sqlite3_mutex_leave(pool->mutex);
+
+    if (!ctx) {
+        DLOG("connecting to %s", ep->name);
+        ctx = redis_connect(ep);
+    }
+    if (ctx && !ctx->err && redis_conn_configure(ctx, ep) != REDIS_OK && !ctx->err) {
+        ctx->err = REDIS_ERR_IO;
+        snprintf(ctx->errstr, sizeof(ctx->errstr), "unable to set socket options on %.80s", ep->name);
+    }
+    return ctx;
+}
+
+static void redis_push_discard(void *privdata, void *reply) {
+    freeReplyObject(reply);
+}
+
+/* Give a connection back.  Anything that looks unhealthy is closed */
+static void redis_pool_put(RedisConnPool *pool, redisContext *ctx, const char *endpoint) {
+    // Whatever file was using it is going away
+    ctx->privdata = NULL;
+    redisSetPushCallback(ctx, redis_push_discard);
+
+    struct RedisPooledConn *conn = NULL;
+    if (redis_conn_idle_ok(ctx))
+        conn = sqlite3_malloc(sizeof(struct RedisPooledConn));
+    if (conn) {
+        conn->ctx = ctx;
+        snprintf(conn->endpoint, REDISVFS_MAX_ENDPOINTLEN+1, "%s", endpoint);
+
+        sqlite3_mutex_enter(pool->mutex);
+        if (pool->nidle < REDISVFS_POOL_MAX_IDLE) {
+            conn->next = pool->idle;
+            pool->idle = conn;
+            pool->nidle++;
+            ctx = NULL;
+        }
+        sqlite3_mutex_leave(pool->mutex);
+    }
+    if (ctx) {
+        sqlite3_free(conn);
+        redisFree(ctx);
+    }
+}
+
+
+/* shared connection
+ *
+ * mux=1 has every file on an endpoint share one connection, rather than
+ * borrow one each, so a server sees one connection per process however
+ * many threads have databases open.  The connection belongs to a thread
+ * of its own.  A file's flush is one request, pushed onto a lock-free
+ * stack for the I/O thread, and the file waits on the request for its
+ * replies.  Requests go out behind whatever is already on the wire, so
+ * files in different threads share round trips rather than taking turns.
+ * Replies come back in order and are matched to requests by counting.
+ *
+ * To a file it looks like a connection of its own: commands are queued,
+ * flush sends them and replies are taken in order.  A shared connection
+ * has no CLIENT TRACKING, so there is no block cache or read-ahead, and
+ * io_conns and cluster=1 don't apply.  When the connection fails, every
+ * request on it fails, and the next request connects again.
+ */
+
+struct RedisMuxReq {
+    struct RedisMuxReq *next;       // submitted, then in flight
+    struct RedisMuxReq *filenext;   // the file's requests, oldest first
+    RedisMuxConn *conn;
+    const char *cmd;
+    size_t len;
+    int ncmds;
+    int nreplies;   // read by the I/O thread
+    int taken;      // handed to the file
+    bool done;      // under the file's mutex
+    bool failed;
+    redisReply *replies[];
+};
+
+struct RedisMux {
+    struct RedisMux *next;
+    int refs;       // files using it.  Both under the pool's muxmutex
+    RedisConnPool *pool;
+    RedisEndpoint ep;   // as the first file to open it asked for
+
+    // Newest first.  Files push with a CAS, and the I/O thread takes
+    // the lot.  The file that finds it empty wakes the I/O thread
+    struct RedisMuxReq *submitted;
+    int wake[2];
+    bool stop;
+    pthread_t thread;
+
+    // The I/O thread's own
+    redisContext *ctx;
+    struct RedisMuxReq *inflight, *inflighttail;
+    bool unsent;    // commands buffered on ctx
+};
+
+struct RedisMuxConn {
+    struct RedisMux *mux;
+    int ncmds;      // encoded since the last resp_end
+    // Queued since the last flush
+    char *buf;
+    size_t len, cap;
+    int nqueued;
+    // Flushed, with replies still to be taken
+    struct RedisMuxReq *head, *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void _mux_nonblock(redisContext *ctx, bool on) {
+    int flags = fcntl(ctx->fd, F_GETFL);
+    fcntl(ctx->fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    if (on)
+        ctx->flags &= ~REDIS_BLOCK;
+    else
+        ctx->flags |= REDIS_BLOCK;
+}
+
+static void _mux_wake(struct RedisMux *mux) {
+    char c = 0;
+    while (write(mux->wake[1], &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+/* The I/O thread is done with req once this returns */
+static void _mux_complete(struct RedisMuxReq *req, bool failed) {
+    RedisMuxConn *mc = req->conn;
+    pthread_mutex_lock(&mc->mutex);
+    req->failed = failed;
+    req->done = true;
+    pthread_cond_signal(&mc->cond);
+    pthread_mutex_unlock(&mc->mutex);
+}
+
+/* Drop the connection and fail everything sent on it */
+static void _mux_fail(struct RedisMux *mux) {
+    if (mux->ctx) {
+        DLOG("shared connection to %s failed: %s", mux->ep.name, mux->ctx->errstr);
+        redisFree(mux->ctx);
+        mux->ctx = NULL;
+    }
+    mux->unsent = false;
+    while (mux->inflight) {
+        struct RedisMuxReq *req = mux->inflight;
+        mux->inflight = req->next;
+        _mux_complete(req, true);
+    }
+    mux->inflighttail = NULL;
+}
+
+/* Put everything submitted since last time on the connection, oldest first */
+static void _mux_take_submitted(struct RedisMux *mux) {
+    struct RedisMuxReq *req = __atomic_exchange_n(&mux->submitted, NULL, __ATOMIC_ACQUIRE);
+    struct RedisMuxReq *oldest = NULL;
+    while (req) {
+        struct RedisMuxReq *next = req->next;
+        req->next = oldest;
+        oldest = req;
+        req = next;
+    }
+    while ((req = oldest)) {
+        oldest = req->next;
+        req->next = NULL;
+        if (!mux->ctx) {
+            mux->ctx = redis_pool_get(mux->pool, &mux->ep);
+            if (mux->ctx && !mux->ctx->err) {
+                _mux_nonblock(mux->ctx, true);
+            } else {
+                _mux_fail(mux);
+                _mux_complete(req, true);
+                continue;
+            }
+        }
+        if (redisAppendFormattedCommand(mux->ctx, req->cmd, req->len) != REDIS_OK) {
+            _mux_complete(req, true);
+            continue;
+        }
+        if (mux->inflighttail)
+            mux->inflighttail->next = req;
+        else
+            mux->inflight = req;
+        mux->inflighttail = req;
+        mux->unsent = true;
+    }
+}
 
-    // TODO: Actually check return codes.  Ignore if DEL fails.
-    if (redis_discard_replies(rf, 2) == REDIS_ERR)  // MULTI,DEL
+static int _mux_write(struct RedisMux *mux) {
+    int done = 0;
+    if (redisBufferWrite(mux->ctx, &done) != REDIS_OK)
         return REDIS_ERR;
-    if (redis_consume_increase_filesize_to(rf))
+    mux->unsent = !done;
+    return REDIS_OK;
+}
+
+/* Read what has arrived and complete every request it finishes */
+static int _mux_read(struct RedisMux *mux) {
+    if (redisBufferRead(mux->ctx) != REDIS_OK)
         return REDIS_ERR;
-    if (redis_discard_replies(rf, 1) == REDIS_ERR)  // EXEC
+    for (;;) {
+        void *reply;
+        if (redisReaderGetReply(mux->ctx->reader, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (!reply)
+            return REDIS_OK;
+        struct RedisMuxReq *req = mux->inflight;
+        if (!req) {
+            // Out of step.  Nothing more on it can be trusted
+            freeReplyObject(reply);
+            return REDIS_ERR;
+        }
+        req->replies[req->nreplies++] = reply;
+        if (req->nreplies == req->ncmds) {
+            if (!(mux->inflight = req->next))
+                mux->inflighttail = NULL;
+            _mux_complete(req, false);
+        }
+    }
+}
+
+static void *redis_mux_thread(void *arg) {
+    struct RedisMux *mux = arg;
+    for (;;) {
+        _mux_take_submitted(mux);
+        if (mux->unsent && _mux_write(mux) != REDIS_OK)
+            _mux_fail(mux);
+        if (!mux->inflight && __atomic_load_n(&mux->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        struct pollfd pfds[2] = {
+            { .fd = mux->wake[0], .events = POLLIN },
+            { .fd = mux->inflight ? mux->ctx->fd : -1, .events = POLLIN | (mux->unsent ? POLLOUT : 0) },
+        };
+        // timeout= is how long to go without hearing back
+        int timeout = mux->inflight && mux->ep.timeout_ms > 0 ? mux->ep.timeout_ms : -1;
+        int ready = poll(pfds, 2, timeout);
+        if (ready < 0)
+            continue;
+        if (ready == 0) {
+            _mux_fail(mux);
+            continue;
+        }
+        if (pfds[0].revents) {
+            char drain[64];
+            while (read(mux->wake[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if ((pfds[1].revents & POLLOUT) && _mux_write(mux) != REDIS_OK)
+            _mux_fail(mux);
+        if (mux->ctx && (pfds[1].revents & (POLLIN|POLLERR|POLLHUP)) && _mux_read(mux) != REDIS_OK)
+            _mux_fail(mux);
+    }
+    return NULL;
+}
+
+/* pre: stopped, or never started */
+static void redis_mux_destroy(struct RedisMux *mux) {
+    if (mux->ctx) {
+        _mux_nonblock(mux->ctx, false);
+        redis_pool_put(mux->pool, mux->ctx, mux->ep.name);
+    }
+    if (mux->wake[0] >= 0)
+        close(mux->wake[0]);
+    if (mux->wake[1] >= 0)
+        close(mux->wake[1]);
+    sqlite3_free(mux);
+}
+
+/* Connect, and start the I/O thread.  pre: pool muxmutex held */
+static struct RedisMux *redis_mux_create(RedisConnPool *pool, const RedisEndpoint *ep) {
+    struct RedisMux *mux = sqlite3_malloc64(sizeof(struct RedisMux));
+    if (!mux)
+        return NULL;
+    memset(mux, 0, sizeof(struct RedisMux));
+    mux->pool = pool;
+    mux->ep = *ep;
+    mux->refs = 1;
+    mux->wake[0] = mux->wake[1] = -1;
+
+    mux->ctx = redis_pool_get(pool, ep);
+    if (!mux->ctx || mux->ctx->err) {
+        if (mux->ctx) {
+            fprintf(stderr, "%s: Error: %s\n", __func__, mux->ctx->errstr);
+            redisFree(mux->ctx);
+            mux->ctx = NULL;
+        }
+        redis_mux_destroy(mux);
+        return NULL;
+    }
+    _mux_nonblock(mux->ctx, true);
+    if (pipe(mux->wake) != 0) {
+        mux->wake[0] = mux->wake[1] = -1;
+        redis_mux_destroy(mux);
+        return NULL;
+    }
+    for (int i=0; i<2; ++i) {
+        fcntl(mux->wake[i], F_SETFL, fcntl(mux->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(mux->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (pthread_create(&mux->thread, NULL, redis_mux_thread, mux) != 0) {
+        redis_mux_destroy(mux);
+        return NULL;
+    }
+    DLOG("shared connection to %s", ep->name);
+    return mux;
+}
+
+/* The endpoint's shared connection, made if nobody has it open */
+static struct RedisMux *redis_mux_get(RedisConnPool *pool, const RedisEndpoint *ep) {
+    sqlite3_mutex_enter(pool->muxmutex);
+    struct RedisMux *mux = pool->muxes;
+    while (mux && strcmp(mux->ep.name, ep->name) != 0)
+        mux = mux->next;
+    if (mux) {
+        mux->refs++;
+    } else if ((mux = redis_mux_create(pool, ep))) {
+        mux->next = pool->muxes;
+        pool->muxes = mux;
+    }
+    sqlite3_mutex_leave(pool->muxmutex);
+    return mux;
+}
+
+/* The last file to let go stops the I/O thread */
+static void redis_mux_put(struct RedisMux *mux) {
+    RedisConnPool *pool = mux->pool;
+    sqlite3_mutex_enter(pool->muxmutex);
+    bool last = --mux->refs == 0;
+    if (last) {
+        struct RedisMux **pp = &pool->muxes;
+        while (*pp != mux)
+            pp = &(*pp)->next;
+        *pp = mux->next;
+    }
+    sqlite3_mutex_leave(pool->muxmutex);
+    if (!last)
+        return;
+    __atomic_store_n(&mux->stop, true, __ATOMIC_RELEASE);
+    _mux_wake(mux);
+    pthread_join(mux->thread, NULL);
+    redis_mux_destroy(mux);
+}
+
+/* Queue commands already in RESP, to go with the next flush */
+static int redis_mux_append(RedisMuxConn *mc, const char *cmd, size_t len, int ncmds) {
+    if (mc->len + len > mc->cap) {
+        size_t cap = mc->cap ? mc->cap : 1024;
+        while (cap < mc->len + len)
+            cap *= 2;
+        char *buf = sqlite3_realloc64(mc->buf, cap);
+        if (!buf)
+            return REDIS_ERR;
+        mc->buf = buf;
+        mc->cap = cap;
+    }
+    memcpy(mc->buf + mc->len, cmd, len);
+    mc->len += len;
+    mc->nqueued += ncmds;
+    return REDIS_OK;
+}
+
+/* Hand everything queued to the I/O thread as one request */
+static int redis_mux_flush(RedisMuxConn *mc) {
+    if (mc->nqueued == 0)
+        return REDIS_OK;
+    int ncmds = mc->nqueued;
+    size_t len = mc->len;
+    mc->nqueued = 0;
+    mc->len = 0;
+    struct RedisMuxReq *req = sqlite3_malloc64(sizeof(struct RedisMuxReq) + ncmds * sizeof(redisReply *) + len);
+    if (!req)
         return REDIS_ERR;
+    memset(req, 0, sizeof(struct RedisMuxReq));
+    req->conn = mc;
+    req->ncmds = ncmds;
+    req->cmd = memcpy(req->replies + ncmds, mc->buf, len);
+    req->len = len;
+    if (mc->tail)
+        mc->tail->filenext = req;
+    else
+        mc->head = req;
+    mc->tail = req;
 
+    struct RedisMux *mux = mc->mux;
+    struct RedisMuxReq *top = __atomic_load_n(&mux->submitted, __ATOMIC_RELAXED);
+    do {
+        req->next = top;
+    } while (!__atomic_compare_exchange_n(&mux->submitted, &top, req, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!top)
+        _mux_wake(mux);
     return REDIS_OK;
 }
 
+static void _mux_req_free(struct RedisMuxReq *req) {
+    for (int i=req->taken; i<req->nreplies; ++i)
+        freeReplyObject(req->replies[i]);
+    sqlite3_free(req);
+}
 
-// NO PIPELINING HANDLED.   Don't call it unless you are
-// sure  there are no other commands sent before or after
-// without appropriate compartmentalisation
-//
-// FIXME: if we're not going to pipeline, just use redisCommand
-static bool redis_does_block_exist(RedisFile *rf, int64_t offset) {
-    assert((offset % REDISVFS_BLOCKSIZE) == 0);
+static void _mux_wait(RedisMuxConn *mc, struct RedisMuxReq *req) {
+    pthread_mutex_lock(&mc->mutex);
+    while (!req->done)
+        pthread_cond_wait(&mc->cond, &mc->mutex);
+    pthread_mutex_unlock(&mc->mutex);
+}
 
-    char key[REDISVFS_KEYBUFLEN];
-    int keylen = get_blockkey(rf, offset, key);
+/* Next reply, sending anything still queued first */
+static int redis_mux_reply(RedisMuxConn *mc, redisReply **reply) {
+    if (redis_mux_flush(mc) != REDIS_OK)
+        return REDIS_ERR;
+    struct RedisMuxReq *req = mc->head;
+    if (!req)
+        return REDIS_ERR;
+    _mux_wait(mc, req);
 
-    if (redisAppendCommandArgv(rf->redisctx, 2,
-           (const char *[]){ "EXISTS", key },
-           (const size_t[]){ 6, keylen }) != REDIS_OK) {
-        return false;
-    };
-    bool exists = false;
-    redisReply *reply;
-    if (redisGetReply(rf->redisctx, (void**)&reply) == REDIS_OK) {
-        if (reply->type == REDIS_REPLY_INTEGER) {
-            DLOG("Redis INT: %lld", reply->integer);
-            exists = reply->integer == 1;
-        } else { DLOG("Redis something else"); }
+    int ret = REDIS_ERR;
+    if (!req->failed) {
+        *reply = req->replies[req->taken++];
+        ret = REDIS_OK;
+    }
+    // A failed request has no more to give
+    if (req->failed || req->taken == req->ncmds) {
+        if (!(mc->head = req->filenext))
+            mc->tail = NULL;
+        _mux_req_free(req);
     }
-    return exists;
+    return ret;
 }
 
-/* pre: buf is >= REDISVFS_BLOCKSIZE */
-static int redis_queuecmd_whole_block_write(RedisFile *rf, int64_t offset, const char *buf) {
-    assert((offset % REDISVFS_BLOCKSIZE) == 0);
+/* A reply the I/O thread read, handed back as though through the sink */
+static void redis_mux_sink(RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    redisReply *r = *reply;
+    if (r->type != REDIS_REPLY_STRING)
+        return;
+    memcpy(dst, r->str, r->len < cap ? r->len : cap);
+    memset(&sink->reply, 0, sizeof(redisReply));
+    sink->reply.type = REDIS_REPLY_STRING;
+    sink->reply.str = dst;
+    sink->reply.len = r->len;
+    freeReplyObject(r);
+    *reply = &sink->reply;
+}
 
-    char key[REDISVFS_KEYBUFLEN];
-    int keylen = get_blockkey(rf, offset, key);
+static int redis_mux_open(RedisFile *rf, const RedisEndpoint *ep) {
+    RedisMuxConn *mc = sqlite3_malloc64(sizeof(RedisMuxConn));
+    if (!mc)
+        return REDIS_ERR;
+    memset(mc, 0, sizeof(RedisMuxConn));
+    if (!(mc->mux = redis_mux_get(rf->pool, ep))) {
+        sqlite3_free(mc);
+        return REDIS_ERR;
+    }
+    pthread_mutex_init(&mc->mutex, NULL);
+    pthread_cond_init(&mc->cond, NULL);
+    rf->mux = mc;
+    return REDIS_OK;
+}
 
-    return redisAppendCommandArgv(rf->redisctx, 3,
-            (const char *[]){ "SET", key, buf },
-            (const size_t[]){ 3, keylen, REDISVFS_BLOCKSIZE });
+/* Replies nobody took are waited for (the I/O thread still has them) */
+static void redis_mux_close(RedisFile *rf) {
+    RedisMuxConn *mc = rf->mux;
+    while (mc->head) {
+        struct RedisMuxReq *req = mc->head;
+        mc->head = req->filenext;
+        _mux_wait(mc, req);
+        _mux_req_free(req);
+    }
+    redis_mux_put(mc->mux);
+    pthread_mutex_destroy(&mc->mutex);
+    pthread_cond_destroy(&mc->cond);
+    sqlite3_free(mc->buf);
+    sqlite3_free(mc);
+    rf->mux = 0;
 }
 
-static int redis_queuecmd_partial_block_read(RedisFile *rf, int64_t offset, int64_t len) {
-    // GETRANGE range is inclusive of first and last indices
-    int64_t block_first = offset % REDISVFS_BLOCKSIZE;
-    int64_t block_last = block_first + len - 1;
 
-    assert(len > 0);
-    assert(block_last < REDISVFS_BLOCKSIZE);
+/* redisAppendFormattedCommand on ctx, or the file's own connection if
+ * that's NULL, counted */
+static int redis_append_formatted(RedisFile *rf, redisContext *ctx, const char *cmd, size_t len) {
+    int ret;
+    if (ctx)
+        ret = redisAppendFormattedCommand(ctx, cmd, len);
+    else if (rf->mux)
+        ret = redis_mux_append(rf->mux, cmd, len, 1);
+    else
+        ret = redisAppendFormattedCommand(rf->redisctx, cmd, len);
+    if (ret == REDIS_OK) {
+        rf->iostats.commands++;
+        redis_iostats_sent(rf, len);
+    }
+    return ret;
+}
 
+/* redisGetReply on the same, counted */
+static int redis_read_reply(RedisFile *rf, redisContext *ctx, redisReply **reply) {
+    int ret;
+    if (ctx)
+        ret = redisGetReply(ctx, (void **)reply);
+    else if (rf->mux)
+        ret = redis_mux_reply(rf->mux, reply);
+    else
+        ret = redisGetReply(rf->redisctx, (void **)reply);
+    if (ret == REDIS_OK)
+        redis_iostats_reply(rf, *reply);
+    return ret;
+}
 
-    char key[REDISVFS_KEYBUFLEN];
-    get_blockkey(rf, offset, key);
+/* redisAppendCommand on the file's own connection, counted */
+static int redis_vappend_command(RedisFile *rf, const char *fmt, va_list ap) {
+    char *cmd;
+    int len = redisvFormatCommand(&cmd, fmt, ap);
+    if (len < 0)
+        return REDIS_ERR;
+    int ret = redis_append_formatted(rf, NULL, cmd, len);
+    redisFreeCommand(cmd);
+    return ret;
+}
 
-    return redisAppendCommand(rf->redisctx, "GETRANGE %s %d %d", key, block_first, block_last);
+static int redis_append_command(RedisFile *rf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = redis_vappend_command(rf, fmt, ap);
+    va_end(ap);
+    return ret;
 }
 
-static int redis_queuecmd_partial_block_write(RedisFile *rf, int64_t offset, const char *buf, int64_t len) {
-    assert(len > 0);
-    int64_t block_first = offset % REDISVFS_BLOCKSIZE;
-    assert((block_first + len) <= REDISVFS_BLOCKSIZE);
+/* redisCommand on the file's own connection, counted */
+static redisReply *redis_command(RedisFile *rf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = redis_vappend_command(rf, fmt, ap);
+    va_end(ap);
+    redisReply *reply;
+    if (ret != REDIS_OK || redis_read_reply(rf, NULL, &reply) != REDIS_OK)
+        return NULL;
+    return reply;
+}
 
-    char key[REDISVFS_KEYBUFLEN];
-    int keylen = get_blockkey(rf, offset, key);
-    char block_offsetstr[32];
-    snprintf(block_offsetstr, 32, "%ld", block_first);
 
-    DLOG("SETRANGE %s %s ...(len %ld)",key, block_offsetstr, len);
-    return redisAppendCommandArgv(rf->redisctx, 4,
-            (const char *[]){ "SETRANGE", key, block_offsetstr, buf },
-            (const size_t[]){ 8, keylen, strlen(block_offsetstr), len });
-}
+/* cluster
+ *
+ * cluster=1 spreads a file's blocks over the masters of a Redis Cluster.
+ * The redis= node is only asked for the slot map.  Block keys hash to
+ * slots as usual, so the blocks of a file end up on every node.  The
+ * length, block size, codec, lock and wal-index keys are named
+ * "{<prefix>}:..." instead, which puts them all in the slot of the hash
+ * tag.  The node owning that slot is the file's home: rf->redisctx is
+ * connected to it, so the scripts that update several of those keys at
+ * once (and layout=hash, which is a single key) run as on a single server.
+ *
+ * Each block command is appended to the connection of the node owning the
+ * block, and the node noted.  Every connection with commands waiting is
+ * written out before we wait for the first reply, so a multi-block read
+ * or write is a pipeline per node with all of them in flight at once.
+ * Replies are then taken from each connection in the order the commands
+ * were queued.
+ *
+ * The bytes of every command queued are kept until its reply is read.  A
+ * slot that has moved comes back as a MOVED or ASK error, and the command
+ * is sent once more to the node named, after ASKING for ASK, on a pooled
+ * connection of its own as the node's may still have replies to come.
+ * MOVED also points the slot at that node if we know it, and the whole
+ * map is loaded again at the next lock from NONE.  Commands sent straight
+ * to the home node (redis_command and friends) aren't kept, so a
+ * redirect of those still fails the operation.
+ */
 
+struct RedisClusterNode {
+    char endpoint[REDISVFS_MAX_ENDPOINTLEN+1];
+    redisContext *ctx;      // NULL for the home node, which is rf->redisctx
+    bool unsent;            // commands appended and not written out yet
+};
 
-static int redis_queuecmd_delete_block(RedisFile *rf, sqlite3_int64 offset) {
-    assert((offset % REDISVFS_BLOCKSIZE) == 0);
+struct RedisCluster {
+    RedisEndpoint ep;       // connection settings from the URI
+    int nnodes;
+    struct RedisClusterNode nodes[REDISVFS_CLUSTER_MAX_NODES];
+    uint8_t slotnode[REDISVFS_CLUSTER_SLOTS];  // 0xff if the slot has no master
+    int home;
+    bool stale;             // a slot moved since the map was loaded
 
-    char key[REDISVFS_KEYBUFLEN];
-    int keylen = get_blockkey(rf, offset, key);
+    // io_conns=K: the nodes are K connections to one server and there is
+    // no slot map (see parallel I/O).  0 for cluster=1
+    int nlanes;
 
-    return redisAppendCommandArgv(rf->redisctx, 2,
-            (const char *[]){ "DEL", key },
-            (const size_t[]){ 3, keylen });
+    // Node for the commands being encoded (-1 for home), and how many
+    int route;
+    int ncmds;
+
+    // Node of every command queued and not replied to yet, oldest first
+    uint8_t *order;
+    int norder;
+    int orderhead;
+    int ordercap;
+
+    // cluster=1: the same commands' bytes, and where each starts, so a
+    // redirected one can be sent again.  last is the order index of the
+    // reply being read, or -1 if it isn't one of them
+    char *sent;
+    size_t sentlen;
+    size_t sentcap;
+    size_t *sentoff;
+    int last;
+};
+
+/* Slot of a key: CRC16 (XMODEM) of the key, or of its hash tag */
+static unsigned redis_cluster_slot(const char *key, size_t keylen) {
+    const char *open = memchr(key, '{', keylen);
+    if (open) {
+        const char *close = memchr(open+1, '}', keylen - (open+1 - key));
+        if (close && close > open+1) {
+            key = open+1;
+            keylen = close - key;
+        }
+    }
+    uint16_t crc = 0;
+    for (size_t i=0; i<keylen; ++i) {
+        crc ^= (uint16_t)(uint8_t)key[i] << 8;
+        for (int bit=0; bit<8; ++bit)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc & (REDISVFS_CLUSTER_SLOTS-1);
+}
+
+/* cluster=1, rather than io_conns=K connections to a single server */
+static inline bool _cluster_mode(RedisFile *rf) {
+    return rf->cluster && !rf->cluster->nlanes;
+}
+
+static inline redisContext *_cluster_ctx(RedisFile *rf, int node) {
+    return node == rf->cluster->home ? rf->redisctx : rf->cluster->nodes[node].ctx;
+}
+
+static RedisCluster *redis_cluster_create(const RedisEndpoint *ep) {
+    RedisCluster *cl = sqlite3_malloc64(sizeof(RedisCluster));
+    if (!cl)
+        return NULL;
+    memset(cl, 0, sizeof(RedisCluster));
+    cl->ep = *ep;
+    cl->home = -1;
+    cl->route = -1;
+    cl->last = -1;
+    return cl;
+}
+
+/* Connections to every node but home go back to the pool */
+static void redis_cluster_destroy(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    for (int i=0; i<cl->nnodes; ++i) {
+        if (cl->nodes[i].ctx)
+            redis_pool_put(rf->pool, cl->nodes[i].ctx, cl->nodes[i].endpoint);
+    }
+    sqlite3_free(cl->order);
+    sqlite3_free(cl->sent);
+    sqlite3_free(cl->sentoff);
+    sqlite3_free(cl);
+}
+
+/* One CLUSTER SLOTS range: start, end, then the master as ip, port, ... */
+static bool _cluster_range_ok(const redisReply *r) {
+    return r->type == REDIS_REPLY_ARRAY && r->elements >= 3 &&
+        r->element[0]->type == REDIS_REPLY_INTEGER && r->element[1]->type == REDIS_REPLY_INTEGER &&
+        r->element[0]->integer >= 0 && r->element[1]->integer < REDISVFS_CLUSTER_SLOTS &&
+        r->element[2]->type == REDIS_REPLY_ARRAY && r->element[2]->elements >= 2 &&
+        r->element[2]->element[0]->type == REDIS_REPLY_STRING &&
+        r->element[2]->element[1]->type == REDIS_REPLY_INTEGER;
+}
+
+/* "host:port" of a node.  No host means the node we asked.  False if
+ * that won't fit */
+static bool _cluster_endpoint(const RedisCluster *cl, char *endpoint, const char *host, size_t hostlen,
+        long long port) {
+    if (hostlen == 0) {
+        host = cl->ep.host;
+        hostlen = strlen(host);
+    }
+    if (hostlen > REDISVFS_MAX_HOSTLEN || port <= 0 || port > 65535)
+        return false;
+    return snprintf(endpoint, REDISVFS_MAX_ENDPOINTLEN+1, "%.*s:%d", (int)hostlen, host, (int)port)
+            <= REDISVFS_MAX_ENDPOINTLEN;
+}
+
+/* Parse a CLUSTER SLOTS reply into next's nodes and slot map */
+static int _cluster_parse_slots(RedisCluster *next, const redisReply *reply) {
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements == 0)
+        return REDIS_ERR;
+    memset(next->slotnode, 0xff, REDISVFS_CLUSTER_SLOTS);
+    for (size_t i=0; i<reply->elements; ++i) {
+        const redisReply *r = reply->element[i];
+        if (!_cluster_range_ok(r))
+            return REDIS_ERR;
+        const redisReply *host = r->element[2]->element[0];
+        char endpoint[REDISVFS_MAX_ENDPOINTLEN+1];
+        if (!_cluster_endpoint(next, endpoint, host->str, host->len, r->element[2]->element[1]->integer))
+            return REDIS_ERR;
+
+        int node = 0;
+        while (node < next->nnodes && strcmp(next->nodes[node].endpoint, endpoint) != 0)
+            ++node;
+        if (node == next->nnodes) {
+            if (node == REDISVFS_CLUSTER_MAX_NODES)
+                return REDIS_ERR;
+            memcpy(next->nodes[node].endpoint, endpoint, sizeof(endpoint));
+            next->nnodes++;
+        }
+        for (long long slot=r->element[0]->integer; slot<=r->element[1]->integer; ++slot)
+            next->slotnode[slot] = node;
+    }
+    return REDIS_OK;
+}
+
+/* Connection settings from the URI, to another node */
+static void _cluster_node_endpoint(RedisCluster *cl, const char *endpoint, RedisEndpoint *ep) {
+    *ep = cl->ep;
+    snprintf(ep->name, sizeof(ep->name), "%s", endpoint);
+    const char *colon = strrchr(endpoint, ':');
+    snprintf(ep->host, sizeof(ep->host), "%.*s", (int)(colon - endpoint), endpoint);
+    ep->port = atoi(colon+1);
+    ep->unixpath = NULL;
+}
+
+/* (Re)load the slot map from the node rf->redisctx is connected to, then
+ * connect to every master and make the owner of the file's home slot
+ * rf->redisctx.  Connections to nodes that are still masters are kept.
+ * pre: nothing queued on any connection */
+static int redis_cluster_load(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    RedisCluster *next = redis_cluster_create(&cl->ep);
+    if (!next)
+        return REDIS_ERR;
+
+    redisReply *reply = redis_command(rf, "CLUSTER SLOTS");
+    int ret = reply ? _cluster_parse_slots(next, reply) : REDIS_ERR;
+    if (reply)
+        freeReplyObject(reply);
+    int home = ret == REDIS_OK ? next->slotnode[redis_cluster_slot(rf->metabase, rf->metabaselen)] : 0xff;
+    if (home == 0xff) {
+        DLOG("%s: no slot map, or the home slot has no master", rf->keyprefix);
+        sqlite3_free(next);
+        return REDIS_ERR;
+    }
+
+    // Take over the connections we already have
+    for (int i=0; i<next->nnodes; ++i) {
+        struct RedisClusterNode *node = &next->nodes[i];
+        if (rf->redisctx && strcmp(node->endpoint, rf->endpoint) == 0) {
+            node->ctx = rf->redisctx;
+            rf->redisctx = NULL;
+            continue;
+        }
+        for (int j=0; j<cl->nnodes; ++j) {
+            if (cl->nodes[j].ctx && strcmp(node->endpoint, cl->nodes[j].endpoint) == 0) {
+                node->ctx = cl->nodes[j].ctx;
+                cl->nodes[j].ctx = NULL;
+                break;
+            }
+        }
+    }
+    // A node we can't reach keeps its failed connection, and everything
+    // sent to it fails
+    for (int i=0; i<next->nnodes; ++i) {
+        if (next->nodes[i].ctx)
+            continue;
+        RedisEndpoint ep;
+        _cluster_node_endpoint(next, next->nodes[i].endpoint, &ep);
+        next->nodes[i].ctx = redis_pool_get(rf->pool, &ep);
+        if (!next->nodes[i].ctx)
+            ret = REDIS_ERR;
+        else if (next->nodes[i].ctx->err)
+            DLOG("ERROR: %s: %s", next->nodes[i].endpoint, next->nodes[i].ctx->errstr);
+    }
+
+    // Whatever wasn't taken over isn't a master any more
+    if (rf->redisctx)
+        redis_pool_put(rf->pool, rf->redisctx, rf->endpoint);
+    next->order = cl->order;
+    next->sentoff = cl->sentoff;
+    next->ordercap = cl->ordercap;
+    cl->order = NULL;
+    cl->sentoff = NULL;
+    next->sent = cl->sent;
+    next->sentcap = cl->sentcap;
+    cl->sent = NULL;
+    redis_cluster_destroy(rf);
+
+    rf->cluster = next;
+    next->home = home;
+    rf->redisctx = next->nodes[home].ctx;
+    next->nodes[home].ctx = NULL;
+    snprintf(rf->endpoint, sizeof(rf->endpoint), "%s", next->nodes[home].endpoint);
+    DLOG("%s: %d masters, home %s", rf->keyprefix, next->nnodes, rf->endpoint);
+    return rf->redisctx ? ret : REDIS_ERR;
+}
+
+/* A RESP number and the CRLF after it.  NULL if it isn't all there */
+static const char *_resp_num(const char *p, const char *end, long long *n) {
+    *n = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        *n = *n * 10 + (*p++ - '0');
+    return (end - p >= 2 && p[0] == '\r' && p[1] == '\n') ? p+2 : NULL;
+}
+
+/* Length of the command at the start of buf, as the RESP encoder and
+ * redisFormatCommand write them.  0 if it isn't all there */
+static size_t _resp_cmdlen(const char *buf, size_t avail) {
+    const char *end = buf + avail;
+    long long argc, len;
+    if (avail == 0 || *buf != '*')
+        return 0;
+    const char *p = _resp_num(buf+1, end, &argc);
+    for (long long i=0; p && i<argc; ++i) {
+        if (p == end || *p != '$' || !(p = _resp_num(p+1, end, &len)) || end - p < len + 2)
+            return 0;
+        p += len + 2;
+    }
+    return p ? (size_t)(p - buf) : 0;
+}
+
+/* Keep a copy of ncmds commands about to be queued (see cluster).  The
+ * copies go once every reply before them has been read */
+static int redis_cluster_keep(RedisCluster *cl, const char *cmds, size_t len, int ncmds) {
+    if (cl->norder == 0)
+        cl->sentlen = 0;
+    if (cl->sentlen + len > cl->sentcap) {
+        size_t cap = cl->sentcap ? cl->sentcap : 4096;
+        while (cap < cl->sentlen + len)
+            cap *= 2;
+        char *sent = sqlite3_realloc64(cl->sent, cap);
+        if (!sent)
+            return REDIS_ERR;
+        cl->sent = sent;
+        cl->sentcap = cap;
+    }
+    memcpy(cl->sent + cl->sentlen, cmds, len);
+    size_t off = cl->sentlen;
+    cl->sentlen += len;
+    for (int i=0; i<ncmds; ++i) {
+        cl->sentoff[cl->norder + i] = off;
+        off += _resp_cmdlen(cl->sent + off, cl->sentlen - off);
+    }
+    return REDIS_OK;
+}
+
+/* Append the commands encoded since the last resp_end (see RESP encoding)
+ * to the connection of their node, and note the node for each of them */
+static int redis_cluster_append(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    int node = cl->route < 0 ? cl->home : cl->route;
+    int ncmds = cl->ncmds;
+    cl->route = -1;
+    cl->ncmds = 0;
+    if (rf->cmdoom)
+        return REDIS_ERR;
+    if (node == 0xff) {
+        cl->stale = true;
+        return REDIS_ERR;
+    }
+    redisContext *ctx = _cluster_ctx(rf, node);
+    if (!ctx)
+        return REDIS_ERR;
+    if (cl->norder + ncmds > cl->ordercap) {
+        int cap = cl->ordercap ? cl->ordercap : 64;
+        while (cap < cl->norder + ncmds)
+            cap *= 2;
+        size_t *sentoff = sqlite3_realloc64(cl->sentoff, cap * sizeof(size_t));
+        if (!sentoff)
+            return REDIS_ERR;
+        cl->sentoff = sentoff;
+        uint8_t *order = sqlite3_realloc64(cl->order, cap);
+        if (!order)
+            return REDIS_ERR;
+        cl->order = order;
+        cl->ordercap = cap;
+    }
+    if (!cl->nlanes && redis_cluster_keep(cl, rf->cmdbuf, rf->cmdlen, ncmds) != REDIS_OK)
+        return REDIS_ERR;
+    if (redisAppendFormattedCommand(ctx, rf->cmdbuf, rf->cmdlen) != REDIS_OK)
+        return REDIS_ERR;
+    for (int i=0; i<ncmds; ++i)
+        cl->order[cl->norder++] = node;
+    cl->nodes[node].unsent = true;
+    return REDIS_OK;
+}
+
+/* Write out every connection with commands waiting.  With more than one,
+ * the sockets are made non-blocking for the length of it and topped up as
+ * each drains, so a big pipeline on one doesn't hold up the rest.
+ * Anything left over (after a timeout) goes out with the next read, and a
+ * failure shows up as an error reading the reply */
+static void redis_cluster_flush(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    redisContext *ctxs[REDISVFS_CLUSTER_MAX_NODES];
+    struct pollfd pfds[REDISVFS_CLUSTER_MAX_NODES];
+    int n = 0;
+    for (int i=0; i<cl->nnodes; ++i) {
+        if (!cl->nodes[i].unsent)
+            continue;
+        cl->nodes[i].unsent = false;
+        redisContext *ctx = _cluster_ctx(rf, i);
+        if (ctx->err)
+            continue;
+        ctxs[n] = ctx;
+        pfds[n].fd = ctx->fd;
+        pfds[n].events = POLLOUT;
+        ++n;
+    }
+    if (n == 1) {
+        int done = 0;
+        while (!done && redisBufferWrite(ctxs[0], &done) == REDIS_OK)
+            ;
+        return;
+    }
+
+    int fdflags[REDISVFS_CLUSTER_MAX_NODES];
+    for (int i=0; i<n; ++i) {
+        fdflags[i] = fcntl(pfds[i].fd, F_GETFL);
+        fcntl(pfds[i].fd, F_SETFL, fdflags[i] | O_NONBLOCK);
+        ctxs[i]->flags &= ~REDIS_BLOCK;
+    }
+    int timeout = cl->ep.timeout_ms > 0 ? cl->ep.timeout_ms : -1;
+    int left = n;
+    while (left > 0) {
+        int ready = poll(pfds, n, timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break;
+        for (int i=0; i<n; ++i) {
+            if (pfds[i].fd < 0 || !pfds[i].revents)
+                continue;
+            int done = 0;
+            if (redisBufferWrite(ctxs[i], &done) != REDIS_OK || done) {
+                pfds[i].fd = -1;
+                --left;
+            }
+        }
+    }
+    for (int i=0; i<n; ++i) {
+        fcntl(ctxs[i]->fd, F_SETFL, fdflags[i]);
+        ctxs[i]->flags |= REDIS_BLOCK;
+    }
+}
+
+/* Connection the next reply comes in on.  The first time round, push out
+ * everything queued on every connection so the nodes work in parallel */
+static redisContext *redis_reply_ctx(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    if (cl)
+        cl->last = -1;
+    if (!cl || cl->orderhead == cl->norder)
+        return rf->redisctx;
+
+    redis_cluster_flush(rf);
+    cl->last = cl->orderhead;
+    int node = cl->order[cl->orderhead++];
+    if (cl->orderhead == cl->norder)
+        cl->orderhead = cl->norder = 0;
+    return _cluster_ctx(rf, node);
+}
+
+/* The reply to the oldest command queued was read straight off its
+ * connection rather than with redis_get_reply */
+static void redis_reply_taken(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    if (cl && cl->orderhead < cl->norder && ++cl->orderhead == cl->norder)
+        cl->orderhead = cl->norder = 0;
+}
+
+/* *reply is "MOVED <slot> <host>:<port>" or "ASK ..." for the command at
+ * order index cl->last.  Send that once more to the node named (see
+ * cluster), and swap *reply for what comes back */
+static void redis_cluster_redirect(RedisFile *rf, redisReply **reply) {
+    RedisCluster *cl = rf->cluster;
+    bool ask = strncmp((*reply)->str, "ASK ", 4) == 0;
+    char *end;
+    long slot = strtol((*reply)->str + (ask ? 4 : 6), &end, 10);
+    const char *colon = strrchr(end, ':');
+    char endpoint[REDISVFS_MAX_ENDPOINTLEN+1];
+    if (*end != ' ' || slot < 0 || slot >= REDISVFS_CLUSTER_SLOTS || !colon ||
+            !_cluster_endpoint(cl, endpoint, end+1, colon - (end+1), atoll(colon+1)))
+        return;
+    if (!ask) {
+        for (int node=0; node<cl->nnodes; ++node) {
+            if (strcmp(cl->nodes[node].endpoint, endpoint) == 0)
+                cl->slotnode[slot] = node;
+        }
+    }
+    size_t off = cl->sentoff[cl->last];
+    size_t len = _resp_cmdlen(cl->sent + off, cl->sentlen - off);
+    if (len == 0)
+        return;
+
+    RedisEndpoint ep;
+    _cluster_node_endpoint(cl, endpoint, &ep);
+    redisContext *ctx = redis_pool_get(rf->pool, &ep);
+    if (!ctx)
+        return;
+    redisReply *retry = NULL;
+    static const char asking[] = "*1\r\n$6\r\nASKING\r\n";
+    if (!ctx->err && (!ask || redis_append_formatted(rf, ctx, asking, sizeof(asking)-1) == REDIS_OK) &&
+            redis_append_formatted(rf, ctx, cl->sent + off, len) == REDIS_OK &&
+            (!ask || redis_read_reply(rf, ctx, &retry) == REDIS_OK)) {
+        if (retry)
+            freeReplyObject(retry);
+        if (redis_read_reply(rf, ctx, &retry) == REDIS_OK) {
+            DLOG("%s: sent again to %s", rf->keyprefix, endpoint);
+            freeReplyObject(*reply);
+            *reply = retry;
+        }
+    }
+    redis_pool_put(rf->pool, ctx, endpoint);
+}
+
+/* After a reply.  A connection that failed leaves the replies queued on
+ * the others out of step with the order, so they are read and dropped */
+static void _cluster_check_reply(RedisFile *rf, int ret, redisReply **reply) {
+    RedisCluster *cl = rf->cluster;
+    if (ret == REDIS_OK) {
+        if ((*reply)->type == REDIS_REPLY_ERROR &&
+                (strncmp((*reply)->str, "MOVED ", 6) == 0 || strncmp((*reply)->str, "ASK ", 4) == 0)) {
+            DLOG("%s: %s", rf->keyprefix, (*reply)->str);
+            cl->stale = true;
+            if (_cluster_mode(rf) && cl->last >= 0)
+                redis_cluster_redirect(rf, reply);
+        }
+        return;
+    }
+    redisReply *dropped;
+    while (cl->orderhead < cl->norder) {
+        redisContext *ctx = _cluster_ctx(rf, cl->order[cl->orderhead++]);
+        if (!ctx->err && redisGetReply(ctx, (void **)&dropped) == REDIS_OK)
+            freeReplyObject(dropped);
+    }
+    cl->orderhead = cl->norder = 0;
+}
+
+/* Next reply to a command queued with resp_end */
+static int redis_get_reply(RedisFile *rf, redisReply **reply) {
+    if (rf->mux)
+        return redis_read_reply(rf, NULL, reply);
+    int ret = redisGetReply(redis_reply_ctx(rf), (void **)reply);
+    if (ret == REDIS_OK)
+        redis_iostats_reply(rf, *reply);
+    if (rf->cluster)
+        _cluster_check_reply(rf, ret, reply);
+    return ret;
+}
+
+/* Same, through a reply sink (see redis_get_reply_into) */
+static int redis_get_reply_sink(RedisFile *rf, RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    if (rf->mux) {
+        if (redis_read_reply(rf, NULL, reply) != REDIS_OK)
+            return REDIS_ERR;
+        redis_mux_sink(sink, dst, cap, reply);
+        return REDIS_OK;
+    }
+    int ret = redis_get_reply_into(redis_reply_ctx(rf), sink, dst, cap, reply);
+    if (ret == REDIS_OK)
+        redis_iostats_reply(rf, *reply);
+    if (rf->cluster)
+        _cluster_check_reply(rf, ret, reply);
+    return ret;
+}
+
+/* parallel I/O
+ *
+ * A single connection runs a multi-block read or write as one pipeline,
+ * which one socket (and one redis I/O thread) has to carry.  io_conns=K
+ * opens K-1 more connections to the same server and deals blocks out
+ * between them by block number, using the cluster machinery with the
+ * connections standing in for nodes.  The connections are filled in
+ * parallel, and the replies are taken in the order the commands were
+ * queued, so callers see one pipeline as before.  Everything that isn't a
+ * block command stays on rf->redisctx.
+ *
+ * Nothing a request sends depends on another part of it landing first,
+ * and a request waits for every reply before it returns, so there is
+ * nothing to order between the connections.
+ *
+ * Keys read on the extra connections are tracked with their invalidations
+ * sent on to rf->redisctx (CLIENT TRACKING REDIRECT), so the block cache
+ * sees them where it always has.  Prefetches stay on rf->redisctx.
+ */
+
+/* Stop the extra connections tracking keys for rf->redisctx.  One that
+ * won't is closed rather than going back to the pool */
+static void redis_lanes_untrack(RedisFile *rf) {
+    RedisCluster *cl = rf->cluster;
+    for (int i=0; i<cl->nnodes; ++i) {
+        redisContext *ctx = cl->nodes[i].ctx;
+        if (!ctx || ctx->err)
+            continue;
+        redisReply *reply = redisCommand(ctx, "CLIENT TRACKING off");
+        if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+            redisFree(ctx);
+            cl->nodes[i].ctx = NULL;
+        }
+        if (reply)
+            freeReplyObject(reply);
+    }
+}
+
+static void redis_lanes_close(RedisFile *rf) {
+    if (rf->cache)
+        redis_lanes_untrack(rf);
+    redis_cluster_destroy(rf);
+    rf->cluster = NULL;
+}
+
+/* io_conns=K.  rf->redisctx is the first of them.
+ * pre: tracking already on for rf->redisctx if there is a block cache */
+static int redis_lanes_open(RedisFile *rf, const RedisEndpoint *ep, int nlanes) {
+    RedisCluster *cl = redis_cluster_create(ep);
+    if (!cl)
+        return REDIS_ERR;
+    rf->cluster = cl;
+    cl->nlanes = cl->nnodes = nlanes;
+    cl->home = 0;
+
+    long long clientid = -1;
+    if (rf->cache) {
+        redisReply *reply = redis_command(rf, "CLIENT ID");
+        if (reply && reply->type == REDIS_REPLY_INTEGER)
+            clientid = reply->integer;
+        if (reply)
+            freeReplyObject(reply);
+        if (clientid < 0)
+            return REDIS_ERR;
+    }
+    for (int i=0; i<nlanes; ++i) {
+        snprintf(cl->nodes[i].endpoint, sizeof(cl->nodes[i].endpoint), "%s", rf->endpoint);
+        if (i == cl->home)
+            continue;
+        redisContext *ctx = cl->nodes[i].ctx = redis_pool_get(rf->pool, ep);
+        if (!ctx || ctx->err)
+            return REDIS_ERR;
+        if (rf->cache) {
+            redisReply *reply = redisCommand(ctx, "CLIENT TRACKING on REDIRECT %lld NOLOOP", clientid);
+            bool ok = reply && reply->type == REDIS_REPLY_STATUS;
+            if (reply)
+                freeReplyObject(reply);
+            if (!ok)
+                return REDIS_ERR;
+        }
+    }
+    DLOG("%s: %d connections to %s", rf->keyprefix, nlanes, rf->endpoint);
+    return REDIS_OK;
+}
+
+/* RESP encoding
+ *
+ * Block commands are written as RESP straight into a buffer kept on the
+ * file, then handed to hiredis already formatted.  redisAppendCommand and
+ * friends allocate the command and every argument on each call.  The
+ * buffer only ever grows, so a pipeline of block reads or writes doesn't
+ * allocate per command.  Several commands can be encoded before resp_end.
+ */
+
+static bool _resp_reserve(RedisFile *rf, size_t extra) {
+    if (rf->cmdlen + extra <= rf->cmdcap)
+        return true;
+    size_t cap = rf->cmdcap ? rf->cmdcap : 1024;
+    while (cap < rf->cmdlen + extra)
+        cap *= 2;
+    char *buf = sqlite3_realloc64(rf->cmdbuf, cap);
+    if (!buf) {
+        rf->cmdoom = true;
+        return false;
+    }
+    rf->cmdbuf = buf;
+    rf->cmdcap = cap;
+    return true;
+}
+
+static void _resp_header(RedisFile *rf, char type, uint64_t n) {
+    if (!_resp_reserve(rf, 24))
+        return;
+    rf->cmdbuf[rf->cmdlen++] = type;
+    rf->cmdlen += _u64_to_dec(n, rf->cmdbuf + rf->cmdlen);
+    rf->cmdbuf[rf->cmdlen++] = '\r';
+    rf->cmdbuf[rf->cmdlen++] = '\n';
+}
+
+static inline void resp_begin(RedisFile *rf, int argc) {
+    _resp_header(rf, '*', argc);
+    rf->iostats.commands++;
+    if (rf->cluster)
+        rf->cluster->ncmds++;
+    else if (rf->mux)
+        rf->mux->ncmds++;
+}
+
+static void resp_arg(RedisFile *rf, const char *arg, size_t len) {
+    _resp_header(rf, '$', len);
+    if (!_resp_reserve(rf, len+2))
+        return;
+    memcpy(rf->cmdbuf + rf->cmdlen, arg, len);
+    rf->cmdlen += len;
+    rf->cmdbuf[rf->cmdlen++] = '\r';
+    rf->cmdbuf[rf->cmdlen++] = '\n';
+}
+
+static inline void resp_arg_str(RedisFile *rf, const char *arg) {
+    resp_arg(rf, arg, strlen(arg));
+}
+
+static void resp_arg_int(RedisFile *rf, int64_t v) {
+    assert(v >= 0);
+    char tmp[20];
+    resp_arg(rf, tmp, _u64_to_dec(v, tmp));
+}
+
+/* Key (or hash field for layout=hash) of the block holding offset */
+static void resp_arg_block(RedisFile *rf, int64_t offset) {
+    char key[REDISVFS_KEYBUFLEN];
+    int keylen = rf->hashlayout ? get_blockfield(rf, offset, key) : get_blockkey(rf, offset, key);
+    resp_arg(rf, key, keylen);
+    // The command goes to whichever node has the block, or is dealt out
+    // over the io_conns connections
+    if (rf->cluster && !rf->hashlayout) {
+        RedisCluster *cl = rf->cluster;
+        cl->route = cl->nlanes ? (offset / rf->blocksize) % cl->nlanes
+                               : cl->slotnode[redis_cluster_slot(key, keylen)];
+    }
+}
+
+/* Hand everything encoded since the last resp_end to hiredis.  In cluster
+ * mode it must all be for the same node */
+static int resp_end(RedisFile *rf) {
+    int ret = REDIS_ERR;
+    if (rf->cluster)
+        ret = redis_cluster_append(rf);
+    else if (rf->mux && !rf->cmdoom)
+        ret = redis_mux_append(rf->mux, rf->cmdbuf, rf->cmdlen, rf->mux->ncmds);
+    else if (!rf->cmdoom)
+        ret = redisAppendFormattedCommand(rf->redisctx, rf->cmdbuf, rf->cmdlen);
+    if (ret == REDIS_OK)
+        redis_iostats_sent(rf, rf->cmdlen);
+    if (rf->mux)
+        rf->mux->ncmds = 0;
+    rf->cmdlen = 0;
+    rf->cmdoom = false;
+    return ret;
+}
+
+/* A server side script, run with EVALSHA.  The SHA only depends on the
+ * text, so once any server has loaded it the process keeps it, and a
+ * server that hasn't (NOSCRIPT) is given it again */
+typedef struct RedisScript {
+    const char *text;
+    char sha[41];
+} RedisScript;
+
+static inline bool _noscript(redisReply *reply) {
+    return reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0;
+}
+
+/* The SHA, or "" if the process has yet to load the script */
+static void _script_sha(RedisScript *script, char *sha) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    sqlite3_mutex_enter(mutex);
+    memcpy(sha, script->sha, sizeof(script->sha));
+    sqlite3_mutex_leave(mutex);
+}
+
+/* SCRIPT LOAD on the file's own connection */
+static int redis_script_load(RedisFile *rf, RedisScript *script) {
+    redisReply *reply = redis_command(rf, "SCRIPT LOAD %s", script->text);
+    if (reply == NULL)
+        return REDIS_ERR;
+    int ret = REDIS_ERR;
+    if (reply->type == REDIS_REPLY_STRING && reply->len < sizeof(script->sha)) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+        sqlite3_mutex_enter(mutex);
+        memcpy(script->sha, reply->str, reply->len+1);
+        sqlite3_mutex_leave(mutex);
+        ret = REDIS_OK;
+    } else {
+        redis_debugreply(reply);
+    }
+    freeReplyObject(reply);
+    return ret;
+}
+
+/* Start queuing EVALSHA of script with nargs arguments, nkeys of them
+ * KEYS, for the caller to add and resp_end.  Loads it first if the
+ * process never has, so unless it has nothing may be waiting for a reply */
+static int redis_resp_script_begin(RedisFile *rf, RedisScript *script, int nkeys, int nargs) {
+    char sha[sizeof(script->sha)];
+    _script_sha(script, sha);
+    if (!*sha) {
+        if (redis_script_load(rf, script) != REDIS_OK)
+            return REDIS_ERR;
+        memcpy(sha, script->sha, sizeof(sha));
+    }
+    resp_begin(rf, 3 + nargs);
+    resp_arg(rf, "EVALSHA", 7);
+    resp_arg_str(rf, sha);
+    resp_arg_int(rf, nkeys);
+    return REDIS_OK;
+}
+
+/* Queue EVALSHA of script.  The first nkeys of args are its KEYS, the
+ * rest its ARGV */
+static int redis_resp_script(RedisFile *rf, RedisScript *script, int nkeys, int nargs, const char **args) {
+    if (redis_resp_script_begin(rf, script, nkeys, nargs) != REDIS_OK)
+        return REDIS_ERR;
+    for (int i=0; i<nargs; ++i)
+        resp_arg_str(rf, args[i]);
+    return resp_end(rf);
+}
+
+/* redis_command for a script: run it and take the reply, loading it
+ * again if redis has lost it, say to a restart.  NULL on error */
+static redisReply *redis_script_command(RedisFile *rf, RedisScript *script, int nkeys, int nargs, const char **args) {
+    redisReply *reply;
+    for (int tries=0; ; ++tries) {
+        if (redis_resp_script(rf, script, nkeys, nargs, args) != REDIS_OK ||
+                redis_get_reply(rf, &reply) != REDIS_OK)
+            return NULL;
+        if (tries > 0 || !_noscript(reply))
+            return reply;
+        DLOG("%s script gone. Reloading", rf->keyprefix);
+        freeReplyObject(reply);
+        if (redis_script_load(rf, script) != REDIS_OK)
+            return NULL;
+    }
+}
+
+
+/* block compression
+ *
+ * compress=lz4|zstd on a new main database stores each block compressed
+ * whenever that makes it smaller.  The codec is kept beside the block size
+ * (<prefix>:codec, or the codec field with layout=hash) so every later
+ * open reads the blocks the same way.  Only whole blocks are ever stored,
+ * so a block shorter than the block size is compressed and a full length
+ * one is stored as is.  Compressed blocks can't be patched with SETRANGE:
+ * partial block writes read the rest of the block in first, and partial
+ * reads fetch the whole block.  Journals and the WAL aren't compressed.
+ *
+ * Whatever the codec, a block written as all zeros is deleted rather than
+ * stored.  Missing blocks inside the file read back as zeros.
+ */
+
+enum { REDISVFS_CODEC_NONE, REDISVFS_CODEC_LZ4, REDISVFS_CODEC_ZSTD };
+
+struct RedisCodec {
+    int type;
+    int blocksize;
+    char *block;        // whole block decoded for a partial read
+    char *edit;         // first and last blocks of a partial write
+    char *out;          // compressed block on its way to redis
+    size_t outcap;
+};
+
+static const char *redis_codec_name(int type) {
+    return type == REDISVFS_CODEC_LZ4 ? "lz4" : type == REDISVFS_CODEC_ZSTD ? "zstd" : "none";
+}
+
+/* Returns -1 for codecs we don't know or weren't built with */
+static int redis_codec_from_name(const char *name) {
+    if (strcmp(name, "none") == 0)
+        return REDISVFS_CODEC_NONE;
+#ifdef REDISVFS_HAVE_LZ4
+    if (strcmp(name, "lz4") == 0)
+        return REDISVFS_CODEC_LZ4;
+#endif
+#ifdef REDISVFS_HAVE_ZSTD
+    if (strcmp(name, "zstd") == 0)
+        return REDISVFS_CODEC_ZSTD;
+#endif
+    return -1;
+}
+
+static void redis_codec_destroy(RedisCodec *codec) {
+    sqlite3_free(codec->block);
+    sqlite3_free(codec->edit);
+    sqlite3_free(codec->out);
+    sqlite3_free(codec);
+}
+
+static RedisCodec *redis_codec_create(int type, int blocksize) {
+    RedisCodec *codec = sqlite3_malloc64(sizeof(RedisCodec));
+    if (!codec)
+        return NULL;
+    memset(codec, 0, sizeof(RedisCodec));
+    codec->type = type;
+    codec->blocksize = blocksize;
+    codec->outcap = blocksize;
+#ifdef REDISVFS_HAVE_LZ4
+    if (type == REDISVFS_CODEC_LZ4)
+        codec->outcap = LZ4_compressBound(blocksize);
+#endif
+#ifdef REDISVFS_HAVE_ZSTD
+    if (type == REDISVFS_CODEC_ZSTD)
+        codec->outcap = ZSTD_compressBound(blocksize);
+#endif
+    codec->block = sqlite3_malloc64(blocksize);
+    codec->edit = sqlite3_malloc64(2 * blocksize);
+    codec->out = sqlite3_malloc64(codec->outcap);
+    if (!codec->block || !codec->edit || !codec->out) {
+        redis_codec_destroy(codec);
+        return NULL;
+    }
+    return codec;
+}
+
+static inline bool _block_is_zero(const char *buf, size_t len) {
+    return buf[0] == 0 && memcmp(buf, buf+1, len-1) == 0;
+}
+
+/* Compress a whole block.  *out is left pointing at what to store, which
+ * is buf itself if compressing didn't help.  Returns its length */
+static size_t redis_codec_encode(RedisFile *rf, const char *buf, const char **out) {
+    RedisCodec *codec = rf->codec;
+    RedisCompressStats *stats = &rf->compressstats;
+    sqlite3_int64 start = _now_us();
+    size_t n = 0;
+#ifdef REDISVFS_HAVE_LZ4
+    if (codec->type == REDISVFS_CODEC_LZ4) {
+        int r = LZ4_compress_default(buf, codec->out, codec->blocksize, codec->outcap);
+        n = r > 0 ? r : 0;
+    }
+#endif
+#ifdef REDISVFS_HAVE_ZSTD
+    if (codec->type == REDISVFS_CODEC_ZSTD) {
+        size_t r = ZSTD_compress(codec->out, codec->outcap, buf, codec->blocksize, REDISVFS_ZSTD_LEVEL);
+        n = ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+    stats->compress_us += _now_us() - start;
+    stats->bytes_in += codec->blocksize;
+
+    if (n == 0 || n >= (size_t)codec->blocksize) {
+        stats->blocks_uncompressed++;
+        stats->bytes_out += codec->blocksize;
+        *out = buf;
+        return codec->blocksize;
+    }
+    stats->blocks_compressed++;
+    stats->bytes_out += n;
+    *out = codec->out;
+    return n;
+}
+
+/* Inverse of redis_codec_encode.  out is a whole block.
+ * Returns the block size, or -1 if the data is corrupt */
+static int64_t redis_codec_decode(RedisFile *rf, const char *data, size_t len, char *out) {
+    RedisCodec *codec = rf->codec;
+    if (len == (size_t)codec->blocksize) {
+        if (data != out)
+            memcpy(out, data, len);
+        return len;
+    }
+    if (len > (size_t)codec->blocksize)
+        return -1;
+
+    sqlite3_int64 start = _now_us();
+    int64_t n = -1;
+#ifdef REDISVFS_HAVE_LZ4
+    if (codec->type == REDISVFS_CODEC_LZ4)
+        n = LZ4_decompress_safe(data, out, len, codec->blocksize);
+#endif
+#ifdef REDISVFS_HAVE_ZSTD
+    if (codec->type == REDISVFS_CODEC_ZSTD) {
+        size_t r = ZSTD_decompress(out, codec->blocksize, data, len);
+        n = ZSTD_isError(r) ? -1 : (int64_t)r;
+    }
+#endif
+    rf->compressstats.decompress_us += _now_us() - start;
+    rf->compressstats.blocks_decompressed++;
+    return n == codec->blocksize ? n : -1;
+}
+
+/* block cache
+ *
+ * A small set associative cache of whole blocks read from redis.  The
+ * connection is switched to RESP3 with CLIENT TRACKING on, so redis
+ * remembers which blocks we have read and pushes an invalidation to us as
+ * soon as anyone (including us) changes one of them.  hiredis hands us
+ * those pushes whenever we read replies, and we poll for any that arrived
+ * while idle before serving blocks out of the cache.
+ */
+
+struct RedisBlockCacheEntry {
+    int64_t blocknum;   // -1 if unused
+    size_t len;         // a block can be shorter than blocksize
+    uint64_t lastused;
+    bool prefetched;    // fetched by read-ahead and not read yet
+};
+
+struct RedisBlockCache {
+    unsigned nsets;
+    int blocksize;
+    struct RedisBlockCacheEntry *entries;  // nsets * REDISVFS_CACHE_WAYS
+    char *data;                            // blocksize per entry
+    uint64_t clock;
+    RedisBlockCacheStats stats;
+};
+
+static void redis_cache_clear(RedisBlockCache *cache) {
+    for (unsigned i=0; i<cache->nsets*REDISVFS_CACHE_WAYS; ++i)
+        cache->entries[i].blocknum = -1;
+}
+
+static RedisBlockCache *redis_cache_create(sqlite3_int64 nblocks, int blocksize) {
+    unsigned nsets = (nblocks + REDISVFS_CACHE_WAYS - 1) / REDISVFS_CACHE_WAYS;
+    sqlite3_int64 nentries = (sqlite3_int64)nsets * REDISVFS_CACHE_WAYS;
+
+    RedisBlockCache *cache = sqlite3_malloc64(sizeof(RedisBlockCache));
+    if (!cache)
+        return NULL;
+    memset(cache, 0, sizeof(RedisBlockCache));
+    cache->nsets = nsets;
+    cache->blocksize = blocksize;
+    cache->entries = sqlite3_malloc64(nentries * sizeof(struct RedisBlockCacheEntry));
+    cache->data = sqlite3_malloc64(nentries * blocksize);
+    if (!cache->entries || !cache->data) {
+        sqlite3_free(cache->entries);
+        sqlite3_free(cache->data);
+        sqlite3_free(cache);
+        return NULL;
+    }
+    redis_cache_clear(cache);
+    return cache;
+}
+
+static void redis_cache_destroy(RedisBlockCache *cache) {
+    DLOG("cache hits=%lld misses=%lld invalidations=%lld evictions=%lld",
+            cache->stats.hits, cache->stats.misses,
+            cache->stats.invalidations, cache->stats.evictions);
+    sqlite3_free(cache->entries);
+    sqlite3_free(cache->data);
+    sqlite3_free(cache);
+}
+
+static inline struct RedisBlockCacheEntry *_cache_set(RedisBlockCache *cache, int64_t blocknum) {
+    return &cache->entries[(blocknum % cache->nsets) * REDISVFS_CACHE_WAYS];
+}
+static inline char *_cache_data(RedisBlockCache *cache, struct RedisBlockCacheEntry *entry) {
+    return cache->data + (entry - cache->entries) * cache->blocksize;
+}
+
+static struct RedisBlockCacheEntry *_cache_find(RedisBlockCache *cache, int64_t blocknum) {
+    struct RedisBlockCacheEntry *set = _cache_set(cache, blocknum);
+    for (int way=0; way<REDISVFS_CACHE_WAYS; ++way) {
+        if (set[way].blocknum == blocknum)
+            return &set[way];
+    }
+    return NULL;
+}
+
+/* Returns a pointer to the cached block data (and its length), or NULL on a miss */
+static const char *redis_cache_lookup(RedisBlockCache *cache, int64_t blocknum, size_t *len) {
+    struct RedisBlockCacheEntry *entry = _cache_find(cache, blocknum);
+    if (!entry) {
+        cache->stats.misses++;
+        return NULL;
+    }
+    entry->lastused = ++cache->clock;
+    cache->stats.hits++;
+    if (entry->prefetched) {
+        entry->prefetched = false;
+        cache->stats.prefetch_hits++;
+    }
+    *len = entry->len;
+    return _cache_data(cache, entry);
+}
+
+static void redis_cache_store(RedisBlockCache *cache, int64_t blocknum, const char *data, size_t len, bool prefetched) {
+    assert(len <= cache->blocksize);
+    struct RedisBlockCacheEntry *set = _cache_set(cache, blocknum);
+    struct RedisBlockCacheEntry *victim = &set[0];
+    for (int way=0; way<REDISVFS_CACHE_WAYS; ++way) {
+        if (set[way].blocknum == blocknum || set[way].blocknum < 0) {
+            victim = &set[way];
+            break;
+        }
+        if (set[way].lastused < victim->lastused)
+            victim = &set[way];
+    }
+    if (victim->blocknum >= 0 && victim->blocknum != blocknum)
+        cache->stats.evictions++;
+
+    victim->blocknum = blocknum;
+    victim->len = len;
+    victim->lastused = ++cache->clock;
+    victim->prefetched = prefetched;
+    memcpy(_cache_data(cache, victim), data, len);
+}
+
+/* Returns true if the block was cached */
+static bool redis_cache_drop(RedisBlockCache *cache, int64_t blocknum) {
+    struct RedisBlockCacheEntry *set = _cache_set(cache, blocknum);
+    for (int way=0; way<REDISVFS_CACHE_WAYS; ++way) {
+        if (set[way].blocknum == blocknum) {
+            set[way].blocknum = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Drop every cached block from blocknum on.  After a truncate */
+static void redis_cache_drop_from(RedisBlockCache *cache, int64_t blocknum) {
+    for (unsigned i=0; i<cache->nsets*REDISVFS_CACHE_WAYS; ++i) {
+        if (cache->entries[i].blocknum >= blocknum)
+            cache->entries[i].blocknum = -1;
+    }
+}
+
+/* read-ahead
+ *
+ * Scans read pages in order, but each xRead is its own round trip.  Once
+ * a file has been read sequentially for a few blocks, GETs for the next
+ * window of blocks are sent without waiting for the replies.  They come
+ * back while sqlite is busy with the pages it already has, and are
+ * collected into the block cache (which keeps them coherent) either when
+ * an xRead wants one of them or before anything else is sent to redis.
+ *
+ * The window doubles each time the reader uses most of the last one, and
+ * halves when most of it goes unused or the reader jumps somewhere else.
+ */
+
+struct RedisReadAhead {
+    int64_t nextblock;      // block after the last one read
+    int64_t issued_until;   // blocks below this have already been requested
+    int seqreads;           // consecutive sequential reads
+    int window;             // blocks per prefetch, 0 if not prefetching
+    int maxwindow;
+
+    // Blocks requested and not collected yet, in order
+    int64_t *pending;
+    int npending;
+    int pendinghead;
+
+    // For judging the last window when the next one is sent
+    int lastissued;
+    sqlite3_int64 hits_at_issue;
+};
+
+static RedisReadAhead *redis_readahead_create(int maxwindow) {
+    RedisReadAhead *ra = sqlite3_malloc64(sizeof(RedisReadAhead));
+    if (!ra)
+        return NULL;
+    memset(ra, 0, sizeof(RedisReadAhead));
+    ra->maxwindow = maxwindow;
+    ra->pending = sqlite3_malloc64(maxwindow * sizeof(int64_t));
+    if (!ra->pending) {
+        sqlite3_free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+static void redis_readahead_destroy(RedisReadAhead *ra) {
+    sqlite3_free(ra->pending);
+    sqlite3_free(ra);
+}
+
+static inline bool _readahead_pending(RedisFile *rf) {
+    return rf->readahead && rf->readahead->npending > rf->readahead->pendinghead;
+}
+
+static void _readahead_store(RedisFile *rf, redisReply *reply) {
+    RedisReadAhead *ra = rf->readahead;
+    assert(ra->pendinghead < ra->npending);
+    int64_t blocknum = ra->pending[ra->pendinghead++];
+
+    // NIL is past the end of the file, or a hole
+    if (reply->type != REDIS_REPLY_STRING || reply->len > rf->blocksize ||
+            _cache_find(rf->cache, blocknum))
+        return;
+    if (!rf->codec)
+        redis_cache_store(rf->cache, blocknum, reply->str, reply->len, true);
+    else if (redis_codec_decode(rf, reply->str, reply->len, rf->codec->block) >= 0)
+        redis_cache_store(rf->cache, blocknum, rf->codec->block, rf->blocksize, true);
+}
+
+/* Collect the reply for the oldest outstanding prefetch (or the whole
+ * window at once for an HMGET).  Takes ownership of reply */
+static void redis_readahead_consume(RedisFile *rf, redisReply *reply) {
+    if (reply->type == REDIS_REPLY_ARRAY) {
+        for (size_t i=0; i<reply->elements && _readahead_pending(rf); ++i)
+            _readahead_store(rf, reply->element[i]);
+        // Short array. Shouldn't happen, but don't wait for replies that won't come
+        rf->readahead->pendinghead = rf->readahead->npending;
+    } else {
+        _readahead_store(rf, reply);
+    }
+    freeReplyObject(reply);
+}
+
+/* Wait for every outstanding prefetch.  Must be done before sending
+ * anything else to redis so replies don't get mixed up */
+static int redis_readahead_drain(RedisFile *rf) {
+    while (_readahead_pending(rf)) {
+        redisReply *reply;
+        if (redis_get_reply(rf, &reply) != REDIS_OK) {
+            DLOG("ERROR: redisGetReply: %s", rf->redisctx->errstr);
+            rf->readahead->npending = rf->readahead->pendinghead = 0;
+            return REDIS_ERR;
+        }
+        redis_readahead_consume(rf, reply);
+    }
+    return REDIS_OK;
+}
+
+/* Send GETs for the next window.  Doesn't wait for the replies.
+ * pre: nothing outstanding on the connection */
+static int redis_readahead_issue(RedisFile *rf) {
+    RedisReadAhead *ra = rf->readahead;
+    assert(!_readahead_pending(rf));
+
+    // How much of the last window was actually read?
+    if (ra->lastissued > 0) {
+        sqlite3_int64 used = rf->cache->stats.prefetch_hits - ra->hits_at_issue;
+        if (used * 4 >= ra->lastissued * 3 && ra->window < ra->maxwindow)
+            ra->window *= 2;
+        else if (used * 4 < ra->lastissued)
+            ra->window /= 2;
+        if (ra->window > ra->maxwindow)
+            ra->window = ra->maxwindow;
+        if (ra->window < REDISVFS_READAHEAD_MIN_WINDOW) {
+            ra->window = 0;
+            ra->lastissued = 0;
+            return REDIS_OK;
+        }
+    }
+
+    int64_t first = ra->issued_until > ra->nextblock ? ra->issued_until : ra->nextblock;
+    int64_t last = first + ra->window;
+    // Only a hint.  Anything past the real end comes back NIL
+    if (rf->filesize >= 0) {
+        int64_t endblock = (rf->filesize + rf->blocksize - 1) / rf->blocksize;
+        if (last > endblock)
+            last = endblock;
+    }
+
+    ra->npending = ra->pendinghead = 0;
+    for (int64_t blocknum=first; blocknum<last; ++blocknum) {
+        if (!_cache_find(rf->cache, blocknum))
+            ra->pending[ra->npending++] = blocknum;
+    }
+
+    if (ra->npending > 0) {
+        if (rf->hashlayout) {
+            // One HMGET for the whole window
+            resp_begin(rf, ra->npending + 2);
+            resp_arg(rf, "HMGET", 5);
+            resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+            for (int i=0; i<ra->npending; ++i)
+                resp_arg_block(rf, ra->pending[i] * rf->blocksize);
+        } else if (rf->blockfile) {
+            for (int i=0; i<ra->npending; ++i) {
+                resp_begin(rf, 4);
+                resp_arg(rf, "BLOCKFILE.READ", 14);
+                resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+                resp_arg_int(rf, ra->pending[i] * rf->blocksize);
+                resp_arg_int(rf, rf->blocksize);
+            }
+        } else {
+            for (int i=0; i<ra->npending; ++i) {
+                resp_begin(rf, 2);
+                resp_arg(rf, "GET", 3);
+                resp_arg_block(rf, ra->pending[i] * rf->blocksize);
+            }
+        }
+        // With io_conns they still all go on rf->redisctx, which is
+        // where redis_cache_poll_invalidations collects them from
+        if (rf->cluster)
+            rf->cluster->route = -1;
+        if (resp_end(rf) != REDIS_OK) {
+            ra->npending = 0;
+            return REDIS_ERR;
+        }
+    }
+    ra->issued_until = last;
+    ra->lastissued = ra->npending;
+    ra->hits_at_issue = rf->cache->stats.prefetch_hits;
+    rf->cache->stats.prefetched += ra->npending;
+
+    // Push the requests out now rather than with the next command
+    int done = 0;
+    while (!done) {
+        if (redisBufferWrite(rf->redisctx, &done) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    DLOG("%s prefetching %d blocks from %lld (window %d)", rf->keyprefix, ra->npending, (long long)first, ra->window);
+    return REDIS_OK;
+}
+
+/* Called after each successful xRead of blocks [firstblock..lastblock] */
+static int redis_readahead_update(RedisFile *rf, int64_t firstblock, int64_t lastblock) {
+    RedisReadAhead *ra = rf->readahead;
+
+    // Re-reading the last block, or anywhere in what was prefetched, still
+    // counts as moving forward through the file
+    int64_t horizon = ra->issued_until > ra->nextblock ? ra->issued_until : ra->nextblock;
+    bool sequential = firstblock >= ra->nextblock-1 && firstblock <= horizon;
+    if (!sequential) {
+        ra->seqreads = 0;
+        ra->window /= 2;
+        if (ra->window < REDISVFS_READAHEAD_MIN_WINDOW)
+            ra->window = 0;
+        ra->lastissued = 0;
+        ra->issued_until = 0;
+    } else {
+        ra->seqreads++;
+    }
+    if (lastblock+1 > ra->nextblock || !sequential)
+        ra->nextblock = lastblock+1;
+
+    if (ra->window == 0 && ra->seqreads >= REDISVFS_READAHEAD_TRIGGER) {
+        ra->window = REDISVFS_READAHEAD_MIN_WINDOW;
+        ra->lastissued = 0;
+    }
+    if (ra->window == 0 || _readahead_pending(rf))
+        return REDIS_OK;
+
+    // Keep half a window ahead of the reader
+    if (ra->issued_until - ra->nextblock <= ra->window / 2)
+        return redis_readahead_issue(rf);
+    return REDIS_OK;
+}
+
+/* Handle a RESP3 push from redis.  Takes ownership of reply */
+static void redis_handle_push(RedisFile *rf, redisReply *reply) {
+    if (rf->cache && reply->elements == 2 &&
+            reply->element[0]->type == REDIS_REPLY_STRING &&
+            strcmp(reply->element[0]->str, "invalidate") == 0) {
+        redisReply *keys = reply->element[1];
+        if (keys->type == REDIS_REPLY_ARRAY) {
+            char sizekey[REDISVFS_KEYBUFLEN];
+            get_filesizekey(rf, sizekey);
+            for (size_t i=0; i<keys->elements; ++i) {
+                // layout=hash and blockfile are a single key for the whole
+                // file, so we can't tell which blocks changed
+                if ((rf->hashlayout || rf->blockfile) && keys->element[i]->len == rf->keyprefixlen &&
+                        memcmp(keys->element[i]->str, rf->keyprefix, rf->keyprefixlen) == 0) {
+                    redis_cache_clear(rf->cache);
+                    rf->cache->stats.invalidations++;
+                    rf->filesize = -1;
+                    continue;
+                }
+                int64_t blocknum = get_blocknum_from_key(rf, keys->element[i]->str, keys->element[i]->len);
+                if (blocknum >= 0 && redis_cache_drop(rf->cache, blocknum))
+                    rf->cache->stats.invalidations++;
+                else if (strcmp(keys->element[i]->str, sizekey) == 0)
+                    rf->filesize = -1;
+            }
+        } else {
+            // NIL means redis lost track of everything (e.g. FLUSHALL)
+            DLOG("invalidate everything");
+            redis_cache_clear(rf->cache);
+            rf->filesize = -1;
+        }
+    } else {
+        DLOG("Ignoring redis push");
+        redis_debugreply(reply);
+    }
+    freeReplyObject(reply);
+}
+
+static void redis_push_callback(void *privdata, void *reply) {
+    redis_handle_push((RedisFile *)privdata, (redisReply *)reply);
+}
+
+/* Pick up any invalidations (and prefetched blocks) that have already
+ * arrived, without blocking.
+ * pre: no replies outstanding on the connection other than prefetches */
+static void redis_cache_poll_invalidations(RedisFile *rf) {
+    redisContext *ctx = rf->redisctx;
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+
+    while (poll(&pfd, 1, 0) > 0) {
+        if (redisBufferRead(ctx) != REDIS_OK) {
+            DLOG("ERROR: redisBufferRead: %s", ctx->errstr);
+            redis_cache_clear(rf->cache);  // can't trust it any more
+            return;
+        }
+        redisReply *reply;
+        while (redisGetReplyFromReader(ctx, (void **)&reply) == REDIS_OK && reply) {
+            if (reply->type == REDIS_REPLY_PUSH) {
+                redis_handle_push(rf, reply);
+            } else if (_readahead_pending(rf)) {
+                redis_reply_taken(rf);
+                redis_iostats_reply(rf, reply);
+                redis_readahead_consume(rf, reply);
+            } else {
+                DLOG("unexpected reply while idle");
+                redis_cache_clear(rf->cache);
+                freeReplyObject(reply);
+            }
+        }
+    }
+}
+
+/* Round trip to redis so every invalidation for writes that completed
+ * before now has been delivered to us */
+static int redis_cache_sync_invalidations(RedisFile *rf) {
+    redisReply *reply = redis_command(rf, "PING");
+    if (reply == NULL) {
+        redis_cache_clear(rf->cache);
+        return REDIS_ERR;
+    }
+    freeReplyObject(reply);
+    return REDIS_OK;
+}
+
+/* Switch the connection to RESP3 and have redis track the keys we read.
+ * Fails on servers older than redis 6 */
+static int redis_enable_tracking(RedisFile *rf) {
+    redisReply *reply = redis_command(rf, "HELLO 3");
+    if (reply == NULL)
+        return REDIS_ERR;
+    bool ok = reply->type != REDIS_REPLY_ERROR;
+    freeReplyObject(reply);
+    if (!ok)
+        return REDIS_ERR;
+
+    rf->redisctx->privdata = rf;
+    redisSetPushCallback(rf->redisctx, redis_push_callback);
+
+    // NOLOOP: we drop our own writes from the cache as we make them. For
+    // layout=hash any write of ours would otherwise flush the whole cache
+    if ((reply = redis_command(rf, "CLIENT TRACKING on NOLOOP")) == NULL)
+        return REDIS_ERR;
+    ok = reply->type == REDIS_REPLY_STATUS;
+    freeReplyObject(reply);
+    return ok ? REDIS_OK : REDIS_ERR;
+}
+
+/* Stop tracking before the connection goes back to the pool.  Any
+ * invalidations still in flight are delivered before the reply */
+static int redis_disable_tracking(RedisFile *rf) {
+    redisReply *reply;
+    if ((reply = redis_command(rf, "CLIENT TRACKING off")) == NULL)
+        return REDIS_ERR;
+    bool ok = reply->type == REDIS_REPLY_STATUS;
+    freeReplyObject(reply);
+    return ok ? REDIS_OK : REDIS_ERR;
+}
+
+
+/* journal storage
+ *
+ * sqlite writes a rollback journal front to back (the header at the start
+ * is all it goes back to rewrite) and only reads it to roll a transaction
+ * back.  So a journal isn't split into blocks with a length key alongside.
+ * It is kept in segments of REDISVFS_JOURNAL_SEGMENT bytes, named
+ * "<prefix>:seg0", "<prefix>:seg1" and so on, and a write is an APPEND to
+ * the last of them (SETRANGE if it isn't at the end).  Normally that is
+ * one command, with no length to update.
+ *
+ * Every segment but the last is full, so the length of the journal is
+ * where the last one ends.  A gap left by writing past the end is zero
+ * filled to keep it that way.  The length is kept locally once known,
+ * which it is after most writes as APPEND and SETRANGE reply with the
+ * length of the segment.  Otherwise it is found with STRLEN of the
+ * segments, a batch at a time, up to the first that isn't full.
+ *
+ * Truncating trims the segment the new end falls in with a short script
+ * and UNLINKs the ones after it, a batch at a time until one comes up
+ * short.  Every key is named in the command that touches it.  Deleting a
+ * journal UNLINKs its segments the same way (see space reclamation).
+ */
+
+/* Cut KEYS[1] (a journal segment) to its first ARGV[1] bytes */
+static RedisScript redis_jtrim_script = { .text =
+    "local v=redis.call('GETRANGE',KEYS[1],0,ARGV[1]-1) "
+    "if #v>0 then redis.call('SET',KEYS[1],v) end "
+    "return #v" };
+
+static inline int64_t _start_of_next_segment(int64_t offset) {
+    return (offset / REDISVFS_JOURNAL_SEGMENT + 1) * REDISVFS_JOURNAL_SEGMENT;
+}
+
+/* Queue an UNLINK of journal segments [first, first+count) */
+static int redis_resp_unlink_segments(RedisFile *rf, int64_t first, int count) {
+    resp_begin(rf, 1 + count);
+    resp_arg(rf, "UNLINK", 6);
+    for (int64_t seg=first; seg<first+count; ++seg) {
+        char key[REDISVFS_KEYBUFLEN];
+        int keylen = get_segmentkey(rf, seg * REDISVFS_JOURNAL_SEGMENT, key);
+        resp_arg(rf, key, keylen);
+    }
+    return resp_end(rf);
+}
+
+/* UNLINK segments from first on until a batch comes up short.  Adds how
+ * many there were to *unlinked */
+static int redis_unlink_segments_from(RedisFile *rf, int64_t first, sqlite3_int64 *unlinked) {
+    for (;; first += REDISVFS_JOURNAL_BATCH) {
+        if (redis_resp_unlink_segments(rf, first, REDISVFS_JOURNAL_BATCH) != REDIS_OK)
+            return REDIS_ERR;
+        redisReply *reply;
+        if (redis_get_reply(rf, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        bool more = false;
+        int ret = REDIS_ERR;
+        if (reply->type == REDIS_REPLY_INTEGER) {
+            *unlinked += reply->integer;
+            more = reply->integer == REDISVFS_JOURNAL_BATCH;
+            ret = REDIS_OK;
+        } else {
+            redis_debugreply(reply);
+        }
+        freeReplyObject(reply);
+        if (ret != REDIS_OK || !more)
+            return ret;
+    }
+}
+
+// WARNING: Don't use in pipeline
+static int64_t redis_journal_size(RedisFile *rf) {
+    if (rf->filesize >= 0)
+        return rf->filesize;
+
+    int64_t size = -1;
+    for (int64_t first=0; size < 0; first += REDISVFS_JOURNAL_BATCH) {
+        for (int64_t seg=first; seg<first+REDISVFS_JOURNAL_BATCH; ++seg) {
+            char key[REDISVFS_KEYBUFLEN];
+            int keylen = get_segmentkey(rf, seg * REDISVFS_JOURNAL_SEGMENT, key);
+            resp_begin(rf, 2);
+            resp_arg(rf, "STRLEN", 6);
+            resp_arg(rf, key, keylen);
+            if (resp_end(rf) != REDIS_OK)
+                return -1;
+        }
+        // Take every reply, even past the last segment
+        bool failed = false;
+        for (int64_t seg=first; seg<first+REDISVFS_JOURNAL_BATCH; ++seg) {
+            redisReply *reply;
+            if (redis_get_reply(rf, &reply) != REDIS_OK)
+                return -1;
+            if (reply->type != REDIS_REPLY_INTEGER) {
+                redis_debugreply(reply);
+                failed = true;
+            } else if (size < 0 && reply->integer < REDISVFS_JOURNAL_SEGMENT) {
+                size = seg * REDISVFS_JOURNAL_SEGMENT + reply->integer;
+            }
+            freeReplyObject(reply);
+        }
+        if (failed)
+            return -1;
+    }
+    rf->filesize = size;
+    return rf->filesize;
+}
+
+/* APPEND, or SETRANGE if the write isn't at the end of the segment.
+ * pre: [offset..offset+len) is within one segment */
+static int redis_journal_queue_write(RedisFile *rf, int64_t offset, const char *buf, int64_t len, bool append) {
+    char key[REDISVFS_KEYBUFLEN];
+    int keylen = get_segmentkey(rf, offset, key);
+    if (append) {
+        resp_begin(rf, 3);
+        resp_arg(rf, "APPEND", 6);
+        resp_arg(rf, key, keylen);
+    } else {
+        resp_begin(rf, 4);
+        resp_arg(rf, "SETRANGE", 8);
+        resp_arg(rf, key, keylen);
+        resp_arg_int(rf, offset % REDISVFS_JOURNAL_SEGMENT);
+    }
+    resp_arg(rf, buf, len);
+    return resp_end(rf);
+}
+
+static int redis_journal_write(RedisFile *rf, const char *buf, int iAmt, int64_t iOfst) {
+    // Only a journal we haven't written to yet, written anywhere but the
+    // start, needs to ask where the end is
+    if (iOfst > 0 && redis_journal_size(rf) < 0)
+        return REDIS_ERR;
+
+    int64_t eof = rf->filesize;
+    int64_t endp = iOfst + iAmt;
+    int queued = 0;
+    int ret = REDIS_OK;
+
+    // Zero fill a gap before the write.  SETRANGE pads a segment up to the
+    // byte it writes, so the last zero in each segment is enough
+    static const char zero = 0;
+    for (int64_t leftp=eof; leftp>=0 && leftp<iOfst && ret == REDIS_OK; leftp=_start_of_next_segment(leftp)) {
+        int64_t next = _start_of_next_segment(leftp);
+        ret = redis_journal_queue_write(rf, (next < iOfst ? next : iOfst) - 1, &zero, 1, false);
+        if (ret == REDIS_OK)
+            queued++;
+    }
+    for (int64_t leftp=iOfst; leftp<endp && ret == REDIS_OK; leftp=_start_of_next_segment(leftp)) {
+        int64_t next = _start_of_next_segment(leftp);
+        int64_t rightp = next < endp ? next : endp;
+        ret = redis_journal_queue_write(rf, leftp, buf + (leftp - iOfst), rightp - leftp,
+                eof >= 0 && leftp >= eof);
+        if (ret == REDIS_OK)
+            queued++;
+    }
+
+    // Each reply is the length of the segment written
+    long long seglen = -1;
+    for (int i=0; i<queued; ++i) {
+        redisReply *reply;
+        if (redis_get_reply(rf, &reply) == REDIS_ERR) {
+            DLOG("ERROR: redisGetReply: %s", rf->redisctx->errstr);
+            rf->filesize = -1;
+            return REDIS_ERR;
+        }
+        redis_debugreply(reply);
+        if (reply->type != REDIS_REPLY_INTEGER)
+            ret = REDIS_ERR;
+        else
+            seglen = reply->integer;
+        freeReplyObject(reply);
+    }
+
+    if (ret == REDIS_ERR)
+        rf->filesize = -1;
+    else if (eof >= 0)
+        rf->filesize = endp > eof ? endp : eof;
+    else if (seglen >= 0 && seglen < REDISVFS_JOURNAL_SEGMENT)
+        // A segment that isn't full is the last one
+        rf->filesize = (endp-1) / REDISVFS_JOURNAL_SEGMENT * REDISVFS_JOURNAL_SEGMENT + seglen;
+    return ret;
+}
+
+/* Returns an SQLITE_* code.  Past the end of the journal reads as zeros */
+static int redis_journal_read(RedisFile *rf, char *buf, int iAmt, int64_t iOfst) {
+    int64_t endp = iOfst + iAmt;
+    int queued = 0;
+    int ret = REDIS_OK;
+    for (int64_t leftp=iOfst; leftp<endp && ret == REDIS_OK; leftp=_start_of_next_segment(leftp)) {
+        int64_t next = _start_of_next_segment(leftp);
+        int64_t rightp = next < endp ? next : endp;
+        char key[REDISVFS_KEYBUFLEN];
+        int keylen = get_segmentkey(rf, leftp, key);
+        resp_begin(rf, 4);
+        resp_arg(rf, "GETRANGE", 8);
+        resp_arg(rf, key, keylen);
+        resp_arg_int(rf, leftp % REDISVFS_JOURNAL_SEGMENT);
+        resp_arg_int(rf, (rightp-1) % REDISVFS_JOURNAL_SEGMENT);
+        ret = resp_end(rf);
+        if (ret == REDIS_OK)
+            queued++;
+    }
+
+    bool failed = ret == REDIS_ERR;
+    bool shortread = false;
+    RedisReplySink sink;
+    int64_t leftp = iOfst;
+    for (int i=0; i<queued; ++i, leftp=_start_of_next_segment(leftp)) {
+        int64_t next = _start_of_next_segment(leftp);
+        int64_t want = (next < endp ? next : endp) - leftp;
+        char *dst = buf + (leftp - iOfst);
+
+        redisReply *reply;
+        if (redis_get_reply_sink(rf, &sink, dst, want, &reply) == REDIS_ERR) {
+            DLOG("ERROR: redisGetReply: %s", rf->redisctx->errstr);
+            return SQLITE_IOERR_READ;
+        }
+        int64_t got = 0;
+        if (reply->type == REDIS_REPLY_STRING && reply->len <= want)
+            got = reply->len;
+        else
+            failed = true;
+        if (got < want) {
+            shortread = true;
+            memset(dst+got, 0, want-got);
+        }
+        redis_reply_release(&sink, reply);
+    }
+    if (leftp < endp)
+        memset(buf + (leftp - iOfst), 0, endp - leftp);
+
+    if (failed)
+        return SQLITE_IOERR_READ;
+    return shortread ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+}
+
+static int redis_journal_truncate(RedisFile *rf, int64_t newsize) {
+    rf->filesize = -1;
+    int64_t seg = newsize / REDISVFS_JOURNAL_SEGMENT;
+    if (newsize > seg * REDISVFS_JOURNAL_SEGMENT) {
+        char key[REDISVFS_KEYBUFLEN];
+        char keep[24];
+        get_segmentkey(rf, newsize, key);
+        snprintf(keep, sizeof(keep), "%lld", (long long)(newsize - seg * REDISVFS_JOURNAL_SEGMENT));
+        const char *args[] = { key, keep };
+        redisReply *reply = redis_script_command(rf, &redis_jtrim_script, 1, 2, args);
+        if (reply == NULL)
+            return REDIS_ERR;
+        bool ok = reply->type == REDIS_REPLY_INTEGER;
+        if (!ok) {
+            redis_debugreply(reply);
+        }
+        freeReplyObject(reply);
+        if (!ok)
+            return REDIS_ERR;
+        seg++;
+    }
+    sqlite3_int64 unlinked = 0;
+    if (redis_unlink_segments_from(rf, seg, &unlinked) != REDIS_OK)
+        return REDIS_ERR;
+    rf->filesize = newsize;
+    return REDIS_OK;
+}
+
+
+/* block store backends
+ *
+ * The file layer only ever stores blocks and lengths through rf->backend.
+ * Block commands (get to extend) are queued, pushed out with flush, and
+ * their replies taken with reply in the order they were queued, so a
+ * multi-block read or write is one round trip whatever is behind it.
+ * The rest wait for their own reply.
+ *
+ * redis is the real thing (below).  memory keeps files in this process,
+ * and delay wraps either with a fixed latency per round trip, so the VFS
+ * can be benchmarked and profiled without a server or a network (see
+ * backend= in redisvfs_open).
+ */
+
+struct RedisBackend {
+    const char *name;
+
+    // Queued.  get replies with the block or nil, getrange with part of
+    // it ("" if there is none), set with a status, setrange (which zero
+    // pads) and extend with the new length, del with 1 if it was there
+    int (*get)(RedisFile *rf, int64_t offset);
+    int (*getrange)(RedisFile *rf, int64_t offset, int64_t len);
+    int (*set)(RedisFile *rf, int64_t offset, const char *data, size_t len);
+    int (*setrange)(RedisFile *rf, int64_t offset, const char *data, int64_t len);
+    int (*del)(RedisFile *rf, int64_t offset);
+    int (*extend)(RedisFile *rf, int64_t minlen);
+    // Queued, and NULL if the backend can't (see range I/O).  readrange
+    // replies with [offset, offset+len) cut short at the end of the file,
+    // writerange with the new length
+    int (*readrange)(RedisFile *rf, int64_t offset, int64_t len);
+    int (*writerange)(RedisFile *rf, int64_t offset, const char *data, int64_t len);
+    int (*flush)(RedisFile *rf);
+    // Next reply.  If dst isn't NULL a block goes there (see the reply
+    // sink).  Either way it is freed with redis_reply_release
+    int (*reply)(RedisFile *rf, RedisReplySink *sink, char *dst, size_t cap, redisReply **reply);
+
+    // Length of the file, 0 if there is no such file or -1
+    int64_t (*length)(RedisFile *rf);
+    // 1 if anything of the file is stored, 0 if not, or -1
+    int (*exists)(RedisFile *rf);
+    int (*truncate)(RedisFile *rf, int64_t newsize, bool delete);
+    // Returns the lock level held afterwards, or -1 (see locking)
+    int (*lock)(RedisFile *rf, const char *op, int level);
+    // Wait for what was written to be as durable as durability= asks
+    int (*sync)(RedisFile *rf);
+    int (*load_blocksize)(RedisFile *rf, const char *zName);
+    int (*save_blocksize)(RedisFile *rf, int iAmt, sqlite3_int64 iOfst);
+};
+
+
+/* redis blockio */
+
+/*
+ * Three storage layouts, chosen per database with layout=keys|hash|blockfile:
+ *
+ * keys (default): every block is its own string key "<prefix>:<hexblock>",
+ *   with "<prefix>:size" and "<prefix>:blocksize" alongside.
+ * hash: the whole file is one hash "<prefix>" with a "<hexblock>" field
+ *   per block plus "size" and "blocksize" fields.  Far less per key
+ *   overhead in redis, and deleting a file is a single UNLINK.  Hashes
+ *   have no GETRANGE/SETRANGE, so partial block reads fetch the whole
+ *   block and partial writes splice server side in Lua.
+ * blockfile: the blocks and length are one key "<prefix>" of the type
+ *   the blockfile module (blockfile.c) adds, with "<prefix>:blocksize"
+ *   alongside.  Any byte range is read or written with one command, and
+ *   the write raises the length itself.  Picked for a new main database
+ *   whenever the server has the module, unless layout= says otherwise.
+ */
+
+/* Zeros to write over a block with layout=blockfile, which has no delete */
+static const char redis_zero_block[REDISVFS_MAX_BLOCKSIZE];
+
+/* layout=blockfile.  data NULL to read len bytes */
+static int redis_resp_blockfile(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    resp_begin(rf, 4);
+    if (data)
+        resp_arg(rf, "BLOCKFILE.WRITE", 15);
+    else
+        resp_arg(rf, "BLOCKFILE.READ", 14);
+    resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    resp_arg_int(rf, offset);
+    if (data)
+        resp_arg(rf, data, len);
+    else
+        resp_arg_int(rf, len);
+    return resp_end(rf);
+}
+
+static int redis_resp_get(RedisFile *rf, int64_t offset) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, _start_of_block(rf, offset), NULL, rf->blocksize);
+    if (rf->hashlayout) {
+        resp_begin(rf, 3);
+        resp_arg(rf, "HGET", 4);
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        resp_begin(rf, 2);
+        resp_arg(rf, "GET", 3);
+    }
+    resp_arg_block(rf, offset);
+    return resp_end(rf);
+}
+
+/* Hashes have no GETRANGE, so layout=hash fetches the whole block.  The
+ * caller trims it */
+static int redis_resp_getrange(RedisFile *rf, int64_t offset, int64_t len) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, offset, NULL, len);
+    if (rf->hashlayout)
+        return redis_resp_get(rf, _start_of_block(rf, offset));
+
+    // GETRANGE range is inclusive of first and last indices
+    int64_t block_first = offset % rf->blocksize;
+    int64_t block_last = block_first + len - 1;
+
+    resp_begin(rf, 4);
+    resp_arg(rf, "GETRANGE", 8);
+    resp_arg_block(rf, offset);
+    resp_arg_int(rf, block_first);
+    resp_arg_int(rf, block_last);
+    return resp_end(rf);
+}
+
+static int redis_resp_set(RedisFile *rf, int64_t offset, const char *data, size_t len) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, offset, data, len);
+    if (rf->hashlayout) {
+        resp_begin(rf, 4);
+        resp_arg(rf, "HSET", 4);
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        resp_begin(rf, 3);
+        resp_arg(rf, "SET", 3);
+    }
+    resp_arg_block(rf, offset);
+    resp_arg(rf, data, len);
+    return resp_end(rf);
+}
+
+/* Atomic max on the length key, evaluated server side.
+ * Replies with the resulting length */
+static RedisScript redis_maxlen_script = { .text =
+    "local n=tonumber(ARGV[1]) "
+    "local c=tonumber(redis.call('GET',KEYS[1]) or 0) "
+    "if n>c then redis.call('SET',KEYS[1],ARGV[1]) return n end "
+    "return c" };
+
+/* Same, on the size field for layout=hash */
+static RedisScript redis_hmaxlen_script = { .text =
+    "local n=tonumber(ARGV[1]) "
+    "local c=tonumber(redis.call('HGET',KEYS[1],'size') or 0) "
+    "if n>c then redis.call('HSET',KEYS[1],'size',ARGV[1]) return n end "
+    "return c" };
+
+/* SETRANGE for a hash field: KEYS[1] hash, ARGV field, offset, data.
+ * Zero pads like SETRANGE does */
+static RedisScript redis_hsetrange_script = { .text =
+    "local v=redis.call('HGET',KEYS[1],ARGV[1]) or '' "
+    "local o=tonumber(ARGV[2]) "
+    "if #v<o then v=v..string.rep('\\0',o-#v) end "
+    "v=v:sub(1,o)..ARGV[3]..v:sub(o+#ARGV[3]+1) "
+    "redis.call('HSET',KEYS[1],ARGV[1],v) "
+    "return #v" };
+
+static int redis_resp_setrange(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, offset, data, len);
+    int64_t block_first = offset % rf->blocksize;
+    if (rf->hashlayout) {
+        if (redis_resp_script_begin(rf, &redis_hsetrange_script, 1, 4) != REDIS_OK)
+            return REDIS_ERR;
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        DLOG("SETRANGE block %lld +%lld ...(len %lld)", (long long)(offset / rf->blocksize),
+                (long long)block_first, (long long)len);
+        resp_begin(rf, 4);
+        resp_arg(rf, "SETRANGE", 8);
+    }
+    resp_arg_block(rf, offset);
+    resp_arg_int(rf, block_first);
+    resp_arg(rf, data, len);
+    return resp_end(rf);
+}
+
+static int redis_resp_del(RedisFile *rf, int64_t offset) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, _start_of_block(rf, offset), redis_zero_block, rf->blocksize);
+    if (rf->hashlayout) {
+        resp_begin(rf, 3);
+        resp_arg(rf, "HDEL", 4);
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        resp_begin(rf, 2);
+        resp_arg(rf, "UNLINK", 6);
+    }
+    resp_arg_block(rf, offset);
+    return resp_end(rf);
+}
+
+static int redis_resp_extend(RedisFile *rf, int64_t minlen) {
+    // An empty write only raises the length
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, minlen, "", 0);
+    if (rf->hashlayout) {
+        if (redis_resp_script_begin(rf, &redis_hmaxlen_script, 1, 2) != REDIS_OK)
+            return REDIS_ERR;
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        // The length is a plain integer key.  Raising it has to be a max
+        // rather than a SET so that interleaved writers can't shrink the file.
+        char key[REDISVFS_KEYBUFLEN];
+        int keylen = get_filesizekey(rf, key);
+        if (redis_resp_script_begin(rf, &redis_maxlen_script, 1, 2) != REDIS_OK)
+            return REDIS_ERR;
+        resp_arg(rf, key, keylen);
+    }
+    resp_arg_int(rf, minlen);
+    return resp_end(rf);
+}
+
+/* range_io=1: a whole xRead or xWrite as one script (see range I/O).
+ * KEYS the length key (the hash for layout=hash) and for layout=keys the
+ * key of every block in the range.  ARGV 'r' or 'w', block size, offset,
+ * length to read or data to write, and 1 for layout=hash.
+ * A read replies with what the file has of the range, holes zero filled.
+ * A write stores blocks the same way the pipeline does (whole ones SET,
+ * or deleted if all zeros, partial ones spliced) then raises the length.
+ * Replies with the resulting length */
+static RedisScript redis_range_script = { .text =
+    "local h=ARGV[5]=='1' "
+    "local bs=tonumber(ARGV[2]) "
+    "local o=tonumber(ARGV[3]) "
+    "local b0=math.floor(o/bs) "
+    "local function field(i) return string.format('%x',b0+i) end "
+    "local function size() "
+    "if h then return tonumber(redis.call('HGET',KEYS[1],'size') or 0) end "
+    "return tonumber(redis.call('GET',KEYS[1]) or 0) end "
+    "if ARGV[1]=='r' then "
+    "local e=math.min(o+tonumber(ARGV[4]),size()) "
+    "local t={} local p=o local i=0 "
+    "while p<e do "
+    "local s=p-(b0+i)*bs local n=math.min(bs-s,e-p) local v "
+    "if h then v=string.sub(redis.call('HGET',KEYS[1],field(i)) or '',s+1,s+n) "
+    "else v=redis.call('GETRANGE',KEYS[2+i],s,s+n-1) end "
+    "t[#t+1]=v..string.rep('\\0',n-#v) p=p+n i=i+1 end "
+    "return table.concat(t) end "
+    "local d=ARGV[4] local z=string.rep('\\0',bs) local p=0 local i=0 "
+    "while p<#d do "
+    "local s=o+p-(b0+i)*bs local n=math.min(bs-s,#d-p) "
+    "local v=string.sub(d,p+1,p+n) "
+    "if n==bs and v==z then "
+    "if h then redis.call('HDEL',KEYS[1],field(i)) else redis.call('UNLINK',KEYS[2+i]) end "
+    "elseif n==bs then "
+    "if h then redis.call('HSET',KEYS[1],field(i),v) else redis.call('SET',KEYS[2+i],v) end "
+    "elseif h then "
+    "local c=redis.call('HGET',KEYS[1],field(i)) or '' "
+    "if #c<s then c=c..string.rep('\\0',s-#c) end "
+    "redis.call('HSET',KEYS[1],field(i),c:sub(1,s)..v..c:sub(s+n+1)) "
+    "else redis.call('SETRANGE',KEYS[2+i],s,v) end "
+    "p=p+n i=i+1 end "
+    "local e=o+#d local c=size() "
+    "if e<=c then return c end "
+    "if h then redis.call('HSET',KEYS[1],'size',string.format('%d',e)) "
+    "else redis.call('SET',KEYS[1],string.format('%d',e)) end "
+    "return e" };
+
+/* data NULL to read len bytes.  layout=blockfile has this natively */
+static int redis_resp_range(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    if (rf->blockfile)
+        return redis_resp_blockfile(rf, offset, data, len);
+    int64_t firstblk = _start_of_block(rf, offset);
+    int nkeys = rf->hashlayout ? 1 : 1 + (_start_of_block(rf, offset+len-1) - firstblk) / rf->blocksize + 1;
+
+    if (redis_resp_script_begin(rf, &redis_range_script, nkeys, nkeys + 5) != REDIS_OK)
+        return REDIS_ERR;
+    if (rf->hashlayout) {
+        resp_arg(rf, rf->keyprefix, rf->keyprefixlen);
+    } else {
+        char key[REDISVFS_KEYBUFLEN];
+        int keylen = get_filesizekey(rf, key);
+        resp_arg(rf, key, keylen);
+        for (int64_t blkstart=firstblk; blkstart<offset+len; blkstart+=rf->blocksize)
+            resp_arg_block(rf, blkstart);
+    }
+    resp_arg(rf, data ? "w" : "r", 1);
+    resp_arg_int(rf, rf->blocksize);
+    resp_arg_int(rf, offset);
+    if (data)
+        resp_arg(rf, data, len);
+    else
+        resp_arg_int(rf, len);
+    resp_arg(rf, rf->hashlayout ? "1" : "0", 1);
+    return resp_end(rf);
+}
+
+static int redis_resp_readrange(RedisFile *rf, int64_t offset, int64_t len) {
+    return redis_resp_range(rf, offset, NULL, len);
+}
+
+static int redis_resp_writerange(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    return redis_resp_range(rf, offset, data, len);
+}
+
+/* The scripts queued behind block commands, which can't stop to load one
+ * with replies still to come.  Loaded at open if the process never has,
+ * and with again after a NOSCRIPT (say redis restarted), which the
+ * replies note in rf->noscript */
+static int redis_file_scripts_load(RedisFile *rf, bool again) {
+    RedisScript *scripts[] = {
+        rf->hashlayout ? &redis_hmaxlen_script : &redis_maxlen_script,
+        rf->hashlayout ? &redis_hsetrange_script : NULL,
+        rf->rangeio ? &redis_range_script : NULL,
+    };
+    rf->noscript = false;
+    for (size_t i=0; i<sizeof(scripts)/sizeof(scripts[0]); ++i) {
+        char sha[sizeof(scripts[i]->sha)];
+        if (!scripts[i])
+            continue;
+        _script_sha(scripts[i], sha);
+        if ((again || !*sha) && redis_script_load(rf, scripts[i]) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* hiredis only writes out a pipeline when the first reply is asked for.
+ * Cluster and io_conns connections are all written at once, and mux=1
+ * hands the pipeline to the I/O thread */
+static int redis_flush(RedisFile *rf) {
+    if (rf->mux)
+        return redis_mux_flush(rf->mux);
+    if (rf->cluster) {
+        redis_cluster_flush(rf);
+        return REDIS_OK;
+    }
+    int done = 0;
+    while (!done) {
+        if (redisBufferWrite(rf->redisctx, &done) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static int redis_reply(RedisFile *rf, RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    int ret = dst ? redis_get_reply_sink(rf, sink, dst, cap, reply) : redis_get_reply(rf, reply);
+    if (ret == REDIS_OK && _noscript(*reply))
+        rf->noscript = true;
+    return ret;
+}
+
+static int64_t redis_length(RedisFile *rf) {
+    redisReply *reply;
+    if (rf->blockfile) {
+        reply = redis_command(rf, "BLOCKFILE.LENGTH %s", rf->keyprefix);
+    } else if (rf->hashlayout) {
+        reply = redis_command(rf, "HGET %s size", rf->keyprefix);
+    } else {
+        char key[REDISVFS_KEYBUFLEN];
+        get_filesizekey(rf, key);
+        reply = redis_command(rf, "GET %s", key);
+    }
+    if (reply == NULL) {
+            return -1;
+    }
+    redis_debugreply(reply);
+
+    int64_t filesize;
+    if (reply->type == REDIS_REPLY_NIL) {
+            filesize = 0;
+    } else if (reply->type == REDIS_REPLY_INTEGER) {
+            filesize = reply->integer;
+    } else if (reply->type != REDIS_REPLY_STRING) {
+            filesize = -1;
+    } else {
+            filesize = atoll(reply->str);
+    }
+    freeReplyObject(reply);
+    return filesize;
+}
+
+/* Whichever layout the file has, and whether it's a journal or not, one
+ * of these is there: the hash or blockfile key, the size key, or the
+ * first journal segment.  They share a slot in cluster mode */
+static int redis_exists(RedisFile *rf) {
+    char sizekey[REDISVFS_KEYBUFLEN];
+    char segkey[REDISVFS_KEYBUFLEN];
+    get_filesizekey(rf, sizekey);
+    get_segmentkey(rf, 0, segkey);
+    redisReply *reply = redis_command(rf, "EXISTS %s %s %s", rf->keyprefix, sizekey, segkey);
+    if (reply == NULL)
+        return -1;
+    int ret = reply->type == REDIS_REPLY_INTEGER ? reply->integer > 0 : -1;
+    freeReplyObject(reply);
+    return ret;
+}
+
+
+/* blockio
+ *
+ * What the file layer queues.  Zero blocks and compression are dealt with
+ * here, so every backend gets them
+ */
+
+static int redis_queuecmd_whole_block_read(RedisFile *rf, const sqlite3_int64 offset) {
+    assert((offset % rf->blocksize) == 0);
+    return rf->backend->get(rf, offset);
+}
+
+/* Length is only cached while nobody else can change it under us.
+ * Journals are only ever opened while the database lock is held */
+static inline bool _filesize_cacheable(RedisFile *rf) {
+    return (rf->openflags & SQLITE_OPEN_MAIN_JOURNAL) || rf->locklevel >= SQLITE_LOCK_SHARED;
+}
+
+/* caller is saying filesize is at least 'minfilesize'
+ * appends 1 command.  Safe to pipeline behind the block writes */
+static int redis_queue_increase_filesize_to(RedisFile *rf, int64_t minfilesize) {
+    return rf->backend->extend(rf, minfilesize);
+}
+static int redis_consume_increase_filesize_to(RedisFile *rf) {
+    RedisReplySink sink;
+    redisReply *reply;
+    if (rf->backend->reply(rf, &sink, NULL, 0, &reply) == REDIS_ERR)
+        return REDIS_ERR;
+    int ret = REDIS_OK;
+    if (reply->type == REDIS_REPLY_INTEGER) {
+        rf->filesize = reply->integer;
+    } else {
+        redis_debugreply(reply);
+        rf->filesize = -1;
+        ret = REDIS_ERR;
+    }
+    redis_reply_release(&sink, reply);
+    return ret;
+}
+
+// WARNING: Don't use in pipeline
+// Returns 0 if the file doesnt exist
+static int64_t redis_get_filesize(RedisFile *rf) {
+    if (rf->filesize >= 0 && _filesize_cacheable(rf))
+        return rf->filesize;
+    if (rf->journal)
+        return redis_journal_size(rf);
+    rf->filesize = rf->backend->length(rf);
+    return rf->filesize;
+}
+
+/* Read the whole block at blkstart into block, zero filled past the end
+ * of the file.  For patching before it's written back compressed.
+ * pre: nothing outstanding on the connection */
+static int redis_codec_load_block(RedisFile *rf, char *block, int64_t blkstart) {
+    int64_t filesize = redis_get_filesize(rf);
+    if (filesize < 0)
+        return REDIS_ERR;
+    if (blkstart >= filesize) {
+        memset(block, 0, rf->blocksize);
+        return REDIS_OK;
+    }
+    int rc = redisvfs_read(&rf->base, block, rf->blocksize, blkstart);
+    return (rc == SQLITE_OK || rc == SQLITE_IOERR_SHORT_READ) ? REDIS_OK : REDIS_ERR;
+}
+
+static int redis_queuecmd_delete_block(RedisFile *rf, sqlite3_int64 offset) {
+    assert((offset % rf->blocksize) == 0);
+    return rf->backend->del(rf, offset);
+}
+
+/* pre: buf is >= rf->blocksize */
+static int redis_queuecmd_whole_block_write(RedisFile *rf, int64_t offset, const char *buf) {
+    assert((offset % rf->blocksize) == 0);
+
+    // Missing blocks read as zeros, so there's no need to store them
+    if (_block_is_zero(buf, rf->blocksize)) {
+        rf->compressstats.zero_blocks++;
+        return redis_queuecmd_delete_block(rf, offset);
+    }
+    const char *data = buf;
+    size_t len = rf->blocksize;
+    if (rf->codec)
+        len = redis_codec_encode(rf, buf, &data);
+    return rf->backend->set(rf, offset, data, len);
+}
+
+/* Compressed blocks read the whole block (as does layout=hash).  The
+ * caller trims it */
+static int redis_queuecmd_partial_block_read(RedisFile *rf, int64_t offset, int64_t len) {
+    assert(len > 0);
+    assert(offset % rf->blocksize + len <= rf->blocksize);
+    if (rf->codec)
+        return redis_queuecmd_whole_block_read(rf, _start_of_block(rf, offset));
+    return rf->backend->getrange(rf, offset, len);
+}
+
+static int redis_queuecmd_partial_block_write(RedisFile *rf, int64_t offset, const char *buf, int64_t len) {
+    assert(len > 0);
+    assert((offset % rf->blocksize + len) <= rf->blocksize);
+    return rf->backend->setrange(rf, offset, buf, len);
+}
+
+
+/* space reclamation
+ *
+ * Truncating or deleting a file runs a server side script that moves the
+ * length (or deletes it along with the block size and codec) and replies
+ * with the old length, so that the blocks to free are known exactly.
+ * The blocks past the new end are then unlinked from here, in pipelined
+ * batches of single key commands, so the server is never held up for
+ * longer than one of them whatever the size of the file.  That is done
+ * before xTruncate or xDelete returns, still under the lock, as a writer
+ * that came after could otherwise extend the file over blocks we have yet
+ * to free.  Blocks left behind by a client that dies in between, or by
+ * older versions that only rewrote the length, are orphans, which
+ * REDISVFS_FCNTL_RECLAIM_ORPHANS finds and frees.
+ *
+ * The scripts only touch the keys they are given, which all share the
+ * file's hash tag in cluster mode.  layout=hash empties a whole file with
+ * one UNLINK, and layout=blockfile frees its pages in the module.
+ *
+ * xDelete isn't told what kind of file it is deleting, so deleting any
+ * file also UNLINKs rollback journal segments (see journal storage), a
+ * batch of names at a time until one comes up short.
+ */
+
+static RedisReclaimStats redis_reclaim_stats;
+
+static void redis_count_reclaimed(sqlite3_int64 blocks_freed, sqlite3_int64 orphans_found, sqlite3_int64 orphans_freed) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    sqlite3_mutex_enter(mutex);
+    redis_reclaim_stats.blocks_freed += blocks_freed;
+    redis_reclaim_stats.orphans_found += orphans_found;
+    redis_reclaim_stats.orphans_freed += orphans_freed;
+    sqlite3_mutex_leave(mutex);
+}
+
+static void redis_get_reclaim_stats(RedisReclaimStats *stats) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    sqlite3_mutex_enter(mutex);
+    *stats = redis_reclaim_stats;
+    sqlite3_mutex_leave(mutex);
+}
+
+/* Sum the replies to queued UNLINKs/HDELs */
+static int _consume_orphans(RedisFile *rf, int queued, sqlite3_int64 *freed) {
+    int ret = REDIS_OK;
+    for (int i=0; i<queued; ++i) {
+        redisReply *reply;
+        if (redis_get_reply(rf, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (reply->type == REDIS_REPLY_INTEGER)
+            *freed += reply->integer;
+        else
+            ret = REDIS_ERR;
+        freeReplyObject(reply);
+    }
+    return ret;
+}
+
+/* KEYS size key, blocksize key, codec key.  ARGV default block size, new
+ * length, "1" to delete the file outright.  Replies with the old length,
+ * the block size and 0 blocks freed */
+static RedisScript redis_truncate_script = { .text =
+    "local bs=tonumber(redis.call('GET',KEYS[2]) or ARGV[1]) "
+    "local c=tonumber(redis.call('GET',KEYS[1]) or 0) "
+    "if ARGV[3]=='1' then redis.call('UNLINK',KEYS[1],KEYS[2],KEYS[3]) "
+    "else redis.call('SET',KEYS[1],ARGV[2]) end "
+    "return {c,bs,0}" };
+
+/* Same for layout=hash.  KEYS the hash.  Emptying or deleting is one
+ * UNLINK whatever the size of the file, and replies with an old length of
+ * 0 and the number of blocks that went with it */
+static RedisScript redis_htruncate_script = { .text =
+    "local b,z=unpack(redis.call('HMGET',KEYS[1],'blocksize','codec')) "
+    "local bs=tonumber(b or ARGV[1]) "
+    "if ARGV[2]=='0' then "
+    "local f=redis.call('HLEN',KEYS[1])-redis.call('HEXISTS',KEYS[1],'size')-(b and 1 or 0)-(z and 1 or 0) "
+    "redis.call('UNLINK',KEYS[1]) "
+    "if ARGV[3]=='1' then return {0,bs,f} end "
+    "if b then redis.call('HSET',KEYS[1],'blocksize',b) end "
+    "if z then redis.call('HSET',KEYS[1],'codec',z) end "
+    "redis.call('HSET',KEYS[1],'size',0) "
+    "return {0,bs,f} end "
+    "local c=tonumber(redis.call('HGET',KEYS[1],'size') or 0) "
+    "redis.call('HSET',KEYS[1],'size',ARGV[2]) "
+    "return {c,bs,0}" };
+
+/* Same for layout=blockfile.  KEYS the blockfile, block size key.  The
+ * module frees the pages itself, so the old length is given as 0 */
+static RedisScript redis_btruncate_script = { .text =
+    "local f=redis.call('BLOCKFILE.TRUNCATE',KEYS[1],ARGV[2]) "
+    "if ARGV[3]=='1' then redis.call('UNLINK',KEYS[1],KEYS[2]) end "
+    "return {0,tonumber(ARGV[1]),f}" };
+
+/* UNLINK blocks [first..end), from whichever nodes have them in cluster
+ * mode, a batch at a time.  Returns how many there were, or -1 */
+static sqlite3_int64 redis_free_blocks(RedisFile *rf, int64_t first, int64_t end) {
+    const int batch = 1024;
+    sqlite3_int64 freed = 0;
+    int ret = REDIS_OK;
+    for (int64_t blocknum=first; blocknum<end && ret == REDIS_OK; ) {
+        int queued = 0;
+        for (; blocknum<end && queued<batch && ret == REDIS_OK; ++blocknum) {
+            ret = redis_resp_del(rf, blocknum * rf->blocksize);
+            if (ret == REDIS_OK)
+                queued++;
+        }
+        if (_consume_orphans(rf, queued, &freed) != REDIS_OK)
+            ret = REDIS_ERR;
+    }
+    return ret == REDIS_OK ? freed : -1;
+}
+
+/* Queue the truncate script for the layout */
+static int redis_resp_truncate(RedisFile *rf, int64_t newsize, bool delete) {
+    char blocksize[24], length[24];
+    char sizekey[REDISVFS_KEYBUFLEN];
+    char blocksizekey[REDISVFS_KEYBUFLEN];
+    char codeckey[REDISVFS_KEYBUFLEN];
+    snprintf(blocksize, sizeof(blocksize), "%d", rf->blocksize);
+    snprintf(length, sizeof(length), "%lld", (long long)newsize);
+    get_blocksizekey(rf, blocksizekey);
+    if (rf->blockfile) {
+        const char *args[] = { rf->keyprefix, blocksizekey, blocksize, length, delete ? "1" : "0" };
+        return redis_resp_script(rf, &redis_btruncate_script, 2, 5, args);
+    }
+    if (rf->hashlayout) {
+        const char *args[] = { rf->keyprefix, blocksize, length, delete ? "1" : "0" };
+        return redis_resp_script(rf, &redis_htruncate_script, 1, 4, args);
+    }
+    get_filesizekey(rf, sizekey);
+    get_codeckey(rf, codeckey);
+    const char *args[] = { sizekey, blocksizekey, codeckey, blocksize, length, delete ? "1" : "0" };
+    return redis_resp_script(rf, &redis_truncate_script, 3, 6, args);
+}
+
+/* Set the length to newsize and free every block past it.  With delete,
+ * the length and block size go as well, and any journal segments */
+static int redis_truncate_file(RedisFile *rf, int64_t newsize, bool delete) {
+    assert(newsize >= 0);
+    assert(!delete || newsize == 0);
+    if (rf->journal && !delete)
+        return redis_journal_truncate(rf, newsize);
+    rf->filesize = -1;
+
+    // The first batch of segments goes in the same round trip
+    redisReply *reply = NULL;
+    sqlite3_int64 segments = 0;
+    for (int tries=0; ; ++tries) {
+        if (redis_resp_truncate(rf, newsize, delete) != REDIS_OK ||
+                (delete && redis_resp_unlink_segments(rf, 0, REDISVFS_JOURNAL_BATCH) != REDIS_OK) ||
+                redis_get_reply(rf, &reply) != REDIS_OK ||
+                (delete && _consume_orphans(rf, 1, &segments) != REDIS_OK)) {
+            if (reply)
+                freeReplyObject(reply);
+            return REDIS_ERR;
+        }
+        if (tries > 0 || !_noscript(reply))
+            break;
+        DLOG("%s truncate script gone. Reloading", rf->keyprefix);
+        freeReplyObject(reply);
+        reply = NULL;
+        RedisScript *script = rf->blockfile ? &redis_btruncate_script :
+                rf->hashlayout ? &redis_htruncate_script : &redis_truncate_script;
+        if (redis_script_load(rf, script) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    if (segments == REDISVFS_JOURNAL_BATCH &&
+            redis_unlink_segments_from(rf, REDISVFS_JOURNAL_BATCH, &segments) != REDIS_OK) {
+        freeReplyObject(reply);
+        return REDIS_ERR;
+    }
+
+    sqlite3_int64 freed = -1;
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+            reply->element[0]->type == REDIS_REPLY_INTEGER &&
+            reply->element[1]->type == REDIS_REPLY_INTEGER && reply->element[1]->integer > 0 &&
+            reply->element[2]->type == REDIS_REPLY_INTEGER) {
+        // The length goes first.  Blocks left behind by a crash before
+        // they're freed are orphans (see redis_reclaim_orphans)
+        int64_t oldsize = reply->element[0]->integer;
+        int64_t bs = reply->element[1]->integer;
+        freed = redis_free_blocks(rf, (newsize + bs - 1) / bs, (oldsize + bs - 1) / bs);
+        if (freed >= 0)
+            freed += reply->element[2]->integer;
+    } else {
+        redis_debugreply(reply);
+    }
+    freeReplyObject(reply);
+
+    int ret = REDIS_ERR;
+    if (freed >= 0) {
+        DLOG("%s truncated to %lld. %lld blocks freed", rf->keyprefix, (long long)newsize, freed);
+        redis_count_reclaimed(freed, 0, 0);
+        if (!delete)
+            rf->filesize = newsize;
+        ret = REDIS_OK;
+    }
+
+    // Tracking is NOLOOP, so nothing will tell us these blocks went
+    if (rf->cache && ret == REDIS_OK)
+        redis_cache_drop_from(rf->cache, (newsize + rf->blocksize - 1) / rf->blocksize);
+    return ret;
+}
+
+/* Glob escape the key prefix for SCAN MATCH */
+static void _escape_glob(const char *in, char *out, size_t outlen) {
+    size_t o = 0;
+    for (; *in && o+2 < outlen; ++in) {
+        if (strchr("*?[]\\", *in))
+            out[o++] = '\\';
+        out[o++] = *in;
+    }
+    out[o] = '\0';
+}
+
+/* Queue a delete for every block past endblock among keys (or hash
+ * fields).  Returns how many */
+static int _queue_orphans(RedisFile *rf, redisReply *keys, int64_t endblock) {
+    int queued = 0;
+    for (size_t i=0; i<keys->elements; ++i) {
+        redisReply *key = keys->element[i];
+        int64_t blocknum = -1;
+        if (rf->hashlayout) {
+            // field names are bare hex.  "size", "blocksize" and "codec" aren't
+            blocknum = 0;
+            for (size_t j=0; j<key->len && blocknum >= 0; ++j) {
+                char c = key->str[j];
+                if (c >= '0' && c <= '9') blocknum = (blocknum << 4) | (c - '0');
+                else if (c >= 'a' && c <= 'f') blocknum = (blocknum << 4) | (c - 'a' + 10);
+                else blocknum = -1;
+            }
+            if (key->len == 0)
+                blocknum = -1;
+        } else {
+            blocknum = get_blocknum_from_key(rf, key->str, key->len);
+        }
+        if (blocknum < endblock)
+            continue;
+        if (redis_resp_del(rf, blocknum * rf->blocksize) != REDIS_OK)
+            return -1;
+        queued++;
+    }
+    return queued;
+}
+
+/* Find blocks stored past the end of the file and free them.  Walks the
+ * whole keyspace with SCAN for layout=keys, so it's only done on request */
+static int redis_reclaim_orphans(RedisFile *rf, RedisReclaimStats *stats) {
+    memset(stats, 0, sizeof(RedisReclaimStats));
+    // The module frees pages past the end as it truncates
+    if (rf->blockfile)
+        return REDIS_OK;
+    rf->filesize = -1;
+    int64_t filesize = redis_get_filesize(rf);
+    if (filesize < 0)
+        return REDIS_ERR;
+    int64_t endblock = (filesize + rf->blocksize - 1) / rf->blocksize;
+
+    int ret = REDIS_OK;
+    if (rf->hashlayout) {
+        redisReply *reply = redis_command(rf, "HKEYS %s", rf->keyprefix);
+        if (reply == NULL)
+            return REDIS_ERR;
+        int queued = -1;
+        if (reply->type == REDIS_REPLY_ARRAY)
+            queued = _queue_orphans(rf, reply, endblock);
+        freeReplyObject(reply);
+        if (queued < 0)
+            return REDIS_ERR;
+        stats->orphans_found = queued;
+        ret = _consume_orphans(rf, queued, &stats->orphans_freed);
+    } else {
+        char pattern[2*REDISVFS_MAX_PREFIXLEN+3];
+        _escape_glob(rf->keyprefix, pattern, sizeof(pattern)-2);
+        strcat(pattern, ":*");
+
+        // In cluster mode every master has some of the blocks
+        int nnodes = _cluster_mode(rf) ? rf->cluster->nnodes : 1;
+        for (int node=0; node<nnodes; ++node) {
+            redisContext *ctx = _cluster_mode(rf) ? _cluster_ctx(rf, node) : NULL;
+            char cursor[32] = "0";
+            do {
+                // Blocks are strings.  A layout=hash or blockfile database
+                // named "<prefix>:<hex>" would otherwise look like one
+                redisReply *reply = ctx ? redisCommand(ctx, "SCAN %s MATCH %s COUNT 1000 TYPE string", cursor, pattern)
+                                        : redis_command(rf, "SCAN %s MATCH %s COUNT 1000 TYPE string", cursor, pattern);
+                if (reply == NULL)
+                    return REDIS_ERR;
+                int queued = -1;
+                if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+                        reply->element[0]->type == REDIS_REPLY_STRING &&
+                        reply->element[1]->type == REDIS_REPLY_ARRAY) {
+                    snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+                    queued = _queue_orphans(rf, reply->element[1], endblock);
+                }
+                freeReplyObject(reply);
+                if (queued < 0)
+                    return REDIS_ERR;
+                stats->orphans_found += queued;
+                if (_consume_orphans(rf, queued, &stats->orphans_freed) != REDIS_OK)
+                    ret = REDIS_ERR;
+            } while (strcmp(cursor, "0") != 0);
+        }
+    }
+    DLOG("%s: %lld orphan blocks found, %lld freed", rf->keyprefix, stats->orphans_found, stats->orphans_freed);
+    redis_count_reclaimed(0, stats->orphans_found, stats->orphans_freed);
+
+    if (rf->cache)
+        redis_cache_drop_from(rf->cache, endblock);
+    return ret;
+}
+
+/* write-back buffer
+ *
+ * Rather than sending every xWrite to redis as it happens, hold the dirty
+ * parts of each block locally.  Writes to the same block are merged while
+ * they overlap or touch, so a page written in pieces goes out as one whole
+ * block SET.  Everything is flushed as a single pipeline (including the
+ * file length update) from xSync, xUnlock, xTruncate, xClose, or when the
+ * buffer fills up.
+ */
+
+struct RedisDirtyBlock {
+    int64_t blocknum;
+    int lo, hi;         // dirty byte range [lo..hi) within the block
+};
+
+struct RedisWriteBack {
+    int nblocks;
+    int maxblocks;
+    int blocksize;
+    struct RedisDirtyBlock *blocks;  // in the order first written
+    int *index;         // open addressed blocknum -> blocks[], 2*maxblocks slots
+    char *data;         // blocksize per dirty block
+    int64_t maxend;     // end of the furthest write held
+};
+
+static RedisWriteBack *redis_writeback_create(sqlite3_int64 maxblocks, int blocksize) {
+    if (maxblocks > REDISVFS_MAX_WRITEBACK_BLOCKS)
+        maxblocks = REDISVFS_MAX_WRITEBACK_BLOCKS;
+
+    RedisWriteBack *wb = sqlite3_malloc64(sizeof(RedisWriteBack));
+    if (!wb)
+        return NULL;
+    memset(wb, 0, sizeof(RedisWriteBack));
+    wb->maxblocks = maxblocks;
+    wb->blocksize = blocksize;
+    wb->blocks = sqlite3_malloc64(maxblocks * sizeof(struct RedisDirtyBlock));
+    wb->index = sqlite3_malloc64(2 * maxblocks * sizeof(int));
+    wb->data = sqlite3_malloc64(maxblocks * blocksize);
+    if (!wb->blocks || !wb->index || !wb->data) {
+        sqlite3_free(wb->blocks);
+        sqlite3_free(wb->index);
+        sqlite3_free(wb->data);
+        sqlite3_free(wb);
+        return NULL;
+    }
+    memset(wb->index, -1, 2 * maxblocks * sizeof(int));
+    return wb;
+}
+
+static void redis_writeback_destroy(RedisWriteBack *wb) {
+    sqlite3_free(wb->blocks);
+    sqlite3_free(wb->index);
+    sqlite3_free(wb->data);
+    sqlite3_free(wb);
+}
+
+static void redis_writeback_reset(RedisWriteBack *wb) {
+    // Only the used slots need clearing
+    for (int i=0; i<wb->nblocks; ++i) {
+        unsigned slot = wb->blocks[i].blocknum % (2 * wb->maxblocks);
+        while (wb->index[slot] >= 0) {
+            wb->index[slot] = -1;
+            slot = (slot + 1) % (2 * wb->maxblocks);
+        }
+    }
+    wb->nblocks = 0;
+    wb->maxend = 0;
+}
+
+static inline char *_writeback_data(RedisWriteBack *wb, struct RedisDirtyBlock *dirty) {
+    return wb->data + (dirty - wb->blocks) * wb->blocksize;
+}
+
+static struct RedisDirtyBlock *redis_writeback_find(RedisWriteBack *wb, int64_t blocknum) {
+    unsigned slot = blocknum % (2 * wb->maxblocks);
+    for (; wb->index[slot] >= 0; slot = (slot + 1) % (2 * wb->maxblocks)) {
+        if (wb->blocks[wb->index[slot]].blocknum == blocknum)
+            return &wb->blocks[wb->index[slot]];
+    }
+    return NULL;
+}
+
+/* pre: blocknum not already present and buffer not full */
+static struct RedisDirtyBlock *redis_writeback_add(RedisWriteBack *wb, int64_t blocknum) {
+    assert(wb->nblocks < wb->maxblocks);
+    unsigned slot = blocknum % (2 * wb->maxblocks);
+    while (wb->index[slot] >= 0)
+        slot = (slot + 1) % (2 * wb->maxblocks);
+    wb->index[slot] = wb->nblocks;
+
+    struct RedisDirtyBlock *dirty = &wb->blocks[wb->nblocks++];
+    dirty->blocknum = blocknum;
+    dirty->lo = dirty->hi = 0;
+    return dirty;
+}
+
+static int _writeback_send(RedisFile *rf) {
+    RedisWriteBack *wb = rf->writeback;
+    int ret = REDIS_OK;
+    for (int i=0; i<wb->nblocks && ret == REDIS_OK; ++i) {
+        struct RedisDirtyBlock *dirty = &wb->blocks[i];
+        const char *data = _writeback_data(wb, dirty);
+        int64_t blkstart = dirty->blocknum * rf->blocksize;
+
+        if (dirty->lo == 0 && dirty->hi == rf->blocksize)
+            ret = redis_queuecmd_whole_block_write(rf, blkstart, data);
+        else
+            ret = redis_queuecmd_partial_block_write(rf, blkstart+dirty->lo, data+dirty->lo, dirty->hi-dirty->lo);
+    }
+    if (ret == REDIS_OK)
+        ret = redis_queue_increase_filesize_to(rf, wb->maxend);
+    if (ret == REDIS_ERR || rf->backend->flush(rf) == REDIS_ERR)
+        return REDIS_ERR;
+
+    RedisReplySink sink;
+    for (int i=0; i<wb->nblocks; ++i) {
+        redisReply *reply;
+        if (rf->backend->reply(rf, &sink, NULL, 0, &reply) == REDIS_ERR) {
+            DLOG("ERROR: reading block write reply");
+            return REDIS_ERR;
+        }
+        if (reply->type == REDIS_REPLY_ERROR) {
+            DLOG("ERROR: block write: %s", reply->str);
+            ret = REDIS_ERR;
+        }
+        redis_reply_release(&sink, reply);
+    }
+    if (redis_consume_increase_filesize_to(rf) == REDIS_ERR)
+        ret = REDIS_ERR;
+    return ret;
+}
+
+/* Send everything held as one pipeline and wait for it to land.  If a
+ * script was gone it's all sent again, which changes nothing that landed */
+static int redis_writeback_flush(RedisFile *rf) {
+    RedisWriteBack *wb = rf->writeback;
+    if (wb->nblocks == 0)
+        return REDIS_OK;
+    DLOG("%s flushing %d blocks", rf->keyprefix, wb->nblocks);
+
+    rf->noscript = false;
+    int ret = _writeback_send(rf);
+    if (ret == REDIS_ERR && rf->noscript && redis_file_scripts_load(rf, true) == REDIS_OK)
+        ret = _writeback_send(rf);
+    redis_writeback_reset(wb);
+    return ret;
+}
+
+/* Hold a write in the buffer, flushing first if it can't be merged */
+static int redis_writeback_write(RedisFile *rf, const void *buf, int iAmt, sqlite3_int64 iOfst) {
+    RedisWriteBack *wb = rf->writeback;
+    int64_t write_startp = iOfst;
+    int64_t write_endp = iOfst+iAmt;
+
+    for (int64_t leftp=write_startp; leftp<write_endp; leftp=_start_of_next_block(rf, leftp)) {
+            int64_t blkstart = _start_of_block(rf, leftp);
+            int64_t blknext = _start_of_next_block(rf, leftp);
+            int64_t rightp = (write_endp > blknext) ? blknext : write_endp;
+            int lo = leftp - blkstart;
+            int hi = rightp - blkstart;
+
+            if (rf->cache)
+                redis_cache_drop(rf->cache, blkstart / rf->blocksize);
+
+            struct RedisDirtyBlock *dirty = redis_writeback_find(wb, blkstart / rf->blocksize);
+
+            // A second disjoint range in the same block would need two
+            // SETRANGEs.  SQLite practically never does this, so just
+            // push out what we have and start again.
+            if (dirty && (lo > dirty->hi || hi < dirty->lo)) {
+                if (redis_writeback_flush(rf) == REDIS_ERR)
+                    return REDIS_ERR;
+                dirty = NULL;
+            }
+            if (!dirty) {
+                if (wb->nblocks == wb->maxblocks && redis_writeback_flush(rf) == REDIS_ERR)
+                    return REDIS_ERR;
+                // Compressed blocks are only written whole, so start
+                // from what's there
+                bool fill = rf->codec && (lo > 0 || hi < rf->blocksize);
+                if (fill && redis_codec_load_block(rf, rf->codec->edit, blkstart) == REDIS_ERR)
+                    return REDIS_ERR;
+                dirty = redis_writeback_add(wb, blkstart / rf->blocksize);
+                dirty->lo = lo;
+                dirty->hi = hi;
+                if (fill) {
+                    memcpy(_writeback_data(wb, dirty), rf->codec->edit, rf->blocksize);
+                    dirty->lo = 0;
+                    dirty->hi = rf->blocksize;
+                }
+            } else {
+                if (lo < dirty->lo) dirty->lo = lo;
+                if (hi > dirty->hi) dirty->hi = hi;
+            }
+            memcpy(_writeback_data(wb, dirty)+lo, (const char *)buf + (leftp - write_startp), hi-lo);
+    }
+    if (write_endp > wb->maxend)
+        wb->maxend = write_endp;
+    return REDIS_OK;
+}
+
+/* Can [iOfst..iOfst+iAmt) be read while writes are held back?  Only if
+ * every dirty block it touches has the whole range we want */
+static bool redis_writeback_readable(RedisFile *rf, int64_t iOfst, int iAmt) {
+    RedisWriteBack *wb = rf->writeback;
+    int64_t read_endp = iOfst+iAmt;
+    for (int64_t leftp=iOfst; leftp<read_endp; leftp=_start_of_next_block(rf, leftp)) {
+            int64_t blkstart = _start_of_block(rf, leftp);
+            int64_t blknext = _start_of_next_block(rf, leftp);
+            int64_t rightp = (read_endp > blknext) ? blknext : read_endp;
+
+            struct RedisDirtyBlock *dirty = redis_writeback_find(wb, blkstart / rf->blocksize);
+            if (dirty && (leftp-blkstart < dirty->lo || rightp-blkstart > dirty->hi))
+                return false;
+    }
+    return true;
+}
+
+/* memory mapped pages
+ *
+ * With PRAGMA mmap_size, sqlite asks for pages with xFetch and uses them
+ * in place instead of copying them into its page cache.  There is no file
+ * to map, so each file gets an anonymous, page aligned region as big as
+ * the file (up to the mmap limit).  Pages are read into it the first
+ * time they are fetched and stay there while sqlite holds a lock.  Only
+ * the pages sqlite asked for, whatever our block size, so that a WAL
+ * reader can't be handed a neighbouring page that was stale when loaded.
+ *
+ * Our own writes go to the region as well as redis, like a shared
+ * mapping would.  Other writers are covered the same way as for a real
+ * mmap: sqlite calls xUnfetch(0, NULL) when it sees the database changed.
+ * Dropping our lock forgets everything loaded anyway.
+ */
+
+struct RedisMap {
+    char *region;
+    int64_t size;       // bytes of region. Whole blocks
+    int blocksize;      // sqlite page size when the region was made
+    uint8_t *loaded;    // bit per page read in since the last reset
+    int nfetchout;      // pointers handed out by xFetch and not yet unfetched
+};
+
+static void redis_map_destroy(RedisMap *map) {
+    if (map->region)
+        munmap(map->region, map->size);
+    sqlite3_free(map->loaded);
+    sqlite3_free(map);
+}
+
+static RedisMap *redis_map_create(int64_t size, int blocksize) {
+    RedisMap *map = sqlite3_malloc64(sizeof(RedisMap));
+    if (!map)
+        return NULL;
+    memset(map, 0, sizeof(RedisMap));
+    map->blocksize = blocksize;
+    map->size = (size + blocksize - 1) / blocksize * blocksize;
+    int64_t nbytes = (map->size / blocksize + 7) / 8;
+    map->loaded = sqlite3_malloc64(nbytes);
+    map->region = mmap(NULL, map->size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (map->region == MAP_FAILED)
+        map->region = NULL;
+    if (!map->loaded || !map->region) {
+        redis_map_destroy(map);
+        return NULL;
+    }
+    memset(map->loaded, 0, nbytes);
+    return map;
+}
+
+static inline bool _map_loaded(RedisMap *map, int64_t blocknum) {
+    return map->loaded[blocknum >> 3] & (1 << (blocknum & 7));
+}
+
+/* Forget everything loaded from blocknum on */
+static void redis_map_reset_from(RedisMap *map, int64_t blocknum) {
+    int64_t nblocks = map->size / map->blocksize;
+    for (; blocknum < nblocks && (blocknum & 7); ++blocknum)
+        map->loaded[blocknum >> 3] &= ~(1 << (blocknum & 7));
+    if (blocknum < nblocks)
+        memset(map->loaded + (blocknum >> 3), 0, (nblocks - blocknum + 7) / 8);
+}
+
+/* Make sure the region covers [0..end) in pages of pagesize.  A region
+ * that doesn't can only be replaced while nothing points into it */
+static int redis_map_ensure(RedisFile *rf, int64_t end, int64_t filesize, int pagesize) {
+    if (rf->map && rf->map->size >= end && rf->map->blocksize == pagesize)
+        return REDIS_OK;
+    if (rf->map && rf->map->nfetchout > 0)
+        return REDIS_ERR;
+
+    int64_t size = filesize < rf->mmapsizemax ? filesize : rf->mmapsizemax;
+    if (size < end)
+        return REDIS_ERR;
+    RedisMap *map = redis_map_create(size, pagesize);
+    if (!map)
+        return REDIS_ERR;
+    if (rf->map)
+        redis_map_destroy(rf->map);
+    rf->map = map;
+    return REDIS_OK;
+}
+
+/* Read in every page of [iOfst..iOfst+iAmt) that isn't already loaded.
+ * Runs of missing pages go to redis as one pipelined read */
+static int redis_map_load(RedisFile *rf, int64_t iOfst, int iAmt, int64_t filesize) {
+    RedisMap *map = rf->map;
+    int64_t first = iOfst / map->blocksize;
+    int64_t last = (iOfst + iAmt - 1) / map->blocksize;
+
+    for (int64_t blocknum = first; blocknum <= last; ++blocknum) {
+        if (_map_loaded(map, blocknum))
+            continue;
+        int64_t runend = blocknum;
+        while (runend < last && !_map_loaded(map, runend+1))
+            ++runend;
+
+        int64_t start = blocknum * map->blocksize;
+        int64_t end = (runend+1) * map->blocksize;
+        if (end > filesize)
+            end = filesize;
+        int rc = redisvfs_read(&rf->base, map->region + start, end - start, start);
+        if (rc != SQLITE_OK)
+            return rc;
+        for (; blocknum <= runend; ++blocknum)
+            map->loaded[blocknum >> 3] |= 1 << (blocknum & 7);
+        --blocknum;
+    }
+    return SQLITE_OK;
+}
+
+/* Keep the region in step with our own writes */
+static void redis_map_write(RedisMap *map, const void *buf, int iAmt, int64_t iOfst) {
+    if (iOfst >= map->size)
+        return;
+    int64_t len = (iOfst + iAmt > map->size) ? map->size - iOfst : iAmt;
+    memcpy(map->region + iOfst, buf, len);
+}
+
+/* locking
+ *
+ * sqlite's SHARED/RESERVED/PENDING/EXCLUSIVE levels, kept in a hash next
+ * to the database (<prefix>:lock) with a field per connection holding its
+ * level and when its lease runs out.  One script works out and records
+ * the new level atomically, using the redis server's clock so that hosts
+ * don't have to agree on the time.
+ *
+ * Leases stop a client that died from holding the database forever.  A
+ * connection holding a lock renews its lease when it uses the file after
+ * half the lease has gone.  If the lease ran out anyway, someone else may
+ * have written since, so the read or write fails rather than carrying on
+ * with a transaction that is no longer isolated.
+ */
+
+/* KEYS the lock hash.  ARGV owner, op, level, lease (ms).
+ *   lock:   try to raise our lock to level.  Going for EXCLUSIVE while
+ *           others still have SHARED leaves us at PENDING
+ *   unlock: drop our lock to level
+ *   renew:  extend our lease.  0 if it has already run out
+ *   check:  1 if anyone holds RESERVED or above
+ * Returns the level we now hold */
+static RedisScript redis_lock_script = { .text =
+    "if redis.replicate_commands then redis.replicate_commands() end "
+    "local t=redis.call('TIME') local now=t[1]*1000+math.floor(t[2]/1000) "
+    "local me,op,want=ARGV[1],ARGV[2],tonumber(ARGV[3]) "
+    "local exp=now+tonumber(ARGV[4]) "
+    "local mine,others,writer,pending=0,0,false,false "
+    "local h=redis.call('HGETALL',KEYS[1]) "
+    "for i=1,#h,2 do "
+      "local l,e=h[i+1]:match('(%d+):(%d+)') l=tonumber(l) "
+      "if tonumber(e)<now then redis.call('HDEL',KEYS[1],h[i]) "
+      "elseif h[i]==me then mine=l "
+      "else others=others+1 writer=writer or l>=2 pending=pending or l>=3 end "
+    "end "
+    "if op=='check' then return (writer or mine>=2) and 1 or 0 end "
+    "local got=mine "
+    "if op=='renew' then if mine==0 then return 0 end "
+    "elseif op=='unlock' then got=math.min(mine,want) "
+    "elseif want==1 then if mine==0 and not pending then got=1 end "
+    "elseif mine>=1 and mine<want then "
+      "if want==2 then if not writer then got=2 end "
+      "elseif mine>=2 or not writer then got=(others==0) and 4 or 3 end "
+    "end "
+    "if got>0 then redis.call('HSET',KEYS[1],me,got..':'..exp) else redis.call('HDEL',KEYS[1],me) end "
+    "redis.call('PEXPIRE',KEYS[1],2*tonumber(ARGV[4])) "
+    "return got" };
+
+/* Run op on our lock.  Returns the level we hold afterwards, or -1 */
+static int redis_lock_cmd(RedisFile *rf, const char *op, int level) {
+    char key[REDISVFS_KEYBUFLEN];
+    char want[24], lease[24];
+    get_lockkey(rf, key);
+    snprintf(want, sizeof(want), "%d", level);
+    snprintf(lease, sizeof(lease), "%lld", (long long)rf->lockleasems);
+    const char *args[] = { key, rf->owner, op, want, lease };
+
+    redisReply *reply = redis_script_command(rf, &redis_lock_script, 1, 5, args);
+    if (reply == NULL)
+        return -1;
+    int ret = (reply->type == REDIS_REPLY_INTEGER) ? (int)reply->integer : -1;
+    freeReplyObject(reply);
+    if (ret >= 0 && strcmp(op, "check") != 0)
+        rf->lockrenewed = _now_us();
+    return ret;
+}
+
+/* Renew our lease if it's past half way.  Called before using the file */
+static int redis_lock_keepalive(RedisFile *rf) {
+    if (rf->locklevel == SQLITE_LOCK_NONE ||
+            _now_us() - rf->lockrenewed < rf->lockleasems * 500)
+        return REDIS_OK;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return REDIS_ERR;
+    int level = rf->backend->lock(rf, "renew", 0);
+    if (level < 0)
+        return REDIS_ERR;
+    rf->lockstats.renewals++;
+    if (level > 0)
+        return REDIS_OK;
+
+    DLOG("%s lost its lock lease", rf->keyprefix);
+    rf->lockstats.lost++;
+    // A WAL database keeps SHARED for as long as it's open, but readers
+    // and writers are kept apart by the wal-index locks.  Just take it again
+    if (rf->shm && rf->locklevel == SQLITE_LOCK_SHARED &&
+            rf->backend->lock(rf, "lock", SQLITE_LOCK_SHARED) == SQLITE_LOCK_SHARED)
+        return REDIS_OK;
+    rf->locklevel = SQLITE_LOCK_NONE;
+    rf->filesize = -1;
+    return REDIS_ERR;
+}
+
+/* durability
+ *
+ * durability= picks what xSync waits for.  Every write already waits for
+ * redis to reply, and that's all "ack" (the default) asks for.  "none"
+ * doesn't even push write-back out at xSync, leaving it for xUnlock.
+ * "replicas:N" sends WAIT N, and "aof" (or "aof:N", for N replicas' AOFs
+ * too) WAITAOF, once per xSync after everything is flushed rather than
+ * once per block.  They go to every connection that can have carried
+ * writes.  WAITAOF needs redis 7.2 and appendonly yes.
+ *
+ * A failover or restart can keep part of a write that was only acked, so
+ * the levels that wait don't claim SQLITE_IOCAP_ATOMIC or SEQUENTIAL, and
+ * sqlite syncs the journal before it touches the database.
+ */
+
+enum { REDISVFS_DURABILITY_NONE, REDISVFS_DURABILITY_ACK, REDISVFS_DURABILITY_REPLICAS, REDISVFS_DURABILITY_AOF };
+
+/* durability=none|ack|replicas:N|aof[:N] */
+static int redis_set_durability(RedisFile *rf, const char *level) {
+    rf->durability = REDISVFS_DURABILITY_ACK;
+    rf->durabilityreplicas = 0;
+    if (!level || strcmp(level, "ack") == 0)
+        return REDIS_OK;
+    if (strcmp(level, "none") == 0) {
+        rf->durability = REDISVFS_DURABILITY_NONE;
+        return REDIS_OK;
+    }
+    if (strcmp(level, "aof") == 0) {
+        rf->durability = REDISVFS_DURABILITY_AOF;
+        return REDIS_OK;
+    }
+    const char *n = NULL;
+    if (strncmp(level, "replicas:", 9) == 0) {
+        rf->durability = REDISVFS_DURABILITY_REPLICAS;
+        n = level + 9;
+    } else if (strncmp(level, "aof:", 4) == 0) {
+        rf->durability = REDISVFS_DURABILITY_AOF;
+        n = level + 4;
+    } else {
+        return REDIS_ERR;
+    }
+    char *end;
+    long replicas = strtol(n, &end, 10);
+    if (end == n || *end || replicas < 0 || replicas > INT32_MAX ||
+            (replicas == 0 && rf->durability == REDISVFS_DURABILITY_REPLICAS))
+        return REDIS_ERR;
+    rf->durabilityreplicas = replicas;
+    return REDIS_OK;
+}
+
+/* Wait for what this file has written to reach as many replicas or AOFs
+ * as durability= asks for.  pre: nothing outstanding on any connection */
+static int redis_durable(RedisFile *rf) {
+    if (rf->durability < REDISVFS_DURABILITY_REPLICAS)
+        return REDIS_OK;
+
+    char *cmd;
+    int len;
+    if (rf->durability == REDISVFS_DURABILITY_REPLICAS)
+        len = redisFormatCommand(&cmd, "WAIT %d %lld",
+                rf->durabilityreplicas, (long long)rf->durabilitytimeoutms);
+    else
+        len = redisFormatCommand(&cmd, "WAITAOF 1 %d %lld",
+                rf->durabilityreplicas, (long long)rf->durabilitytimeoutms);
+    if (len < 0)
+        return REDIS_ERR;
+
+    // All at once, so the nodes wait in parallel
+    int nctx = rf->cluster ? rf->cluster->nnodes : 1;
+    int nsent = 0;
+    for (; nsent<nctx; ++nsent) {
+        redisContext *ctx = rf->cluster ? _cluster_ctx(rf, nsent) : NULL;
+        if (redis_append_formatted(rf, ctx, cmd, len) != REDIS_OK)
+            break;
+    }
+    redisFreeCommand(cmd);
+
+    int ret = nsent == nctx ? REDIS_OK : REDIS_ERR;
+    for (int i=0; i<nsent; ++i) {
+        redisContext *ctx = rf->cluster ? _cluster_ctx(rf, i) : NULL;
+        redisReply *reply;
+        if (redis_read_reply(rf, ctx, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (reply->type == REDIS_REPLY_INTEGER) {
+            // WAIT: how many replicas have it
+            if (reply->integer < rf->durabilityreplicas)
+                ret = REDIS_ERR;
+        } else if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+                reply->element[0]->type == REDIS_REPLY_INTEGER &&
+                reply->element[1]->type == REDIS_REPLY_INTEGER) {
+            // WAITAOF: whether the local AOF has it, and how many replicas'
+            if (reply->element[0]->integer < 1 || reply->element[1]->integer < rf->durabilityreplicas)
+                ret = REDIS_ERR;
+        } else {
+            if (reply->type == REDIS_REPLY_ERROR)
+                fprintf(stderr, "%s: Error: %s: %s\n", __func__, rf->keyprefix, reply->str);
+            ret = REDIS_ERR;
+        }
+        freeReplyObject(reply);
+    }
+    if (ret == REDIS_ERR)
+        DLOG("%s not durable in time", rf->keyprefix);
+    return ret;
+}
+
+
+/* wal-index shared memory
+ *
+ * WAL mode needs a wal-index that every connection to the database sees.
+ * By default it lives in POSIX shared memory named after the redis server
+ * and database, so it is shared by every process on this host.  Locks are
+ * fcntl() locks on the shared memory object at the same offsets the unix
+ * VFS uses in its -shm file, counted per slot for connections within this
+ * process.
+ *
+ * With shm=redis the wal-index lives in redis instead, for clients on
+ * more than one host.  Each connection works on its own copy.  Every lock
+ * and barrier pulls whatever others have changed since we last looked,
+ * and anything we changed is pushed before a lock is released.  Both are
+ * done byte for byte against a shadow of what redis last had, so only
+ * changed bytes move.  Locks are kept in redis, in a hash with a field
+ * per connection using the wal-index that holds the slots it has locked
+ * and when its lease runs out, as with the database lock (see locking).
+ * Any lock command renews our lease, as does using the database after
+ * half of it has gone.  A connection that died drops out once its lease
+ * runs out, locks and all.  The first connection in starts with an empty
+ * wal-index.
+ */
+
+// Lock bytes in the shared memory object, as the unix VFS -shm file
+#define REDISVFS_SHM_LOCKBASE ((22+SQLITE_SHM_NLOCK)*4)
+#define REDISVFS_SHM_DMS (REDISVFS_SHM_LOCKBASE+SQLITE_SHM_NLOCK)
+
+// Read locks start at this slot.  Taking one starts a WAL read transaction
+#define REDISVFS_SHM_FIRST_READ_LOCK 3
+
+/* One per wal-index in this process, shared by every connection to it */
+struct RedisShmNode {
+    struct RedisShmNode *next;
+    char name[32];          // POSIX shared memory object
+    int fd;
+    int nref;
+    int szregion;
+    int nregion;
+    char **regions;
+    int lockcount[SQLITE_SHM_NLOCK];    // shared holders here, or -1 if exclusive
+};
+
+// Every open RedisShmNode.  Guarded by the SQLITE_MUTEX_STATIC_VFS2 mutex,
+// as is everything in them
+static struct RedisShmNode *redis_shm_nodes;
+
+struct RedisShm {
+    struct RedisShmNode *node;  // local wal-index, or NULL for shm=redis
+    uint16_t sharedmask;        // slots we hold
+    uint16_t exclmask;
+
+    // shm=redis: our copy of the wal-index, and redis' as of the last pull,
+    // and when our lease was last renewed (us, monotonic)
+    int szregion;
+    int nregion;
+    char **regions;
+    char **shadows;
+    long long version;
+    sqlite3_int64 renewed;
+};
+
+/* KEYS the wal-index hash.  ARGV triples of region, offset, bytes.
+ * Returns the new version */
+static RedisScript redis_shmpush_script = { .text =
+    "for i=1,#ARGV,3 do "
+      "local v=redis.call('HGET',KEYS[1],ARGV[i]) or '' "
+      "local o=tonumber(ARGV[i+1]) "
+      "if #v<o then v=v..string.rep('\\0',o-#v) end "
+      "redis.call('HSET',KEYS[1],ARGV[i],v:sub(1,o)..ARGV[i+2]..v:sub(o+#ARGV[i+2]+1)) "
+    "end "
+    "return redis.call('HINCRBY',KEYS[1],'version',1)" };
+
+/* KEYS the wal-index hash.  ARGV the version we have, then regions.
+ * Returns {version} if nothing changed, else {version, regions...} */
+static RedisScript redis_shmpull_script = { .text =
+    "local v=redis.call('HGET',KEYS[1],'version') or '0' "
+    "if v==ARGV[1] then return {v} end "
+    "local r={v} "
+    "for i=2,#ARGV do r[i]=redis.call('HGET',KEYS[1],ARGV[i]) or '' end "
+    "return r" };
+
+/* KEYS the lock hash, the wal-index hash.  ARGV owner, op, first slot,
+ * count, lease (ms).  Fields are "<shared>:<exclusive>:<expiry>", the
+ * slots as bitmasks.
+ *   open:   join.  Returns how many have joined, emptying the wal-index
+ *           if we are the only one
+ *   close:  leave, dropping any locks
+ *   s, x:   lock the slots shared or exclusive.  0 if someone else holds
+ *           one of them
+ *   us, ux: unlock our own shared or exclusive slots
+ *   renew:  extend our lease.  0 if it has already run out, and we join
+ *           again holding nothing
+ *   users:  how many have joined */
+static RedisScript redis_shmlock_script = { .text =
+    "if redis.replicate_commands then redis.replicate_commands() end "
+    "local t=redis.call('TIME') local now=t[1]*1000+math.floor(t[2]/1000) "
+    "local me,op,lease=ARGV[1],ARGV[2],tonumber(ARGV[5]) "
+    "local m=bit.lshift(bit.lshift(1,tonumber(ARGV[4]))-1,tonumber(ARGV[3])) "
+    "local ms,mx,found,os,ox,users=0,0,false,0,0,0 "
+    "local h=redis.call('HGETALL',KEYS[1]) "
+    "for i=1,#h,2 do "
+      "local s,x,e=h[i+1]:match('^(%d+):(%d+):(%d+)$') "
+      "if not e or tonumber(e)<now then redis.call('HDEL',KEYS[1],h[i]) "
+      "else users=users+1 "
+        "if h[i]==me then ms,mx,found=tonumber(s),tonumber(x),true "
+        "else os=bit.bor(os,tonumber(s)) ox=bit.bor(ox,tonumber(x)) end "
+      "end "
+    "end "
+    "if op=='users' then return users end "
+    "if op=='close' then redis.call('HDEL',KEYS[1],me) return 1 end "
+    "local r=1 "
+    "if op=='open' then "
+      "if not found then users=users+1 end "
+      "if users==1 then redis.call('UNLINK',KEYS[2]) end "
+      "r=users "
+    "elseif op=='renew' then if not found then r=0 end "
+    "elseif op=='s' then if bit.band(ox,m)~=0 then r=0 else ms=bit.bor(ms,m) end "
+    "elseif op=='x' then if bit.band(bit.bor(os,ox),m)~=0 then r=0 else mx=bit.bor(mx,m) end "
+    "elseif op=='us' then ms=bit.band(ms,bit.bnot(m)) "
+    "elseif op=='ux' then mx=bit.band(mx,bit.bnot(m)) end "
+    "redis.call('HSET',KEYS[1],me,ms..':'..mx..':'..(now+lease)) "
+    "redis.call('PEXPIRE',KEYS[1],2*lease) "
+    "return r" };
+
+static int get_shmkey(RedisFile *rf, const char *suffix, char *outkeyname) {
+    int written = snprintf(outkeyname, REDISVFS_KEYBUFLEN, "%s%s", rf->metabase, suffix);
+    assert(written < REDISVFS_KEYBUFLEN);
+    return written;
+}
+
+/* Local wal-index */
+
+static int _shm_fcntl(int fd, short type, int ofst, int n) {
+    struct flock lock = {0};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = ofst;
+    lock.l_len = n;
+    if (fcntl(fd, F_SETLK, &lock) == 0)
+        return SQLITE_OK;
+    return (errno == EAGAIN || errno == EACCES) ? SQLITE_BUSY : SQLITE_IOERR_SHMLOCK;
+}
+
+/* Does a process other than us hold byte ofst? */
+static bool _shm_fcntl_held(int fd, int ofst) {
+    struct flock lock = {0};
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = ofst;
+    lock.l_len = 1;
+    if (fcntl(fd, F_GETLK, &lock) != 0)
+        return true;
+    return lock.l_type != F_UNLCK;
+}
+
+/* pre: shm mutex held */
+static struct RedisShmNode *redis_shm_node_open(RedisFile *rf) {
+    // Named for the server and database.  Hashed to fit a shm_open name
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = rf->endpoint; *c; ++c)
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    hash = (hash ^ '/') * 1099511628211ULL;
+    for (size_t i = 0; i < rf->keyprefixlen; ++i)
+        hash = (hash ^ (uint8_t)rf->keyprefix[i]) * 1099511628211ULL;
+    char name[32];
+    snprintf(name, sizeof(name), "/redisvfs-%016llx", (unsigned long long)hash);
+
+    for (struct RedisShmNode *node = redis_shm_nodes; node; node = node->next) {
+        if (strcmp(node->name, name) == 0) {
+            node->nref++;
+            return node;
+        }
+    }
+
+    struct RedisShmNode *node = sqlite3_malloc64(sizeof(struct RedisShmNode));
+    if (!node)
+        return NULL;
+    memset(node, 0, sizeof(struct RedisShmNode));
+    memcpy(node->name, name, sizeof(name));
+    node->fd = shm_open(name, O_RDWR|O_CREAT, 0600);
+    if (node->fd < 0) {
+        sqlite3_free(node);
+        return NULL;
+    }
+    // If we can lock the DMS byte exclusive nobody else has it open, so
+    // whatever is in there is left over from a process that went away.
+    // Start clean, then go down to a shared lock to tell later processes
+    // we are here.  Holding the lock throughout keeps two processes from
+    // both deciding they are first
+    if (_shm_fcntl(node->fd, F_WRLCK, REDISVFS_SHM_DMS, 1) == SQLITE_OK &&
+            ftruncate(node->fd, 0) != 0) {
+        close(node->fd);
+        sqlite3_free(node);
+        return NULL;
+    }
+    if (_shm_fcntl(node->fd, F_RDLCK, REDISVFS_SHM_DMS, 1) != SQLITE_OK) {
+        close(node->fd);
+        sqlite3_free(node);
+        return NULL;
+    }
+    node->nref = 1;
+    node->next = redis_shm_nodes;
+    redis_shm_nodes = node;
+    return node;
+}
+
+/* pre: shm mutex held */
+static void redis_shm_node_close(struct RedisShmNode *node, bool delete) {
+    if (--node->nref > 0)
+        return;
+    for (struct RedisShmNode **pp = &redis_shm_nodes; *pp; pp = &(*pp)->next) {
+        if (*pp == node) {
+            *pp = node->next;
+            break;
+        }
+    }
+    for (int i = 0; i < node->nregion; ++i)
+        munmap(node->regions[i], node->szregion);
+    sqlite3_free(node->regions);
+    if (delete)
+        shm_unlink(node->name);
+    close(node->fd);    // drops our fcntl locks
+    sqlite3_free(node);
+}
+
+/* pre: shm mutex held */
+static int redis_shm_node_map(struct RedisShmNode *node, int iregion, int szregion, bool extend, void volatile **pp) {
+    if (node->nregion <= iregion) {
+        struct stat st;
+        if (fstat(node->fd, &st) != 0)
+            return SQLITE_IOERR_SHMSIZE;
+        int64_t need = (int64_t)(iregion+1) * szregion;
+        if (st.st_size < need) {
+            if (!extend)
+                return SQLITE_OK;
+            if (ftruncate(node->fd, need) != 0)
+                return SQLITE_IOERR_SHMSIZE;
+        }
+        char **regions = sqlite3_realloc64(node->regions, (iregion+1) * sizeof(char *));
+        if (!regions)
+            return SQLITE_IOERR_NOMEM;
+        node->regions = regions;
+        node->szregion = szregion;
+        for (; node->nregion <= iregion; ++node->nregion) {
+            void *p = mmap(NULL, szregion, PROT_READ|PROT_WRITE, MAP_SHARED,
+                    node->fd, (off_t)node->nregion * szregion);
+            if (p == MAP_FAILED)
+                return SQLITE_IOERR_SHMMAP;
+            node->regions[node->nregion] = p;
+        }
+    }
+    *pp = node->regions[iregion];
+    return SQLITE_OK;
+}
+
+/* pre: shm mutex held */
+static int redis_shm_node_lock(RedisShm *shm, int ofst, int n, int flags) {
+    struct RedisShmNode *node = shm->node;
+    uint16_t mask = ((1 << n) - 1) << ofst;
+    int fd = node->fd;
+    int base = REDISVFS_SHM_LOCKBASE;
+
+    if (flags & SQLITE_SHM_UNLOCK) {
+        if ((flags & SQLITE_SHM_EXCLUSIVE) && (shm->exclmask & mask)) {
+            _shm_fcntl(fd, F_UNLCK, base+ofst, n);
+            for (int i = ofst; i < ofst+n; ++i)
+                node->lockcount[i] = 0;
+            shm->exclmask &= ~mask;
+        } else if ((flags & SQLITE_SHM_SHARED) && (shm->sharedmask & mask)) {
+            if (node->lockcount[ofst] == 1)
+                _shm_fcntl(fd, F_UNLCK, base+ofst, 1);
+            node->lockcount[ofst]--;
+            shm->sharedmask &= ~mask;
+        }
+        return SQLITE_OK;
+    }
+
+    if (flags & SQLITE_SHM_SHARED) {
+        if (shm->sharedmask & mask)
+            return SQLITE_OK;
+        if (node->lockcount[ofst] < 0)
+            return SQLITE_BUSY;
+        if (node->lockcount[ofst] == 0) {
+            int rc = _shm_fcntl(fd, F_RDLCK, base+ofst, 1);
+            if (rc != SQLITE_OK)
+                return rc;
+        }
+        node->lockcount[ofst]++;
+        shm->sharedmask |= mask;
+        return SQLITE_OK;
+    }
+
+    if ((shm->exclmask & mask) == mask)
+        return SQLITE_OK;
+    for (int i = ofst; i < ofst+n; ++i) {
+        if (node->lockcount[i] != 0)
+            return SQLITE_BUSY;
+    }
+    int rc = _shm_fcntl(fd, F_WRLCK, base+ofst, n);
+    if (rc != SQLITE_OK)
+        return rc;
+    for (int i = ofst; i < ofst+n; ++i)
+        node->lockcount[i] = -1;
+    shm->exclmask |= mask;
+    return SQLITE_OK;
+}
+
+/* shm=redis */
+
+static void _shm_region_field(int iregion, char *out) {
+    out[_u64_to_hex(iregion, out)] = '\0';
+}
+
+/* Take anything redis has that differs from what we last saw.  Bytes
+ * we've changed ourselves since are kept unless redis changed them too */
+static void _shm_merge(RedisShm *shm, int iregion, const char *remote, size_t len) {
+    char *local = shm->regions[iregion];
+    char *shadow = shm->shadows[iregion];
+    for (int i = 0; i < shm->szregion; ++i) {
+        char r = (size_t)i < len ? remote[i] : 0;
+        if (r != shadow[i])
+            local[i] = shadow[i] = r;
+    }
+}
+
+static int _shm_pull_reply(RedisShm *shm, redisReply *reply) {
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 1 ||
+            reply->element[0]->type != REDIS_REPLY_STRING)
+        return REDIS_ERR;
+    shm->version = strtoll(reply->element[0]->str, NULL, 10);
+    for (size_t i = 1; i < reply->elements && (int)i <= shm->nregion; ++i) {
+        if (reply->element[i]->type == REDIS_REPLY_STRING)
+            _shm_merge(shm, i-1, reply->element[i]->str, reply->element[i]->len);
+    }
+    return REDIS_OK;
+}
+
+static int redis_queue_shm_pull(RedisFile *rf) {
+    RedisShm *shm = rf->shm;
+    char key[REDISVFS_KEYBUFLEN];
+    char field[20];
+    if (redis_resp_script_begin(rf, &redis_shmpull_script, 1, 2 + shm->nregion) != REDIS_OK)
+        return REDIS_ERR;
+    resp_arg(rf, key, get_shmkey(rf, "shm", key));
+    resp_arg_int(rf, shm->version);
+    for (int i = 0; i < shm->nregion; ++i) {
+        _shm_region_field(i, field);
+        resp_arg_str(rf, field);
+    }
+    return REDIS_OK;
+}
+
+/* The wal-index scripts are all lost together, to a restart or SCRIPT
+ * FLUSH.  After a NOSCRIPT load them all again */
+static int redis_shm_scripts_load(RedisFile *rf) {
+    DLOG("%s wal-index scripts gone. Reloading", rf->keyprefix);
+    if (redis_script_load(rf, &redis_shmlock_script) != REDIS_OK ||
+            redis_script_load(rf, &redis_shmpull_script) != REDIS_OK ||
+            redis_script_load(rf, &redis_shmpush_script) != REDIS_OK)
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+
+static int redis_shm_pull(RedisFile *rf) {
+    redisReply *reply;
+    for (int tries=0; ; ++tries) {
+        if (redis_queue_shm_pull(rf) != REDIS_OK || resp_end(rf) != REDIS_OK ||
+                redis_get_reply(rf, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (tries > 0 || !_noscript(reply))
+            break;
+        freeReplyObject(reply);
+        if (redis_shm_scripts_load(rf) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    int ret = _shm_pull_reply(rf->shm, reply);
+    freeReplyObject(reply);
+    return ret;
+}
+
+/* Queue a push of every byte changed since the last pull or push.
+ * pushed is false if there was nothing to push.  What was pushed only
+ * counts as in redis once the reply says so (see redis_shm_pushed) */
+static int redis_queue_shm_push(RedisFile *rf, bool *pushed) {
+    RedisShm *shm = rf->shm;
+
+    // Count the changed ranges first.  Gaps shorter than this aren't
+    // worth a separate range
+    const int mingap = 32;
+    int nranges = 0;
+    for (int r = 0; r < shm->nregion; ++r) {
+        const char *local = shm->regions[r], *shadow = shm->shadows[r];
+        for (int i = 0; i < shm->szregion; ) {
+            if (local[i] == shadow[i]) { ++i; continue; }
+            int end = i+1, gap = 0;
+            for (; end < shm->szregion && gap < mingap; ++end)
+                gap = (local[end] == shadow[end]) ? gap+1 : 0;
+            ++nranges;
+            i = end;
+        }
+    }
+    *pushed = nranges > 0;
+    if (nranges == 0)
+        return REDIS_OK;
+
+    char key[REDISVFS_KEYBUFLEN];
+    char field[20];
+    if (redis_resp_script_begin(rf, &redis_shmpush_script, 1, 1 + 3*nranges) != REDIS_OK)
+        return REDIS_ERR;
+    resp_arg(rf, key, get_shmkey(rf, "shm", key));
+    for (int r = 0; r < shm->nregion; ++r) {
+        const char *local = shm->regions[r], *shadow = shm->shadows[r];
+        _shm_region_field(r, field);
+        for (int i = 0; i < shm->szregion; ) {
+            if (local[i] == shadow[i]) { ++i; continue; }
+            int end = i+1, gap = 0;
+            for (; end < shm->szregion && gap < mingap; ++end)
+                gap = (local[end] == shadow[end]) ? gap+1 : 0;
+            resp_arg_str(rf, field);
+            resp_arg_int(rf, i);
+            resp_arg(rf, local+i, end - gap - i);
+            i = end;
+        }
+    }
+    return REDIS_OK;
+}
+
+/* A push landed.  Every byte that differed went, so redis now has our copy */
+static void redis_shm_pushed(RedisShm *shm) {
+    for (int r = 0; r < shm->nregion; ++r)
+        memcpy(shm->shadows[r], shm->regions[r], shm->szregion);
+}
+
+static int redis_queue_shm_lockcmd(RedisFile *rf, const char *op, int ofst, int n) {
+    char key[REDISVFS_KEYBUFLEN];
+    if (redis_resp_script_begin(rf, &redis_shmlock_script, 2, 7) != REDIS_OK)
+        return REDIS_ERR;
+    resp_arg(rf, key, get_shmkey(rf, "shm:locks", key));
+    resp_arg(rf, key, get_shmkey(rf, "shm", key));
+    resp_arg_str(rf, rf->owner);
+    resp_arg_str(rf, op);
+    resp_arg_int(rf, ofst);
+    resp_arg_int(rf, n);
+    resp_arg_int(rf, rf->lockleasems);
+    rf->shm->renewed = _now_us();
+    return REDIS_OK;
+}
+
+/* Run op on our wal-index locks.  Returns its reply, or -1 */
+static long long redis_shm_lockcmd(RedisFile *rf, const char *op) {
+    redisReply *reply;
+    for (int tries=0; ; ++tries) {
+        if (redis_queue_shm_lockcmd(rf, op, 0, 0) != REDIS_OK || resp_end(rf) != REDIS_OK ||
+                redis_get_reply(rf, &reply) != REDIS_OK)
+            return -1;
+        if (tries > 0 || !_noscript(reply))
+            break;
+        freeReplyObject(reply);
+        if (redis_shm_scripts_load(rf) != REDIS_OK)
+            return -1;
+    }
+    long long ret = (reply->type == REDIS_REPLY_INTEGER) ? reply->integer : -1;
+    if (ret < 0) {
+        redis_debugreply(reply);
+    }
+    freeReplyObject(reply);
+    return ret;
+}
+
+/* Push what we changed and unlock, in one round trip.  NOSCRIPT means
+ * neither ran: redis runs the pipeline of one client in order without
+ * taking another's commands in between, so nobody can have loaded the
+ * lock script again after the push script was found missing */
+static int redis_shm_remote_unlock(RedisFile *rf, int ofst, int n, bool exclusive) {
+    RedisShm *shm = rf->shm;
+    redisReply *reply;
+    bool pushed;
+    for (int tries=0; ; ++tries) {
+        bool noscript = false;
+        if (redis_queue_shm_push(rf, &pushed) != REDIS_OK ||
+                redis_queue_shm_lockcmd(rf, exclusive ? "ux" : "us", ofst, n) != REDIS_OK ||
+                resp_end(rf) != REDIS_OK)
+            return REDIS_ERR;
+        if (pushed) {
+            if (redis_get_reply(rf, &reply) != REDIS_OK)
+                return REDIS_ERR;
+            noscript = _noscript(reply);
+            if (reply->type == REDIS_REPLY_INTEGER) {
+                redis_shm_pushed(shm);
+                // Nobody else pushed in between, so we're still up to date
+                if (reply->integer == shm->version+1)
+                    shm->version = reply->integer;
+            }
+            freeReplyObject(reply);
+        }
+        if (redis_get_reply(rf, &reply) != REDIS_OK)
+            return REDIS_ERR;
+        noscript = noscript || _noscript(reply);
+        freeReplyObject(reply);
+        if (tries > 0 || !noscript)
+            return REDIS_OK;
+        if (redis_shm_scripts_load(rf) != REDIS_OK)
+            return REDIS_ERR;
+    }
+}
+
+/* Lock and pull in one round trip.  Returns 1 if we got the slots, 0 if
+ * someone else holds one of them, or -1.  Taking slots we already hold
+ * changes nothing, so after a NOSCRIPT the pair is simply run again */
+static int redis_shm_remote_trylock(RedisFile *rf, int ofst, int n, bool exclusive) {
+    redisReply *reply;
+    for (int tries=0; ; ++tries) {
+        if (redis_queue_shm_lockcmd(rf, exclusive ? "x" : "s", ofst, n) != REDIS_OK ||
+                redis_queue_shm_pull(rf) != REDIS_OK || resp_end(rf) != REDIS_OK)
+            return -1;
+        if (redis_get_reply(rf, &reply) != REDIS_OK)
+            return -1;
+        bool noscript = _noscript(reply);
+        int locked = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+        freeReplyObject(reply);
+        if (redis_get_reply(rf, &reply) != REDIS_OK)
+            return -1;
+        noscript = noscript || _noscript(reply);
+        int ret = noscript ? REDIS_OK : _shm_pull_reply(rf->shm, reply);
+        freeReplyObject(reply);
+        if (ret != REDIS_OK)
+            return -1;
+        if (tries > 0 || !noscript)
+            return noscript ? -1 : locked;
+        if (redis_shm_scripts_load(rf) != REDIS_OK)
+            return -1;
+    }
+}
+
+static int redis_shm_remote_lock(RedisFile *rf, int ofst, int n, int flags) {
+    RedisShm *shm = rf->shm;
+    uint16_t mask = ((1 << n) - 1) << ofst;
+    bool exclusive = flags & SQLITE_SHM_EXCLUSIVE;
+    uint16_t *held = exclusive ? &shm->exclmask : &shm->sharedmask;
+
+    if (flags & SQLITE_SHM_UNLOCK) {
+        if (!(*held & mask))
+            return SQLITE_OK;
+        // Whatever we changed under the lock has to be in redis before
+        // anyone else can take it
+        if (redis_shm_remote_unlock(rf, ofst, n, exclusive) != REDIS_OK)
+            return SQLITE_IOERR_SHMLOCK;
+        *held &= ~mask;
+        return SQLITE_OK;
+    }
+
+    if ((*held & mask) == mask)
+        return SQLITE_OK;
+    int locked = redis_shm_remote_trylock(rf, ofst, n, exclusive);
+    if (locked < 0)
+        return SQLITE_IOERR_SHMLOCK;
+    if (!locked)
+        return SQLITE_BUSY;
+    *held |= mask;
+    return SQLITE_OK;
+}
+
+/* Renew our wal-index lease with the database's (see redis_lock_keepalive).
+ * If it ran out with slots locked, others may have changed what they
+ * guard, so the read or write fails */
+static int redis_shm_keepalive(RedisFile *rf) {
+    RedisShm *shm = rf->shm;
+    if (!shm || shm->node || _now_us() - shm->renewed < rf->lockleasems * 500)
+        return REDIS_OK;
+    long long ret = redis_shm_lockcmd(rf, "renew");
+    if (ret < 0)
+        return REDIS_ERR;
+    if (ret > 0)
+        return REDIS_OK;
+
+    DLOG("%s lost its wal-index lease", rf->keyprefix);
+    rf->lockstats.lost++;
+    bool held = shm->sharedmask || shm->exclmask;
+    shm->sharedmask = shm->exclmask = 0;
+    return held ? REDIS_ERR : REDIS_OK;
+}
+
+static int redis_shm_remote_map(RedisFile *rf, int iregion, int szregion, bool extend, void volatile **pp) {
+    RedisShm *shm = rf->shm;
+    if (shm->nregion > iregion) {
+        *pp = shm->regions[iregion];
+        return SQLITE_OK;
+    }
+
+    // Regions are only ever added in order
+    char key[REDISVFS_KEYBUFLEN];
+    char field[20];
+    get_shmkey(rf, "shm", key);
+    _shm_region_field(shm->nregion, field);
+    redisReply *reply = redis_command(rf, "HGET %s %s", key, field);
+    if (!reply)
+        return SQLITE_IOERR_SHMMAP;
+    if (reply->type == REDIS_REPLY_NIL && !extend) {
+        freeReplyObject(reply);
+        return SQLITE_OK;
+    }
+
+    char **regions = sqlite3_realloc64(shm->regions, (shm->nregion+1) * sizeof(char *));
+    if (regions)
+        shm->regions = regions;
+    char **shadows = sqlite3_realloc64(shm->shadows, (shm->nregion+1) * sizeof(char *));
+    if (shadows)
+        shm->shadows = shadows;
+    char *local = sqlite3_malloc64(szregion);
+    char *shadow = sqlite3_malloc64(szregion);
+    if (!regions || !shadows || !local || !shadow) {
+        sqlite3_free(local);
+        sqlite3_free(shadow);
+        freeReplyObject(reply);
+        return SQLITE_IOERR_NOMEM;
+    }
+    memset(local, 0, szregion);
+    memset(shadow, 0, szregion);
+    shm->szregion = szregion;
+    shm->regions[shm->nregion] = local;
+    shm->shadows[shm->nregion] = shadow;
+    shm->nregion++;
+    if (reply->type == REDIS_REPLY_STRING)
+        _shm_merge(shm, shm->nregion-1, reply->str, reply->len);
+    freeReplyObject(reply);
+
+    if (shm->nregion <= iregion)
+        return redis_shm_remote_map(rf, iregion, szregion, extend, pp);
+    *pp = shm->regions[iregion];
+    return SQLITE_OK;
+}
+
+/* Attach to the database's wal-index the first time sqlite maps it */
+static int redis_shm_open(RedisFile *rf) {
+    // WAL already turns commits into appends, and held back writes to the
+    // database would be missed by readers going by the shared wal-index
+    if (rf->writeback) {
+        if (redis_writeback_flush(rf) == REDIS_ERR)
+            return SQLITE_IOERR_SHMOPEN;
+        redis_writeback_destroy(rf->writeback);
+        rf->writeback = 0;
+    }
+
+    RedisShm *shm = sqlite3_malloc64(sizeof(RedisShm));
+    if (!shm)
+        return SQLITE_IOERR_NOMEM;
+    memset(shm, 0, sizeof(RedisShm));
+
+    if (!rf->shmredis) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+        sqlite3_mutex_enter(mutex);
+        shm->node = redis_shm_node_open(rf);
+        sqlite3_mutex_leave(mutex);
+        if (!shm->node) {
+            sqlite3_free(shm);
+            return SQLITE_IOERR_SHMOPEN;
+        }
+        rf->shm = shm;
+        return SQLITE_OK;
+    }
+
+    // First one in starts with an empty wal-index, like a new -shm file
+    rf->shm = shm;
+    if (redis_shm_lockcmd(rf, "open") < 0) {
+        rf->shm = 0;
+        sqlite3_free(shm);
+        return SQLITE_IOERR_SHMOPEN;
+    }
+    return SQLITE_OK;
+}
+
+static void redis_shm_close(RedisFile *rf, bool delete) {
+    RedisShm *shm = rf->shm;
+    if (shm->node) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+        sqlite3_mutex_enter(mutex);
+        for (int i = 0; i < SQLITE_SHM_NLOCK; ++i) {
+            if (shm->exclmask & (1 << i))
+                redis_shm_node_lock(shm, i, 1, SQLITE_SHM_UNLOCK|SQLITE_SHM_EXCLUSIVE);
+            if (shm->sharedmask & (1 << i))
+                redis_shm_node_lock(shm, i, 1, SQLITE_SHM_UNLOCK|SQLITE_SHM_SHARED);
+        }
+        redis_shm_node_close(shm->node, delete);
+        sqlite3_mutex_leave(mutex);
+    } else if (rf->redisctx || rf->mux) {
+        for (int i = 0; i < SQLITE_SHM_NLOCK; ++i) {
+            if (shm->exclmask & (1 << i))
+                redis_shm_remote_lock(rf, i, 1, SQLITE_SHM_UNLOCK|SQLITE_SHM_EXCLUSIVE);
+            if (shm->sharedmask & (1 << i))
+                redis_shm_remote_lock(rf, i, 1, SQLITE_SHM_UNLOCK|SQLITE_SHM_SHARED);
+        }
+        redis_shm_lockcmd(rf, "close");
+        if (delete) {
+            char shmkey[REDISVFS_KEYBUFLEN], lockkey[REDISVFS_KEYBUFLEN];
+            get_shmkey(rf, "shm", shmkey);
+            get_shmkey(rf, "shm:locks", lockkey);
+            redisReply *reply = redis_command(rf, "UNLINK %s %s", shmkey, lockkey);
+            if (reply)
+                freeReplyObject(reply);
+        }
+    }
+    for (int i = 0; i < shm->nregion; ++i) {
+        sqlite3_free(shm->regions[i]);
+        sqlite3_free(shm->shadows[i]);
+    }
+    sqlite3_free(shm->regions);
+    sqlite3_free(shm->shadows);
+    sqlite3_free(shm);
+    rf->shm = 0;
+}
+
+/* Is anyone besides us using the wal-index? */
+static bool redis_shm_shared(RedisFile *rf) {
+    RedisShm *shm = rf->shm;
+    if (shm->node) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+        sqlite3_mutex_enter(mutex);
+        bool shared = shm->node->nref > 1 || _shm_fcntl_held(shm->node->fd, REDISVFS_SHM_DMS);
+        sqlite3_mutex_leave(mutex);
+        return shared;
+    }
+    return redis_shm_lockcmd(rf, "users") != 1;
+}
+
+/* block size */
+
+static inline bool _valid_blocksize(int64_t blocksize) {
+    return blocksize >= REDISVFS_MIN_BLOCKSIZE && blocksize <= REDISVFS_MAX_BLOCKSIZE &&
+        (blocksize & (blocksize-1)) == 0;
+}
+
+/* Change the block size of a file that has nothing stored yet.  The
+ * cache and write-back buffer are sized in blocks, so rebuild them */
+static int redis_change_blocksize(RedisFile *rf, int blocksize) {
+    if (blocksize == rf->blocksize)
+        return REDIS_OK;
+    DLOG("%s block size %d -> %d", rf->keyprefix, rf->blocksize, blocksize);
+    rf->blocksize = blocksize;
+
+    if (rf->cache) {
+        RedisBlockCache *old = rf->cache;
+        rf->cache = redis_cache_create(old->nsets * REDISVFS_CACHE_WAYS, blocksize);
+        if (!rf->cache) {
+            rf->cache = old;
+            return REDIS_ERR;
+        }
+        rf->cache->stats = old->stats;
+        redis_cache_destroy(old);
+    }
+    if (rf->writeback) {
+        RedisWriteBack *old = rf->writeback;
+        assert(old->nblocks == 0);
+        rf->writeback = redis_writeback_create(old->maxblocks, blocksize);
+        if (!rf->writeback) {
+            rf->writeback = old;
+            return REDIS_ERR;
+        }
+        redis_writeback_destroy(old);
+    }
+    if (rf->codec) {
+        RedisCodec *old = rf->codec;
+        rf->codec = redis_codec_create(old->type, blocksize);
+        if (!rf->codec) {
+            rf->codec = old;
+            return REDIS_ERR;
+        }
+        redis_codec_destroy(old);
+    }
+    return REDIS_OK;
+}
+
+/* Switch to the codec a database is stored with */
+static int redis_set_codec(RedisFile *rf, const char *name) {
+    int type = redis_codec_from_name(name);
+    if (type < 0) {
+        fprintf(stderr, "%s: Error: compress '%s' for '%s' not supported by this build\n",
+                __func__, name, rf->keyprefix);
+        return REDIS_ERR;
+    }
+    if (rf->codec && rf->codec->type == type)
+        return REDIS_OK;
+    if (rf->codec) {
+        redis_codec_destroy(rf->codec);
+        rf->codec = 0;
+    }
+    if (type != REDISVFS_CODEC_NONE && !(rf->codec = redis_codec_create(type, rf->blocksize)))
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* A database nobody has written yet.  block_size=N and compress= from the
+ * URI, stored on the first write */
+static int _new_blocksize(RedisFile *rf, const char *zName) {
+    int ret = REDIS_OK;
+    sqlite3_int64 blocksize = sqlite3_uri_int64(zName, "block_size", 0);
+    if (blocksize != 0) {
+        if (_valid_blocksize(blocksize)) {
+            rf->blocksize = blocksize;
+            rf->blocksize_fixed = true;
+        } else {
+            DLOG("invalid block_size %lld", blocksize);
+            ret = REDIS_ERR;
+        }
+    }
+    const char *compress = sqlite3_uri_parameter(zName, "compress");
+    if (ret == REDIS_OK && compress && redis_set_codec(rf, compress) == REDIS_ERR)
+        ret = REDIS_ERR;
+    rf->blocksize_unsaved = true;
+    return ret;
+}
+
+/* Main database open.  Use the block size (and storage layout and codec)
+ * of whoever first wrote the database, otherwise block_size=N, layout= and
+ * compress= from the URI.  If no block size either way, the choice is left
+ * until the first write (see redis_save_blocksize) */
+static int redis_load_blocksize(RedisFile *rf, const char *zName) {
+    char key[REDISVFS_KEYBUFLEN];
+    char codeckey[REDISVFS_KEYBUFLEN];
+    get_blocksizekey(rf, key);
+    get_codeckey(rf, codeckey);
+
+    // Look for every layout in one round trip, and whether the server has
+    // the blockfile module.  The block size and codec are only ever stored
+    // together, and the block size is asked for first
+    if (redis_append_command(rf, "GET %s", key) != REDIS_OK ||
+            redis_append_command(rf, "GET %s", codeckey) != REDIS_OK ||
+            redis_append_command(rf, "HMGET %s blocksize codec", rf->keyprefix) != REDIS_OK ||
+            redis_append_command(rf, "COMMAND INFO blockfile.write") != REDIS_OK)
+        return REDIS_ERR;
+    redisReply *replies[4];
+    for (int i=0; i<4; ++i) {
+        if (redis_get_reply(rf, &replies[i]) != REDIS_OK) {
+            while (i-- > 0)
+                freeReplyObject(replies[i]);
+            return REDIS_ERR;
+        }
+    }
+    redisReply *keysreply = replies[0];
+    redisReply *hashreply = replies[2];
+    redisReply *modreply = replies[3];
+    bool havemodule = modreply->type == REDIS_REPLY_ARRAY && modreply->elements == 1 &&
+            modreply->element[0]->type == REDIS_REPLY_ARRAY;
+
+    int ret = REDIS_OK;
+    redisReply *reply = keysreply;
+    redisReply *codec = replies[1];
+    if (havemodule && keysreply->type == REDIS_REPLY_STRING && hashreply->type == REDIS_REPLY_ERROR &&
+            strncmp(hashreply->str, "WRONGTYPE", 9) == 0) {
+        // HMGET on a blockfile
+        rf->hashlayout = false;
+        rf->blockfile = true;
+    } else if (hashreply->type != REDIS_REPLY_ARRAY || hashreply->elements != 2) {
+        reply = hashreply;
+    } else if (keysreply->type == REDIS_REPLY_STRING) {
+        rf->hashlayout = false;
+        rf->blockfile = false;
+    } else if (keysreply->type == REDIS_REPLY_NIL && hashreply->element[0]->type == REDIS_REPLY_STRING) {
+        rf->hashlayout = true;
+        rf->blockfile = false;
+        reply = hashreply->element[0];
+        codec = hashreply->element[1];
+    }
+
+    if (reply->type == REDIS_REPLY_STRING && _valid_blocksize(atoll(reply->str))) {
+        rf->blocksize = atoll(reply->str);
+        if (codec->type == REDIS_REPLY_STRING)
+            ret = redis_set_codec(rf, codec->str);
+    } else if (reply->type == REDIS_REPLY_NIL) {
+        ret = _new_blocksize(rf, zName);
+        // The module, unless the URI wants something it can't do
+        if (havemodule && !sqlite3_uri_parameter(zName, "layout") && !rf->codec && !rf->cluster)
+            rf->blockfile = true;
+    } else {
+        redis_debugreply(reply);
+        ret = REDIS_ERR;
+    }
+    if (ret == REDIS_OK && rf->blockfile && (!havemodule || rf->codec || rf->cluster)) {
+        fprintf(stderr, "%s: Error: layout=blockfile needs the blockfile module on the server, "
+                "and can't be used with compress= or cluster=1\n", __func__);
+        ret = REDIS_ERR;
+    }
+    DLOG("%s layout=%s", rf->keyprefix, rf->blockfile ? "blockfile" : rf->hashlayout ? "hash" : "keys");
+    for (int i=0; i<4; ++i)
+        freeReplyObject(replies[i]);
+    return ret;
+}
+
+/* KEYS block size key, codec key.  ARGV block size, codec ("" for none).
+ * Stores both unless the file already has a block size.  Replies with
+ * whatever the file ends up with */
+static RedisScript redis_newfile_script = { .text =
+    "if redis.call('SET',KEYS[1],ARGV[1],'NX') and ARGV[2]~='' then "
+    "redis.call('SET',KEYS[2],ARGV[2]) end "
+    "return {redis.call('GET',KEYS[1]),redis.call('GET',KEYS[2])}" };
+
+/* Same for layout=blockfile, which has no codec.  KEYS block size key,
+ * the blockfile.  ARGV block size.  Makes the blockfile too, so that the
+ * layout can be told from the start */
+static RedisScript redis_bnewfile_script = { .text =
+    "if redis.call('SET',KEYS[1],ARGV[1],'NX') then "
+    "redis.call('BLOCKFILE.TRUNCATE',KEYS[2],0) end "
+    "return {redis.call('GET',KEYS[1])}" };
+
+/* Same for layout=hash.  KEYS the hash */
+static RedisScript redis_hnewfile_script = { .text =
+    "if redis.call('HSETNX',KEYS[1],'blocksize',ARGV[1])==1 and ARGV[2]~='' then "
+    "redis.call('HSET',KEYS[1],'codec',ARGV[2]) end "
+    "return redis.call('HMGET',KEYS[1],'blocksize','codec')" };
+
+/* Block size for a new database, given its first write */
+static int _first_blocksize(RedisFile *rf, int iAmt, sqlite3_int64 iOfst) {
+    // sqlite writes page 1 whole and first, so unless told otherwise
+    // match blocks to the page size
+    if (!rf->blocksize_fixed && iOfst == 0 && _valid_blocksize(iAmt))
+        return iAmt;
+    return rf->blocksize;
+}
+
+/* First write to a new database.  Settle on the block size and store it
+ * before any blocks go out */
+static int redis_save_blocksize(RedisFile *rf, int iAmt, sqlite3_int64 iOfst) {
+    int blocksize = _first_blocksize(rf, iAmt, iOfst);
+    const char *codec = rf->codec ? redis_codec_name(rf->codec->type) : "";
+
+    char key[REDISVFS_KEYBUFLEN];
+    char codeckey[REDISVFS_KEYBUFLEN];
+    char size[24];
+    get_blocksizekey(rf, key);
+    get_codeckey(rf, codeckey);
+    snprintf(size, sizeof(size), "%d", blocksize);
+    redisReply *reply;
+    if (rf->blockfile) {
+        const char *args[] = { key, rf->keyprefix, size };
+        reply = redis_script_command(rf, &redis_bnewfile_script, 2, 3, args);
+    } else if (rf->hashlayout) {
+        const char *args[] = { rf->keyprefix, size, codec };
+        reply = redis_script_command(rf, &redis_hnewfile_script, 1, 3, args);
+    } else {
+        const char *args[] = { key, codeckey, size, codec };
+        reply = redis_script_command(rf, &redis_newfile_script, 2, 4, args);
+    }
+    if (reply == NULL)
+        return REDIS_ERR;
+
+    // If we lost a race with another writer, go with theirs
+    int ret = REDIS_ERR;
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 1 &&
+            reply->element[0]->type == REDIS_REPLY_STRING) {
+        blocksize = atoll(reply->element[0]->str);
+        bool compressed = reply->elements == 2 && reply->element[1]->type == REDIS_REPLY_STRING;
+        if (_valid_blocksize(blocksize) &&
+                redis_set_codec(rf, compressed ? reply->element[1]->str : "none") == REDIS_OK)
+            ret = REDIS_OK;
+    } else {
+        redis_debugreply(reply);
+    }
+    freeReplyObject(reply);
+
+    if (ret == REDIS_ERR || redis_change_blocksize(rf, blocksize) == REDIS_ERR)
+        return REDIS_ERR;
+    rf->blocksize_unsaved = false;
+    return REDIS_OK;
+}
+
+
+/* redis backend */
+
+static const RedisBackend redis_backend = {
+    "redis",
+    redis_resp_get,
+    redis_resp_getrange,
+    redis_resp_set,
+    redis_resp_setrange,
+    redis_resp_del,
+    redis_resp_extend,
+    redis_resp_readrange,
+    redis_resp_writerange,
+    redis_flush,
+    redis_reply,
+    redis_length,
+    redis_exists,
+    redis_truncate_file,
+    redis_lock_cmd,
+    redis_durable,
+    redis_load_blocksize,
+    redis_save_blocksize,
+};
+
+
+/* memory backend
+ *
+ * backend=memory keeps files in this process instead of redis, for every
+ * connection in the process to share.  Same behaviour as the redis one as
+ * far as the file layer can tell: missing blocks are nil, SETRANGE zero
+ * pads, truncation frees the blocks past the end and the lock rules are
+ * the same (without leases).  A file goes when it is deleted, or is empty
+ * once nobody has it open.
+ *
+ * Commands are carried out as they are queued, under the static mutex,
+ * and their replies kept for reply to hand back in order.  Replies live
+ * in the file's RedisMemConn until the next command is queued after
+ * they've all been taken.
+ */
+
+struct RedisMemBlock {
+    char *data;
+    size_t len;
+};
+
+struct RedisMemLock {
+    const RedisFile *owner;
+    int level;
+};
+
+struct RedisMemFile {
+    struct RedisMemFile *next;
+    char *name;
+    int refs;           // RedisMemConns open on it
+    int blocksize;      // 0 until the first write (see redis_save_blocksize)
+    int codec;
+    int64_t size;
+    struct RedisMemBlock *blocks;
+    int64_t nblocks;    // slots in blocks, not how many are stored
+    struct RedisMemLock *locks;
+    int nlocks;
+};
+
+struct RedisMemReply {
+    int type;
+    long long integer;
+    size_t off, len;    // string in data
+};
+
+struct RedisMemConn {
+    struct RedisMemFile *file;
+    struct RedisMemReply *replies;
+    int nreplies, head, maxreplies;
+    char *data;
+    size_t datalen, datacap;
+};
+
+// Every file in the store.  Guarded by the SQLITE_MUTEX_STATIC_VFS3 mutex
+static struct RedisMemFile *redis_mem_files;
+
+/* Keep a reply to a command.  bytes sent are counted as though it went
+ * over the wire.  pre: mem mutex held */
+static int _mem_queue(RedisFile *rf, size_t sent, int type, long long integer, const char *str, size_t len) {
+    RedisMemConn *mc = rf->mem;
+    if (mc->head == mc->nreplies)
+        mc->head = mc->nreplies = mc->datalen = 0;
+    if (mc->nreplies == mc->maxreplies) {
+        int n = mc->maxreplies ? 2 * mc->maxreplies : 64;
+        struct RedisMemReply *replies = sqlite3_realloc64(mc->replies, n * sizeof(struct RedisMemReply));
+        if (!replies)
+            return REDIS_ERR;
+        mc->replies = replies;
+        mc->maxreplies = n;
+    }
+    // NUL terminated like hiredis strings
+    if (mc->datalen + len + 1 > mc->datacap) {
+        size_t n = mc->datacap ? 2 * mc->datacap : 65536;
+        while (n < mc->datalen + len + 1)
+            n *= 2;
+        char *data = sqlite3_realloc64(mc->data, n);
+        if (!data)
+            return REDIS_ERR;
+        mc->data = data;
+        mc->datacap = n;
+    }
+    struct RedisMemReply *r = &mc->replies[mc->nreplies++];
+    r->type = type;
+    r->integer = integer;
+    r->off = mc->datalen;
+    r->len = len;
+    if (len > 0)
+        memcpy(mc->data + mc->datalen, str, len);
+    mc->data[mc->datalen + len] = '\0';
+    mc->datalen += len + 1;
+
+    rf->iostats.commands++;
+    redis_iostats_sent(rf, sent);
+    return REDIS_OK;
+}
+
+/* Commands that wait for their own reply */
+static void _mem_roundtrip(RedisFile *rf) {
+    rf->iostats.commands++;
+    rf->iostats.round_trips++;
+}
+
+/* The block, or NULL if it isn't stored.  With create it is made (empty)
+ * if need be, and only NULL when out of memory.  pre: mem mutex held */
+static struct RedisMemBlock *_mem_block(struct RedisMemFile *mf, int64_t blocknum, bool create) {
+    if (blocknum >= mf->nblocks) {
+        if (!create)
+            return NULL;
+        int64_t n = mf->nblocks ? mf->nblocks : 64;
+        while (n <= blocknum)
+            n *= 2;
+        struct RedisMemBlock *blocks = sqlite3_realloc64(mf->blocks, n * sizeof(struct RedisMemBlock));
+        if (!blocks)
+            return NULL;
+        memset(blocks + mf->nblocks, 0, (n - mf->nblocks) * sizeof(struct RedisMemBlock));
+        mf->blocks = blocks;
+        mf->nblocks = n;
+    }
+    struct RedisMemBlock *blk = &mf->blocks[blocknum];
+    return (blk->data || create) ? blk : NULL;
+}
+
+/* Returns whether there was anything to free.  pre: mem mutex held */
+static bool _mem_free_block(struct RedisMemBlock *blk) {
+    if (!blk->data)
+        return false;
+    sqlite3_free(blk->data);
+    blk->data = NULL;
+    blk->len = 0;
+    return true;
+}
+
+static int redis_mem_get(RedisFile *rf, int64_t offset) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemBlock *blk = _mem_block(rf->mem->file, offset / rf->blocksize, false);
+    int ret = blk ? _mem_queue(rf, 0, REDIS_REPLY_STRING, 0, blk->data, blk->len)
+                  : _mem_queue(rf, 0, REDIS_REPLY_NIL, 0, NULL, 0);
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_getrange(RedisFile *rf, int64_t offset, int64_t len) {
+    int64_t block_first = offset % rf->blocksize;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemBlock *blk = _mem_block(rf->mem->file, offset / rf->blocksize, false);
+    int64_t avail = (blk && (int64_t)blk->len > block_first) ? (int64_t)blk->len - block_first : 0;
+    if (avail > len)
+        avail = len;
+    int ret = _mem_queue(rf, 0, REDIS_REPLY_STRING, 0, avail > 0 ? blk->data + block_first : NULL, avail);
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_set(RedisFile *rf, int64_t offset, const char *data, size_t len) {
+    int ret = REDIS_ERR;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemBlock *blk = _mem_block(rf->mem->file, offset / rf->blocksize, true);
+    char *copy = blk ? sqlite3_realloc64(blk->data, len) : NULL;
+    if (copy) {
+        memcpy(copy, data, len);
+        blk->data = copy;
+        blk->len = len;
+        ret = _mem_queue(rf, len, REDIS_REPLY_STATUS, 0, "OK", 2);
+    }
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_setrange(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    int64_t block_first = offset % rf->blocksize;
+    int ret = REDIS_ERR;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemBlock *blk = _mem_block(rf->mem->file, offset / rf->blocksize, true);
+    size_t newlen = blk && (int64_t)blk->len > block_first + len ? blk->len : block_first + len;
+    char *copy = blk ? sqlite3_realloc64(blk->data, newlen) : NULL;
+    if (copy) {
+        if ((int64_t)blk->len < block_first)
+            memset(copy + blk->len, 0, block_first - blk->len);
+        memcpy(copy + block_first, data, len);
+        blk->data = copy;
+        blk->len = newlen;
+        ret = _mem_queue(rf, len, REDIS_REPLY_INTEGER, newlen, NULL, 0);
+    }
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_del(RedisFile *rf, int64_t offset) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemBlock *blk = _mem_block(rf->mem->file, offset / rf->blocksize, false);
+    bool freed = blk && _mem_free_block(blk);
+    int ret = _mem_queue(rf, 0, REDIS_REPLY_INTEGER, freed, NULL, 0);
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_extend(RedisFile *rf, int64_t minlen) {
+    struct RedisMemFile *mf = rf->mem->file;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    if (minlen > mf->size)
+        mf->size = minlen;
+    int ret = _mem_queue(rf, 0, REDIS_REPLY_INTEGER, mf->size, NULL, 0);
+    sqlite3_mutex_leave(mutex);
+    return ret;
+}
+
+static int redis_mem_flush(RedisFile *rf) {
+    return REDIS_OK;
+}
+
+static int redis_mem_reply(RedisFile *rf, RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    RedisMemConn *mc = rf->mem;
+    if (mc->head == mc->nreplies)
+        return REDIS_ERR;
+    struct RedisMemReply *r = &mc->replies[mc->head++];
+    memset(&sink->reply, 0, sizeof(redisReply));
+    sink->reply.type = r->type;
+    sink->reply.integer = r->integer;
+    if (r->type == REDIS_REPLY_STRING || r->type == REDIS_REPLY_STATUS) {
+        sink->reply.str = mc->data + r->off;
+        sink->reply.len = r->len;
+        if (dst && r->type == REDIS_REPLY_STRING) {
+            memcpy(dst, sink->reply.str, r->len < cap ? r->len : cap);
+            sink->reply.str = dst;
+        }
+    }
+    *reply = &sink->reply;
+    redis_iostats_reply(rf, *reply);
+    return REDIS_OK;
+}
+
+static int64_t redis_mem_length(RedisFile *rf) {
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    int64_t size = rf->mem->file->size;
+    sqlite3_mutex_leave(mutex);
+    _mem_roundtrip(rf);
+    return size;
+}
+
+/* An empty file goes when it's closed, so there's no telling it apart
+ * from one that was never there */
+static int redis_mem_exists(RedisFile *rf) {
+    return redis_mem_length(rf) > 0;
+}
+
+static int redis_mem_truncate(RedisFile *rf, int64_t newsize, bool delete) {
+    struct RedisMemFile *mf = rf->mem->file;
+    sqlite3_int64 freed = 0;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    int64_t bs = mf->blocksize ? mf->blocksize : rf->blocksize;
+    for (int64_t blocknum=(newsize + bs - 1) / bs; blocknum<mf->nblocks; ++blocknum)
+        freed += _mem_free_block(&mf->blocks[blocknum]);
+    mf->size = newsize;
+    if (delete) {
+        mf->blocksize = 0;
+        mf->codec = REDISVFS_CODEC_NONE;
+    }
+    sqlite3_mutex_leave(mutex);
+    _mem_roundtrip(rf);
+
+    DLOG("%s truncated to %lld. %lld blocks freed", rf->keyprefix, (long long)newsize, freed);
+    redis_count_reclaimed(freed, 0, 0);
+    rf->filesize = delete ? -1 : newsize;
+    return REDIS_OK;
+}
+
+/* Set our entry in the lock table.  pre: mem mutex held */
+static void _mem_setlock(struct RedisMemFile *mf, const RedisFile *rf, int level) {
+    int i = 0;
+    while (i < mf->nlocks && mf->locks[i].owner != rf)
+        ++i;
+    if (level == 0) {
+        if (i < mf->nlocks)
+            mf->locks[i] = mf->locks[--mf->nlocks];
+        return;
+    }
+    // There are never more entries than files open on it
+    if (i == mf->nlocks)
+        mf->locks[mf->nlocks++].owner = rf;
+    mf->locks[i].level = level;
+}
+
+/* redis_lock_script without the leases, which can't run out in-process */
+static int redis_mem_lock(RedisFile *rf, const char *op, int want) {
+    struct RedisMemFile *mf = rf->mem->file;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    int mine = 0, others = 0;
+    bool writer = false, pending = false;
+    for (int i=0; i<mf->nlocks; ++i) {
+        if (mf->locks[i].owner == rf) {
+            mine = mf->locks[i].level;
+        } else {
+            others++;
+            writer = writer || mf->locks[i].level >= SQLITE_LOCK_RESERVED;
+            pending = pending || mf->locks[i].level >= SQLITE_LOCK_PENDING;
+        }
+    }
+    int got = mine;
+    if (strcmp(op, "check") == 0) {
+        got = writer || mine >= SQLITE_LOCK_RESERVED;
+    } else if (strcmp(op, "renew") == 0) {
+        // nothing to renew
+    } else if (strcmp(op, "unlock") == 0) {
+        got = mine < want ? mine : want;
+    } else if (want == SQLITE_LOCK_SHARED) {
+        if (mine == SQLITE_LOCK_NONE && !pending)
+            got = SQLITE_LOCK_SHARED;
+    } else if (mine >= SQLITE_LOCK_SHARED && mine < want) {
+        if (want == SQLITE_LOCK_RESERVED) {
+            if (!writer)
+                got = SQLITE_LOCK_RESERVED;
+        } else if (mine >= SQLITE_LOCK_RESERVED || !writer) {
+            got = others == 0 ? SQLITE_LOCK_EXCLUSIVE : SQLITE_LOCK_PENDING;
+        }
+    }
+    if (strcmp(op, "check") != 0)
+        _mem_setlock(mf, rf, got);
+    sqlite3_mutex_leave(mutex);
+    _mem_roundtrip(rf);
+
+    if (strcmp(op, "check") != 0)
+        rf->lockrenewed = _now_us();
+    return got;
+}
+
+/* Nothing is more durable than the process */
+static int redis_mem_sync(RedisFile *rf) {
+    return REDIS_OK;
+}
+
+static int redis_mem_load_blocksize(RedisFile *rf, const char *zName) {
+    struct RedisMemFile *mf = rf->mem->file;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    int blocksize = mf->blocksize;
+    int codec = mf->codec;
+    sqlite3_mutex_leave(mutex);
+    _mem_roundtrip(rf);
+
+    if (blocksize == 0)
+        return _new_blocksize(rf, zName);
+    rf->blocksize = blocksize;
+    return redis_set_codec(rf, redis_codec_name(codec));
+}
+
+static int redis_mem_save_blocksize(RedisFile *rf, int iAmt, sqlite3_int64 iOfst) {
+    struct RedisMemFile *mf = rf->mem->file;
+    int blocksize = _first_blocksize(rf, iAmt, iOfst);
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    // If we lost a race with another writer, go with theirs
+    if (mf->blocksize == 0) {
+        mf->blocksize = blocksize;
+        mf->codec = rf->codec ? rf->codec->type : REDISVFS_CODEC_NONE;
+    }
+    blocksize = mf->blocksize;
+    int codec = mf->codec;
+    sqlite3_mutex_leave(mutex);
+    _mem_roundtrip(rf);
+
+    if (redis_set_codec(rf, redis_codec_name(codec)) == REDIS_ERR ||
+            redis_change_blocksize(rf, blocksize) == REDIS_ERR)
+        return REDIS_ERR;
+    rf->blocksize_unsaved = false;
+    return REDIS_OK;
+}
+
+/* Find the file in the store, or make it */
+static int redis_mem_open(RedisFile *rf) {
+    RedisMemConn *mc = sqlite3_malloc64(sizeof(RedisMemConn));
+    if (!mc)
+        return REDIS_ERR;
+    memset(mc, 0, sizeof(RedisMemConn));
+
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    struct RedisMemFile *mf = redis_mem_files;
+    while (mf && strcmp(mf->name, rf->keyprefix) != 0)
+        mf = mf->next;
+    if (!mf && (mf = sqlite3_malloc64(sizeof(struct RedisMemFile) + rf->keyprefixlen + 1))) {
+        memset(mf, 0, sizeof(struct RedisMemFile));
+        mf->name = (char *)(mf + 1);
+        memcpy(mf->name, rf->keyprefix, rf->keyprefixlen + 1);
+        mf->next = redis_mem_files;
+        redis_mem_files = mf;
+    }
+    // One lock table entry per file open on it at most
+    struct RedisMemLock *locks = mf ? sqlite3_realloc64(mf->locks, (mf->refs + 1) * sizeof(struct RedisMemLock)) : NULL;
+    if (locks) {
+        mf->locks = locks;
+        mf->refs++;
+        mc->file = mf;
+    }
+    sqlite3_mutex_leave(mutex);
+
+    if (!mc->file) {
+        sqlite3_free(mc);
+        return REDIS_ERR;
+    }
+    rf->mem = mc;
+    return REDIS_OK;
+}
+
+/* Let go of the file and any lock we still hold on it */
+static void redis_mem_close(RedisFile *rf) {
+    RedisMemConn *mc = rf->mem;
+    struct RedisMemFile *mf = mc->file;
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+    sqlite3_mutex_enter(mutex);
+    _mem_setlock(mf, rf, 0);
+    if (--mf->refs == 0 && mf->size == 0 && mf->blocksize == 0) {
+        struct RedisMemFile **pp = &redis_mem_files;
+        while (*pp != mf)
+            pp = &(*pp)->next;
+        *pp = mf->next;
+        for (int64_t blocknum=0; blocknum<mf->nblocks; ++blocknum)
+            _mem_free_block(&mf->blocks[blocknum]);
+        sqlite3_free(mf->blocks);
+        sqlite3_free(mf->locks);
+        sqlite3_free(mf);
+    }
+    sqlite3_mutex_leave(mutex);
+    sqlite3_free(mc->replies);
+    sqlite3_free(mc->data);
+    sqlite3_free(mc);
+    rf->mem = 0;
+}
+
+static const RedisBackend redis_mem_backend = {
+    "memory",
+    redis_mem_get,
+    redis_mem_getrange,
+    redis_mem_set,
+    redis_mem_setrange,
+    redis_mem_del,
+    redis_mem_extend,
+    NULL,
+    NULL,
+    redis_mem_flush,
+    redis_mem_reply,
+    redis_mem_length,
+    redis_mem_exists,
+    redis_mem_truncate,
+    redis_mem_lock,
+    redis_mem_sync,
+    redis_mem_load_blocksize,
+    redis_mem_save_blocksize,
+};
+
+
+/* latency injection
+ *
+ * backend_latency_us=N wraps the backend so that every round trip to it
+ * takes N us longer, plus up to backend_jitter_us=M more picked from a
+ * fixed seed.  A round trip is the first reply after commands were queued,
+ * or any of the calls that wait for their own reply.  Read-ahead, cache
+ * invalidations, journal segments and shm=redis talk to redis directly
+ * and aren't slowed down.
+ */
+
+struct RedisDelay {
+    const RedisBackend *inner;
+    sqlite3_int64 latency_us;
+    sqlite3_int64 jitter_us;
+    uint64_t rng;       // xorshift64 state
+    bool queued;        // commands queued since the last round trip
+};
+
+static void _delay_roundtrip(RedisDelay *d) {
+    sqlite3_int64 us = d->latency_us;
+    if (d->jitter_us > 0) {
+        d->rng ^= d->rng << 13;
+        d->rng ^= d->rng >> 7;
+        d->rng ^= d->rng << 17;
+        us += d->rng % (uint64_t)(d->jitter_us + 1);
+    }
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static int redis_delay_get(RedisFile *rf, int64_t offset) {
+    rf->delay->queued = true;
+    return rf->delay->inner->get(rf, offset);
+}
+static int redis_delay_getrange(RedisFile *rf, int64_t offset, int64_t len) {
+    rf->delay->queued = true;
+    return rf->delay->inner->getrange(rf, offset, len);
+}
+static int redis_delay_set(RedisFile *rf, int64_t offset, const char *data, size_t len) {
+    rf->delay->queued = true;
+    return rf->delay->inner->set(rf, offset, data, len);
+}
+static int redis_delay_setrange(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    rf->delay->queued = true;
+    return rf->delay->inner->setrange(rf, offset, data, len);
+}
+static int redis_delay_del(RedisFile *rf, int64_t offset) {
+    rf->delay->queued = true;
+    return rf->delay->inner->del(rf, offset);
+}
+static int redis_delay_extend(RedisFile *rf, int64_t minlen) {
+    rf->delay->queued = true;
+    return rf->delay->inner->extend(rf, minlen);
+}
+static int redis_delay_readrange(RedisFile *rf, int64_t offset, int64_t len) {
+    rf->delay->queued = true;
+    return rf->delay->inner->readrange(rf, offset, len);
+}
+static int redis_delay_writerange(RedisFile *rf, int64_t offset, const char *data, int64_t len) {
+    rf->delay->queued = true;
+    return rf->delay->inner->writerange(rf, offset, data, len);
+}
+static int redis_delay_flush(RedisFile *rf) {
+    return rf->delay->inner->flush(rf);
+}
+static int redis_delay_reply(RedisFile *rf, RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    if (rf->delay->queued) {
+        rf->delay->queued = false;
+        _delay_roundtrip(rf->delay);
+    }
+    return rf->delay->inner->reply(rf, sink, dst, cap, reply);
+}
+static int64_t redis_delay_length(RedisFile *rf) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->length(rf);
+}
+static int redis_delay_exists(RedisFile *rf) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->exists(rf);
+}
+static int redis_delay_truncate(RedisFile *rf, int64_t newsize, bool delete) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->truncate(rf, newsize, delete);
+}
+static int redis_delay_lock(RedisFile *rf, const char *op, int level) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->lock(rf, op, level);
+}
+static int redis_delay_sync(RedisFile *rf) {
+    if (rf->durability >= REDISVFS_DURABILITY_REPLICAS)
+        _delay_roundtrip(rf->delay);
+    return rf->delay->inner->sync(rf);
+}
+static int redis_delay_load_blocksize(RedisFile *rf, const char *zName) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->load_blocksize(rf, zName);
+}
+static int redis_delay_save_blocksize(RedisFile *rf, int iAmt, sqlite3_int64 iOfst) {
+    _delay_roundtrip(rf->delay);
+    return rf->delay->inner->save_blocksize(rf, iAmt, iOfst);
+}
+
+static const RedisBackend redis_delay_backend = {
+    "delay",
+    redis_delay_get,
+    redis_delay_getrange,
+    redis_delay_set,
+    redis_delay_setrange,
+    redis_delay_del,
+    redis_delay_extend,
+    redis_delay_readrange,
+    redis_delay_writerange,
+    redis_delay_flush,
+    redis_delay_reply,
+    redis_delay_length,
+    redis_delay_exists,
+    redis_delay_truncate,
+    redis_delay_lock,
+    redis_delay_sync,
+    redis_delay_load_blocksize,
+    redis_delay_save_blocksize,
+};
+
+/* Put backend_latency_us= and backend_jitter_us= in front of rf->backend */
+static int redis_delay_wrap(RedisFile *rf, sqlite3_int64 latency_us, sqlite3_int64 jitter_us) {
+    RedisDelay *d = sqlite3_malloc64(sizeof(RedisDelay));
+    if (!d)
+        return REDIS_ERR;
+    d->inner = rf->backend;
+    d->latency_us = latency_us > 0 ? latency_us : 0;
+    d->jitter_us = jitter_us > 0 ? jitter_us : 0;
+    d->rng = 0x9e3779b97f4a7c15ULL;
+    d->queued = false;
+    rf->delay = d;
+    rf->backend = &redis_delay_backend;
+    return REDIS_OK;
+}
+
+
+/* range I/O
+ *
+ * range_io=1 sends each xRead and xWrite to redis as a single script call
+ * over the whole byte range (redis_range_script) rather than a pipeline of
+ * block commands and a length update.  Still one round trip, but one
+ * command, and a write lands atomically with its length.  The script is
+ * loaded at open and called by SHA.  Only for a single server (or mux=1)
+ * and uncompressed blocks.  Reads that can be served in part from the
+ * cache or write-back take the block by block path instead.  The blocks
+ * are passed as script keys, so CLIENT TRACKING still follows them.
+ *
+ * layout=blockfile always works this way, with BLOCKFILE.READ and
+ * BLOCKFILE.WRITE in place of the script.
+ */
+
+/* Run the range script and take its reply.  data NULL to read len bytes,
+ * which go to dst if it can hold them (see the reply sink).  Reloads the
+ * script if redis has lost it, say to a restart */
+static int redis_range_call(RedisFile *rf, int64_t offset, const char *data, int64_t len,
+        RedisReplySink *sink, char *dst, size_t cap, redisReply **reply) {
+    for (int tries=0; ; ++tries) {
+        int ret = data ? rf->backend->writerange(rf, offset, data, len)
+                       : rf->backend->readrange(rf, offset, len);
+        if (ret == REDIS_ERR || rf->backend->flush(rf) == REDIS_ERR ||
+                rf->backend->reply(rf, sink, dst, cap, reply) == REDIS_ERR)
+            return REDIS_ERR;
+        if (tries > 0 || !_noscript(*reply))
+            return REDIS_OK;
+        DLOG("%s range script gone. Reloading", rf->keyprefix);
+        redis_reply_release(sink, *reply);
+        if (redis_script_load(rf, &redis_range_script) == REDIS_ERR)
+            return REDIS_ERR;
+    }
+}
+
+/* True if any block of [offset, end) is dirty or cached */
+static bool redis_range_local(RedisFile *rf, int64_t offset, int64_t end) {
+    for (int64_t blkstart=_start_of_block(rf, offset); blkstart<end; blkstart+=rf->blocksize) {
+        int64_t blocknum = blkstart / rf->blocksize;
+        if (rf->writeback && redis_writeback_find(rf->writeback, blocknum))
+            return true;
+        if (rf->cache && _cache_find(rf->cache, blocknum))
+            return true;
+    }
+    return false;
+}
+
+static int redis_range_read(RedisFile *rf, char *buf, int iAmt, sqlite3_int64 iOfst) {
+    RedisReplySink sink;
+    redisReply *reply;
+    if (redis_range_call(rf, iOfst, NULL, iAmt, &sink, buf, iAmt, &reply) == REDIS_ERR)
+        return SQLITE_IOERR_READ;
+
+    int ret = SQLITE_OK;
+    int64_t got = 0;
+    if (reply->type == REDIS_REPLY_STRING && reply->len <= (size_t)iAmt) {
+        got = reply->len;
+        if (got > 0 && reply->str != buf)
+            memcpy(buf, reply->str, got);
+        // Past the end of the file is a short read
+        if (got < iAmt)
+            ret = SQLITE_IOERR_SHORT_READ;
+        // Blocks the reply covers whole go in the cache.  Any holes in
+        // them are zeros as far as anyone reading can tell
+        if (rf->cache) {
+            int64_t end = iOfst+got;
+            for (int64_t blkstart=_start_of_block(rf, iOfst); blkstart<end; blkstart+=rf->blocksize) {
+                rf->cache->stats.misses++;
+                if (blkstart >= iOfst && blkstart+rf->blocksize <= end)
+                    redis_cache_store(rf->cache, blkstart / rf->blocksize,
+                            buf+(blkstart-iOfst), rf->blocksize, false);
+            }
+        }
+    } else {
+        DLOG("bad range reply");
+        redis_debugreply(reply);
+        ret = SQLITE_IOERR_READ;
+    }
+    // sqlite needs the rest of a short read zero filled
+    if (got < iAmt)
+        memset(buf+got, 0, iAmt-got);
+    redis_reply_release(&sink, reply);
+    return ret;
+}
+
+static int redis_range_write(RedisFile *rf, const char *buf, int iAmt, sqlite3_int64 iOfst) {
+    int64_t end = iOfst+iAmt;
+    for (int64_t blkstart=_start_of_block(rf, iOfst); blkstart<end; blkstart+=rf->blocksize) {
+        // Tracking is NOLOOP, so redis won't tell us about our own writes
+        if (rf->cache)
+            redis_cache_drop(rf->cache, blkstart / rf->blocksize);
+        // The script deletes these, as the pipeline would have
+        if (blkstart >= iOfst && blkstart+rf->blocksize <= end &&
+                _block_is_zero(buf+(blkstart-iOfst), rf->blocksize))
+            rf->compressstats.zero_blocks++;
+    }
+
+    RedisReplySink sink;
+    redisReply *reply;
+    if (redis_range_call(rf, iOfst, buf, iAmt, &sink, NULL, 0, &reply) == REDIS_ERR)
+        return SQLITE_IOERR_WRITE;
+    int ret = SQLITE_OK;
+    if (reply->type == REDIS_REPLY_INTEGER) {
+        rf->filesize = reply->integer;
+    } else {
+        redis_debugreply(reply);
+        ret = SQLITE_IOERR_WRITE;
+    }
+    redis_reply_release(&sink, reply);
+    return ret;
 }
 
+
 /*
  * File API implementation
  *
@@ -257,29 +5801,140 @@ static int redis_queuecmd_delete_block(RedisFile *rf, sqlite3_int64 offset) {
 int redisvfs_close(sqlite3_file *fp) {
     DLOG("disconnecting from redis");
     RedisFile *rf = (RedisFile *)fp;
+    int ret = SQLITE_OK;
+    if (rf->readahead) {
+        if (rf->redisctx && redis_readahead_drain(rf) == REDIS_ERR) {
+            redisFree(rf->redisctx);
+            rf->redisctx = 0;
+        }
+        redis_readahead_destroy(rf->readahead);
+        rf->readahead = 0;
+    }
+    // sqlite unmaps the wal-index itself.  Just in case it didn't
+    if (rf->shm)
+        redis_shm_close(rf, false);
+    if (rf->writeback) {
+        if (redis_writeback_flush(rf) == REDIS_ERR)
+            ret = SQLITE_IOERR_CLOSE;
+        redis_writeback_destroy(rf->writeback);
+        rf->writeback = 0;
+    }
+    // sqlite unlocks first, but don't leave others waiting out our lease
+    if (rf->locklevel > SQLITE_LOCK_NONE && (rf->redisctx || rf->mux)) {
+        if (rf->backend->lock(rf, "unlock", SQLITE_LOCK_NONE) < 0 && rf->redisctx) {
+            redisFree(rf->redisctx);
+            rf->redisctx = 0;
+        }
+        rf->locklevel = SQLITE_LOCK_NONE;
+    }
+    if (rf->cache) {
+        // A connection still tracking keys can't be handed to anyone else
+        if (rf->cluster && rf->cluster->nlanes)
+            redis_lanes_untrack(rf);
+        if (rf->redisctx && redis_disable_tracking(rf) == REDIS_ERR) {
+            redisFree(rf->redisctx);
+            rf->redisctx = 0;
+        }
+        redis_cache_destroy(rf->cache);
+        rf->cache = 0;
+    }
     if (rf->redisctx) {
-        redisFree(rf->redisctx);
+        redis_pool_put(rf->pool, rf->redisctx, rf->endpoint);
         rf->redisctx = 0;
     }
-    return SQLITE_OK;
+    if (rf->mux)
+        redis_mux_close(rf);
+    if (rf->mem)
+        redis_mem_close(rf);
+    if (rf->delay) {
+        sqlite3_free(rf->delay);
+        rf->delay = 0;
+    }
+    if (rf->cluster) {
+        redis_cluster_destroy(rf);
+        rf->cluster = 0;
+    }
+    if (rf->map) {
+        redis_map_destroy(rf->map);
+        rf->map = 0;
+    }
+    if (rf->codec) {
+        redis_codec_destroy(rf->codec);
+        rf->codec = 0;
+    }
+    sqlite3_free(rf->cmdbuf);
+    rf->cmdbuf = 0;
+    rf->cmdlen = rf->cmdcap = 0;
+    redis_iostats_fold(rf);
+    return ret;
 }
-int redisvfs_write(sqlite3_file *fp, const void *buf, int iAmt, sqlite3_int64 iOfst) {
+static int _redisvfs_write(sqlite3_file *fp, const void *buf, int iAmt, sqlite3_int64 iOfst) {
     RedisFile *rf = (RedisFile *)fp;
     DLOG("(fp=%p prefix='%s' offset=%lld len=%d)", rf, rf->keyprefix, iOfst, iAmt);
 
+    if (redis_readahead_drain(rf) == REDIS_ERR || redis_lock_keepalive(rf) == REDIS_ERR ||
+            redis_shm_keepalive(rf) == REDIS_ERR)
+        return SQLITE_IOERR_WRITE;
+
+    if (rf->journal)
+        return (redis_journal_write(rf, buf, iAmt, iOfst) == REDIS_OK) ? SQLITE_OK : SQLITE_IOERR_WRITE;
+
+    if (rf->blocksize_unsaved && rf->backend->save_blocksize(rf, iAmt, iOfst) == REDIS_ERR)
+        return SQLITE_IOERR_WRITE;
+
+    if (rf->map)
+        redis_map_write(rf->map, buf, iAmt, iOfst);
+
+    if (rf->writeback)
+        return (redis_writeback_write(rf, buf, iAmt, iOfst) == REDIS_OK) ? SQLITE_OK : SQLITE_IOERR_WRITE;
+
+    if (rf->rangeio && !rf->codec)
+        return redis_range_write(rf, buf, iAmt, iOfst);
+
     int64_t write_startp = iOfst;
     int64_t write_endp = iOfst+iAmt;
 
+    // Compressed blocks are only ever written whole.  Read in the rest of
+    // a partly written first or last block before anything is queued
+    char *headblock = NULL, *tailblock = NULL;
+    if (rf->codec) {
+        int64_t headstart = _start_of_block(rf, write_startp);
+        int64_t tailstart = _start_of_block(rf, write_endp-1);
+        if (write_startp != headstart || write_endp < headstart + rf->blocksize) {
+            headblock = rf->codec->edit;
+            if (redis_codec_load_block(rf, headblock, headstart) == REDIS_ERR)
+                return SQLITE_IOERR_WRITE;
+            int64_t end = write_endp < headstart + rf->blocksize ? write_endp : headstart + rf->blocksize;
+            memcpy(headblock + (write_startp - headstart), buf, end - write_startp);
+        }
+        if (tailstart != headstart && write_endp != tailstart + rf->blocksize) {
+            tailblock = rf->codec->edit + rf->blocksize;
+            if (redis_codec_load_block(rf, tailblock, tailstart) == REDIS_ERR)
+                return SQLITE_IOERR_WRITE;
+            memcpy(tailblock, (const char *)buf + (tailstart - write_startp), write_endp - tailstart);
+        }
+    }
+
     // Queue writes
-    for (int64_t leftp=write_startp; leftp<write_endp; leftp=_start_of_next_block(leftp)) {
-            int64_t blkstart = _start_of_block(leftp);
-            int64_t blknext = _start_of_next_block(leftp);
+    for (int64_t leftp=write_startp; leftp<write_endp; leftp=_start_of_next_block(rf, leftp)) {
+            int64_t blkstart = _start_of_block(rf, leftp);
+            int64_t blknext = _start_of_next_block(rf, leftp);
             int64_t rightp = (write_endp > blknext) ? blknext : write_endp;
 
             const char *bufleft = (const char *)buf + (leftp - write_startp);
 
-            if ((leftp == blkstart) && (rightp == blknext)) {
-                    assert((rightp-leftp) == REDISVFS_BLOCKSIZE);
+            // Tracking is NOLOOP, so redis won't tell us about our own writes
+            if (rf->cache)
+                redis_cache_drop(rf->cache, blkstart / rf->blocksize);
+
+            if (headblock && blkstart == _start_of_block(rf, write_startp)) {
+                    if (redis_queuecmd_whole_block_write(rf, blkstart, headblock) == REDIS_ERR)
+                            return SQLITE_IOERR_WRITE;
+            } else if (tailblock && rightp == write_endp) {
+                    if (redis_queuecmd_whole_block_write(rf, blkstart, tailblock) == REDIS_ERR)
+                            return SQLITE_IOERR_WRITE;
+            } else if ((leftp == blkstart) && (rightp == blknext)) {
+                    assert((rightp-leftp) == rf->blocksize);
                     DLOG("%s full block write @ %ld", rf->keyprefix, leftp);
                     if( redis_queuecmd_whole_block_write(rf, leftp, bufleft) == REDIS_ERR) {
                             return SQLITE_IOERR;
@@ -293,61 +5948,149 @@ int redisvfs_write(sqlite3_file *fp, const void *buf, int iAmt, sqlite3_int64 iO
             }
     }
 
+    // write barrier (guaranteed for single server) then update filesize.
+    // Redis runs a pipeline in order, so the length update is sent along
+    // with the block writes rather than costing its own round trip. If a
+    // block write fails the length may cover it, but the failed range reads
+    // back zero filled and sqlite sees the write error either way.
+    // In cluster mode (or with io_conns) the length goes on another
+    // connection and can land before the blocks.  Nobody reads them until
+    // the write returns and sqlite's locks let them, by which time every
+    // connection has replied.
+    bool extends = !(_filesize_cacheable(rf) && rf->filesize >= write_endp);
+    if (extends && redis_queue_increase_filesize_to(rf, write_endp) != REDIS_OK)
+        return SQLITE_IOERR_WRITE;
+
     // Execute write and check responses
+    if (rf->backend->flush(rf) == REDIS_ERR)
+        return SQLITE_IOERR_WRITE;
     int64_t successfully_written = 0;
     int return_status = SQLITE_OK;
+    RedisReplySink sink;
 
-    for (int64_t leftp=write_startp; leftp<write_endp; leftp=_start_of_next_block(leftp)) {
-            int64_t blknext = _start_of_next_block(leftp);
+    for (int64_t leftp=write_startp; leftp<write_endp; leftp=_start_of_next_block(rf, leftp)) {
+            int64_t blknext = _start_of_next_block(rf, leftp);
             int64_t rightp = (write_endp > blknext) ? blknext : write_endp;
 
             redisReply *reply;
 
             DLOG("checking reply for [%ld..%ld)", leftp,rightp);
-            if (redisGetReply(rf->redisctx, (void **)&reply) == REDIS_ERR) {
-                DLOG("ERROR: redisGetReply: %s", rf->redisctx->errstr);
+            if (rf->backend->reply(rf, &sink, NULL, 0, &reply) == REDIS_ERR) {
+                DLOG("ERROR: reading block write reply");
                 return SQLITE_IOERR_WRITE;
             }
 
             redis_debugreply(reply);
-            // FIXME: check reply before incrementing written
+            if (reply->type == REDIS_REPLY_ERROR) {
+                    return_status = SQLITE_IOERR_WRITE;
+            }
             if (return_status == SQLITE_OK) {
                     successfully_written += rightp-leftp;
             }
-            freeReplyObject(reply);
+            redis_reply_release(&sink, reply);
     }
+    if (extends && redis_consume_increase_filesize_to(rf) != REDIS_OK)
+        return_status = SQLITE_IOERR_WRITE;
 
-    // write barrier (guaranteed for single server) then update filesize
-    // TODO: Make write barrier optional and remove SAFE_APPEND guarantee
-    // if we need  to increase write performance
-    // FIXME : Add write barrier cross-cluster
-    if (successfully_written > 0) {
-        int64_t minfilesize = iOfst + successfully_written;
-        // I think we could do this earlier on there without the extra RTT, but
-        // that assumes all the writes succeeded.
-        if (redis_queue_increase_filesize_to(rf, minfilesize) != REDIS_OK)
-            return_status = SQLITE_IOERR_WRITE;
-        if (redis_consume_increase_filesize_to(rf) != REDIS_OK)
-            return_status = SQLITE_IOERR_WRITE;
-    }
     DLOG("written %ld/%d.  Returning %s\n", successfully_written, iAmt,
             return_status == SQLITE_OK ? "SQLITE_OK" : "NOT OK");
     return return_status;
 }
 
-int redisvfs_read(sqlite3_file *fp, void *buf, int iAmt, sqlite3_int64 iOfst) {
+int redisvfs_write(sqlite3_file *fp, const void *buf, int iAmt, sqlite3_int64 iOfst) {
+    RedisFile *rf = (RedisFile *)fp;
+    sqlite3_int64 start = _now_us();
+    rf->noscript = false;
+    int ret = _redisvfs_write(fp, buf, iAmt, iOfst);
+    // Writing the same bytes again changes nothing that landed
+    if (ret != SQLITE_OK && rf->noscript && redis_file_scripts_load(rf, true) == REDIS_OK)
+        ret = _redisvfs_write(fp, buf, iAmt, iOfst);
+    redis_iostats_time(&rf->iostats.write, start);
+    return ret;
+}
+
+static int _redisvfs_read(sqlite3_file *fp, void *buf, int iAmt, sqlite3_int64 iOfst) {
     RedisFile *rf = (RedisFile *)fp;
     DLOG("(fp=%p prefix='%s' offset=%lld len=%d)", rf, rf->keyprefix, iOfst, iAmt);
 
     int64_t read_startp = iOfst;
     int64_t read_endp = iOfst+iAmt;
 
+    // sqlite3 requires short reads be zero-filled for the rest of the buffer,
+    // and says database corruption will otherwise occur.  Each (sub)block
+    // below zeroes whatever part of buf it didn't fill.
+
+    if (redis_lock_keepalive(rf) == REDIS_ERR || redis_shm_keepalive(rf) == REDIS_ERR)
+        return SQLITE_IOERR_READ;
+    if (rf->journal)
+        return redis_journal_read(rf, buf, iAmt, iOfst);
+    if (rf->writeback && !redis_writeback_readable(rf, iOfst, iAmt)) {
+        if (redis_readahead_drain(rf) == REDIS_ERR || redis_writeback_flush(rf) == REDIS_ERR)
+            return SQLITE_IOERR_READ;
+    }
+    if (rf->cache)
+        redis_cache_poll_invalidations(rf);
+
+    // Wait for any prefetch we are about to need rather than asking twice
+    int64_t firstblock = read_startp / rf->blocksize;
+    int64_t lastblock = (read_endp-1) / rf->blocksize;
+    if (_readahead_pending(rf)) {
+        RedisReadAhead *ra = rf->readahead;
+        if (ra->pending[ra->pendinghead] <= lastblock && ra->pending[ra->npending-1] >= firstblock &&
+                redis_readahead_drain(rf) == REDIS_ERR)
+            return SQLITE_IOERR_READ;
+    }
+
+    if (rf->rangeio && !rf->codec && !redis_range_local(rf, read_startp, read_endp)) {
+        if (redis_readahead_drain(rf) == REDIS_ERR)
+            return SQLITE_IOERR_READ;
+        int ret = redis_range_read(rf, buf, iAmt, iOfst);
+        if (ret != SQLITE_IOERR_READ && rf->readahead &&
+                redis_readahead_update(rf, firstblock, lastblock) == REDIS_ERR)
+            ret = SQLITE_IOERR_READ;
+        return ret;
+    }
+
+    // Length of each (sub)block served straight from the write-back
+    // buffer or the cache, or -1 if it was queued to redis instead
+    int nblocks = (_start_of_block(rf, read_endp-1) - _start_of_block(rf, read_startp)) / rf->blocksize + 1;
+    int64_t cachedlen[nblocks];
+    int blockidx = 0;
+
     // Queue reads
-    for (int64_t leftp=read_startp; leftp<read_endp; leftp=_start_of_next_block(leftp)) {
-            int64_t blkstart = _start_of_block(leftp);
-            int64_t blknext = _start_of_next_block(leftp);
+    for (int64_t leftp=read_startp; leftp<read_endp; leftp=_start_of_next_block(rf, leftp), ++blockidx) {
+            int64_t blkstart = _start_of_block(rf, leftp);
+            int64_t blknext = _start_of_next_block(rf, leftp);
             int64_t rightp = (read_endp > blknext) ? blknext : read_endp;
 
+            cachedlen[blockidx] = -1;
+            if (rf->writeback) {
+                struct RedisDirtyBlock *dirty = redis_writeback_find(rf->writeback, blkstart / rf->blocksize);
+                if (dirty) {
+                    memcpy((char *)buf+(leftp-read_startp),
+                            _writeback_data(rf->writeback, dirty)+(leftp-blkstart), rightp-leftp);
+                    cachedlen[blockidx] = rightp-leftp;
+                    DLOG("dirty block read [%ld..%ld)", leftp,rightp);
+                    continue;
+                }
+            }
+            if (rf->cache) {
+                size_t len;
+                const char *data = redis_cache_lookup(rf->cache, blkstart / rf->blocksize, &len);
+                if (data) {
+                    // trim to the part of the block we want
+                    int64_t first = leftp - blkstart;
+                    int64_t avail = (int64_t)len > first ? (int64_t)len - first : 0;
+                    if (avail > rightp-leftp)
+                        avail = rightp-leftp;
+                    if (avail > 0)
+                        memcpy((char *)buf+(leftp-read_startp), data+first, avail);
+                    cachedlen[blockidx] = avail;
+                    DLOG("cached block read [%ld..%ld)", leftp,rightp);
+                    continue;
+                }
+            }
+
             if ((leftp == blkstart) && (rightp == blknext)) {
                     DLOG("full block read");
                     if( redis_queuecmd_whole_block_read(rf, blkstart) == REDIS_ERR) {
@@ -362,103 +6105,262 @@ int redisvfs_read(sqlite3_file *fp, void *buf, int iAmt, sqlite3_int64 iOfst) {
             }
     }
 
-    // sqlite3 requires short reads be zero-filled for the rest of the buffer,
-    // and says database corruption will otherwise occur
-    memset(buf, 0, iAmt); /* This will cover the requirement but only required in the case of a short read */
-
-    int64_t successfully_read = 0;
+    // Blocks that were missing or short.  Inside the file they are holes
+    // (all zero blocks aren't stored) and read as zeros.  Decided at the end
+    bool holes = false;
 
-    // We track this becausei we need to continue draining the
+    // We track this because we need to continue draining the
     // connection of command responses regardless of if the commands
     // were successful.
     int returnStatus = SQLITE_OK;
 
-    // Execute and read responses
-    for (int64_t leftp=read_startp; leftp<read_endp; leftp=_start_of_next_block(leftp)) {
-            int64_t blknext = _start_of_next_block(leftp);
+    // Any prefetches still outstanding were sent ahead of our reads
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_READ;
+
+    // Execute and read responses.  Block data is written by hiredis
+    // straight into buf (see the reply sink)
+    if (rf->backend->flush(rf) == REDIS_ERR)
+        return SQLITE_IOERR_READ;
+    RedisReplySink sink;
+    blockidx = 0;
+    for (int64_t leftp=read_startp; leftp<read_endp; leftp=_start_of_next_block(rf, leftp), ++blockidx) {
+            int64_t blkstart = _start_of_block(rf, leftp);
+            int64_t blknext = _start_of_next_block(rf, leftp);
             int64_t rightp = (read_endp > blknext) ? blknext : read_endp;
+            char *dst = (char *)buf+(leftp-read_startp);
+            int64_t want = rightp-leftp;
+
+            if (cachedlen[blockidx] >= 0) {
+                // Already copied in from the cache
+                if (cachedlen[blockidx] < want) {
+                    holes = true;
+                    memset(dst+cachedlen[blockidx], 0, want-cachedlen[blockidx]);
+                }
+                continue;
+            }
 
             redisReply *reply;
+            bool wholeblock = (leftp == blkstart) && (rightp == blknext);
+            // layout=hash and compressed blocks always get the whole block
+            // back.  Trimming a partial read (and caching the block) needs
+            // all of it, and compressed blocks need decoding first.
+            bool wholefetch = rf->hashlayout || rf->codec;
+            bool direct = !rf->codec && (!rf->hashlayout || wholeblock);
 
             DLOG("fetching next (sub)block from redis stream");
-            if (redisGetReply(rf->redisctx, (void **)&reply) == REDIS_ERR) {
-                DLOG("ERROR: redisGetReply: %s", rf->redisctx->errstr);
+            if (rf->backend->reply(rf, &sink, direct ? dst : NULL, want, &reply) == REDIS_ERR) {
+                DLOG("ERROR: reading block reply");
                 return SQLITE_IOERR_READ;
             }
+            // Bytes at the start of dst that hold data for this read
+            int64_t got = 0;
             if (reply->type == REDIS_REPLY_STRING) {
                 DLOG("Redis STRING: %lu bytes", reply->len);
-                // The read counter can only increment if any previous
-                // reads were successful and not short
-                if (returnStatus == SQLITE_OK) {
-                    if (reply->len > rightp-leftp) {
-                        DLOG("read reply overflow");
-                        return SQLITE_IOERR_READ;
-                    }
-                    if (reply->len < rightp-leftp) {
-                        DLOG("short read");
-                        returnStatus = SQLITE_IOERR_SHORT_READ;
+                const char *data = reply->str;
+                int64_t len = reply->len;
+                if (rf->codec) {
+                    char *out = wholeblock ? dst : rf->codec->block;
+                    len = redis_codec_decode(rf, data, len, out);
+                    data = out;
+                }
+                // What the cache gets, before trimming
+                const char *blockdata = data;
+                int64_t blocklen = len;
+                if (wholefetch && len > 0) {
+                    // Trim to what we asked for
+                    int64_t first = leftp - blkstart;
+                    data += (len > first) ? first : len;
+                    len = (len > first) ? len - first : 0;
+                    if (len > want)
+                        len = want;
+                }
+                if (len < 0 || len > want) {
+                    // Keep draining so the connection can be reused
+                    DLOG("bad block reply");
+                    returnStatus = SQLITE_IOERR_READ;
+                } else {
+                    if (len < want) {
+                        DLOG("short block");
+                        holes = true;
                     }
-                    if (reply->len > 0) {
-                        memcpy(buf+(leftp-read_startp), reply->str, reply->len);
+                    if (len > 0 && data != dst) {
+                        memcpy(dst, data, len);
                     }
-                    successfully_read += rightp-leftp;
+                    got = len;
                 }
-                else {
-                    DLOG("Dropping because lack of continuity");
+                // Only whole blocks go in the cache. Any invalidation
+                // for this block can only arrive after this reply.
+                bool cacheable = wholefetch || wholeblock;
+                if (rf->cache && cacheable && blocklen >= 0 && blocklen <= rf->blocksize) {
+                    redis_cache_store(rf->cache, blkstart / rf->blocksize, blockdata, blocklen, false);
                 }
             }
             else if (reply->type == REDIS_REPLY_NIL) {
                 DLOG("Block not found");
-                if (returnStatus == SQLITE_OK)
-                    returnStatus = SQLITE_IOERR_SHORT_READ;
+                holes = true;
             }
             else {
-                DLOG("wrong reply type. Bailing straight away");
-                return SQLITE_IOERR_READ;
+                DLOG("wrong reply type");
+                returnStatus = SQLITE_IOERR_READ;
             }
+            if (got < want)
+                memset(dst+got, 0, want-got);
 
-            freeReplyObject(reply);
+            redis_reply_release(&sink, reply);
     }
-    if ((returnStatus == SQLITE_IOERR_SHORT_READ) && (successfully_read == 0)) {
-        returnStatus = SQLITE_IOERR_READ;
+    if (returnStatus == SQLITE_OK && holes) {
+        // Past the end of the file is a short read
+        int64_t filesize = redis_get_filesize(rf);
+        if (filesize < 0)
+            returnStatus = SQLITE_IOERR_READ;
+        else if (filesize < read_endp)
+            returnStatus = SQLITE_IOERR_SHORT_READ;
     }
-    assert(!SQLITE_OK || (successfully_read == iAmt));
+    if (returnStatus == SQLITE_OK && rf->readahead &&
+            redis_readahead_update(rf, firstblock, lastblock) == REDIS_ERR)
+        returnStatus = SQLITE_IOERR_READ;
     return returnStatus;
 }
+int redisvfs_read(sqlite3_file *fp, void *buf, int iAmt, sqlite3_int64 iOfst) {
+    RedisFile *rf = (RedisFile *)fp;
+    sqlite3_int64 start = _now_us();
+    int ret = _redisvfs_read(fp, buf, iAmt, iOfst);
+    redis_iostats_time(&rf->iostats.read, start);
+    if (ret == SQLITE_IOERR_SHORT_READ)
+        rf->iostats.short_reads++;
+    return ret;
+}
 int redisvfs_truncate(sqlite3_file *fp, sqlite3_int64 size) {
+    RedisFile *rf = (RedisFile *)fp;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_TRUNCATE;
+    if (rf->writeback && redis_writeback_flush(rf) == REDIS_ERR)
+        return SQLITE_IOERR_TRUNCATE;
+
     sqlite3_int64 existing_size;
-    if (redisvfs_fileSize(fp, &existing_size) == REDIS_ERR)
-        return SQLITE_ERROR;
+    if (redisvfs_fileSize(fp, &existing_size) != SQLITE_OK)
+        return SQLITE_IOERR_TRUNCATE;
     if (existing_size < size)
         return SQLITE_ERROR;
-    if (redis_force_set_filesize((RedisFile *)fp, size) == REDIS_ERR)
-        return SQLITE_ERROR;
+    if (rf->backend->truncate(rf, size, false) == REDIS_ERR)
+        return SQLITE_IOERR_TRUNCATE;
+    if (rf->map)
+        redis_map_reset_from(rf->map, size / rf->map->blocksize);
     return SQLITE_OK;
 }
 int redisvfs_sync(sqlite3_file *fp, int flags) {
-    DLOG("stub");
-    // Noop. All our writes are synchronous.
-    // TODO: We can put a hard barrier in here to redis and block if we really want
-    return SQLITE_OK;
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s)", rf->keyprefix);
+    sqlite3_int64 start = _now_us();
+    int ret = SQLITE_OK;
+    // Outside of write-back mode all our writes have been acked already.
+    // durability=none leaves write-back for xUnlock (see durability)
+    if (rf->durability != REDISVFS_DURABILITY_NONE &&
+            (redis_readahead_drain(rf) == REDIS_ERR ||
+             (rf->writeback && redis_writeback_flush(rf) == REDIS_ERR) ||
+             rf->backend->sync(rf) == REDIS_ERR))
+        ret = SQLITE_IOERR_FSYNC;
+    redis_iostats_time(&rf->iostats.sync, start);
+    redis_iostats_fold(rf);
+    return ret;
 }
 int redisvfs_fileSize(sqlite3_file *fp, sqlite3_int64 *pSize) {
     RedisFile *rf = (RedisFile *)fp;
     DLOG("get_filesize(%s)", rf->keyprefix);
-    *pSize = redis_get_filesize(rf);
-    DLOG("... get_filesize(%s) = %lld", rf->keyprefix, *pSize);
-    return (*pSize >= 0) ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_int64 start = _now_us();
+    int ret = SQLITE_IOERR_FSTAT;
+    if (redis_readahead_drain(rf) == REDIS_OK) {
+        *pSize = redis_get_filesize(rf);
+        if (rf->writeback && *pSize >= 0 && rf->writeback->maxend > *pSize)
+            *pSize = rf->writeback->maxend;
+        DLOG("... get_filesize(%s) = %lld", rf->keyprefix, *pSize);
+        ret = (*pSize >= 0) ? SQLITE_OK : SQLITE_ERROR;
+    }
+    redis_iostats_time(&rf->iostats.filesize, start);
+    return ret;
 }
 int redisvfs_lock(sqlite3_file *fp, int eLock) {
-    DLOG("stub flock(%s,%d)",((RedisFile *)fp)->keyprefix,eLock);
-    return SQLITE_OK; // FIXME: Implement
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("flock(%s,%d)",rf->keyprefix,eLock);
+
+    if (rf->locklevel >= eLock)
+        return SQLITE_OK;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_LOCK;
+
+    // A slot moved.  With no lock held nothing of ours depends on the old map
+    if (rf->cluster && rf->cluster->stale && rf->locklevel == SQLITE_LOCK_NONE &&
+            redis_cluster_load(rf) == REDIS_ERR)
+        return SQLITE_IOERR_LOCK;
+
+    // In WAL mode sqlite only asks for an exclusive lock to find out if it
+    // is the last connection, and so can checkpoint and delete the WAL.
+    // Leases of idle connections can lapse, so the wal-index users decide
+    if (eLock == SQLITE_LOCK_EXCLUSIVE && rf->shm && redis_shm_shared(rf))
+        return SQLITE_BUSY;
+
+    int oldlevel = rf->locklevel;
+    int level = rf->backend->lock(rf, "lock", eLock);
+    if (level < 0) {
+        if (rf->cache)
+            redis_cache_clear(rf->cache);
+        return SQLITE_IOERR_LOCK;
+    }
+    rf->locklevel = level;
+
+    // Someone else may have changed the length while we held no lock.
+    // Any invalidations for their writes came in ahead of the lock reply
+    if (oldlevel == SQLITE_LOCK_NONE)
+        rf->filesize = -1;
+
+    if (level < eLock) {
+        rf->lockstats.busy++;
+        if (rf->lockwaitstart == 0)
+            rf->lockwaitstart = _now_us();
+        return SQLITE_BUSY;
+    }
+    rf->lockstats.acquired++;
+    if (rf->lockwaitstart) {
+        rf->lockstats.wait_us += _now_us() - rf->lockwaitstart;
+        rf->lockwaitstart = 0;
+    }
+    return SQLITE_OK;
 }
 int redisvfs_unlock(sqlite3_file *fp, int eLock) {
-    DLOG("stub funlock(%s,%d)",((RedisFile *)fp)->keyprefix,eLock);
-    return SQLITE_OK; // FIXME: Implement
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("funlock(%s,%d)",rf->keyprefix,eLock);
+    // Whoever gets the lock next must see everything we wrote under it
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_UNLOCK;
+    if (rf->writeback && redis_writeback_flush(rf) == REDIS_ERR)
+        return SQLITE_IOERR_UNLOCK;
+    if (eLock == SQLITE_LOCK_NONE) {
+        rf->filesize = -1;
+        if (rf->map)
+            redis_map_reset_from(rf->map, 0);
+        rf->lockwaitstart = 0;
+        redis_iostats_fold(rf);
+    }
+    if (rf->locklevel <= eLock)
+        return SQLITE_OK;
+    int level = rf->backend->lock(rf, "unlock", eLock);
+    // Whatever happened we don't hold more than was asked for. A lock
+    // left behind in redis goes when its lease runs out
+    rf->locklevel = eLock;
+    if (level < 0)
+        return SQLITE_IOERR_UNLOCK;
+    return SQLITE_OK;
 }
 int redisvfs_checkReservedLock(sqlite3_file *fp, int *pResOut) {
-    DLOG("stub");
-    return !SQLITE_OK; // FIXME: Implement
+    RedisFile *rf = (RedisFile *)fp;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_CHECKRESERVEDLOCK;
+    int reserved = rf->backend->lock(rf, "check", 0);
+    if (reserved < 0)
+        return SQLITE_IOERR_CHECKRESERVEDLOCK;
+    *pResOut = reserved;
+    return SQLITE_OK;
 }
 int redisvfs_fileControl(sqlite3_file *fp, int op, void *pArg) {
     if ( op == SQLITE_FCNTL_VFSNAME ) {
@@ -467,41 +6369,229 @@ int redisvfs_fileControl(sqlite3_file *fp, int op, void *pArg) {
         *out = sqlite3_mprintf("redisvfs");
         return SQLITE_OK;
     }
+    if ( op == SQLITE_FCNTL_MMAP_SIZE ) {
+        RedisFile *rf = (RedisFile *)fp;
+        sqlite3_int64 newlimit = *(sqlite3_int64 *)pArg;
+        *(sqlite3_int64 *)pArg = rf->mmapsizemax;
+        // A region already in use keeps its size until it's next replaced
+        if (newlimit >= 0 && newlimit != rf->mmapsizemax && !(rf->map && rf->map->nfetchout > 0)) {
+            rf->mmapsizemax = newlimit;
+            if (rf->map) {
+                redis_map_destroy(rf->map);
+                rf->map = 0;
+            }
+        }
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_CACHE_STATS ) {
+        RedisFile *rf = (RedisFile *)fp;
+        RedisBlockCacheStats *stats = (RedisBlockCacheStats *)pArg;
+        if (rf->cache)
+            *stats = rf->cache->stats;
+        else
+            memset(stats, 0, sizeof(RedisBlockCacheStats));
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_LOCK_STATS ) {
+        RedisFile *rf = (RedisFile *)fp;
+        *(RedisLockStats *)pArg = rf->lockstats;
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_COMPRESS_STATS ) {
+        RedisFile *rf = (RedisFile *)fp;
+        *(RedisCompressStats *)pArg = rf->compressstats;
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_IO_STATS ) {
+        RedisFile *rf = (RedisFile *)fp;
+        *(RedisIOStats *)pArg = rf->iostats;
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_VFS_IO_STATS ) {
+        redis_iostats_fold((RedisFile *)fp);
+        redis_get_iostats((RedisIOStats *)pArg);
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_RECLAIM_STATS ) {
+        redis_get_reclaim_stats((RedisReclaimStats *)pArg);
+        return SQLITE_OK;
+    }
+    if ( op == REDISVFS_FCNTL_RECLAIM_ORPHANS ) {
+        RedisFile *rf = (RedisFile *)fp;
+        RedisReclaimStats stats;
+        // The memory backend frees blocks as it truncates, so has none
+        if (rf->mem) {
+            if (pArg)
+                memset(pArg, 0, sizeof(RedisReclaimStats));
+            return SQLITE_OK;
+        }
+        if (redis_readahead_drain(rf) == REDIS_ERR ||
+                (rf->writeback && redis_writeback_flush(rf) == REDIS_ERR) ||
+                redis_reclaim_orphans(rf, &stats) == REDIS_ERR)
+            return SQLITE_IOERR;
+        if (pArg)
+            *(RedisReclaimStats *)pArg = stats;
+        return SQLITE_OK;
+    }
+    // PRAGMA redisvfs_reclaim_orphans, for when the file control can't be
+    // reached.  Replies with the number freed
+    if ( op == SQLITE_FCNTL_PRAGMA && sqlite3_stricmp(((char **)pArg)[1], "redisvfs_reclaim_orphans") == 0 ) {
+        RedisReclaimStats stats;
+        int rc = redisvfs_fileControl(fp, REDISVFS_FCNTL_RECLAIM_ORPHANS, &stats);
+        if (rc == SQLITE_OK)
+            ((char **)pArg)[0] = sqlite3_mprintf("%lld", stats.orphans_freed);
+        return rc;
+    }
     DLOG("No idea what %d is", op);
     return SQLITE_NOTFOUND;
 }
 int redisvfs_sectorSize(sqlite3_file *fp) {
-    DLOG("stub");
-    return REDISVFS_BLOCKSIZE;
+    DLOG("entry");
+    return ((RedisFile *)fp)->blocksize;
 }
 int redisvfs_deviceCharacteristics(sqlite3_file *fp) {
     DLOG("entry");
     // Describe ordering and consistency guarantees that we
     // can provide.  See sqlite3.h
     // TODO implement SQLITE_IOCAP_BATCH_ATOMIC
-    // TODO: If we remove SQLITE_IOCAP_ATOMIC and replace with caveated
-    // atomic op flags, we can remove transactions with redis entirely
-    return ( SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_SAFE_APPEND |
-        SQLITE_IOCAP_SEQUENTIAL | SQLITE_IOCAP_POWERSAFE_OVERWRITE |
-        SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN );
+    RedisFile *rf = (RedisFile *)fp;
+    int iocap = ( SQLITE_IOCAP_SAFE_APPEND |
+        SQLITE_IOCAP_POWERSAFE_OVERWRITE | SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN );
+
+    // Only as far as redis acking a write goes.  Levels that wait for
+    // replicas or the AOF make sqlite sync the journal first (see durability)
+    if (rf->durability >= REDISVFS_DURABILITY_REPLICAS)
+        return iocap;
+    iocap |= SQLITE_IOCAP_ATOMIC;
+
+    // Held back writes are flushed in whatever order the blocks were first
+    // dirtied, so SQLite must sync the journal before touching the database
+    if (!rf->writeback)
+        iocap |= SQLITE_IOCAP_SEQUENTIAL;
+    return iocap;
 }
 
-#if 0
-/* Methods above are valid for version 1 */
-int redisvfs_shmMap(sqlite3_file *fp, int iPg, int pgsz, int, void volatile **pp);
-int redisvfs_shmLock(sqlite3_file *fp, int offset, int n, int flags);
-void redisvfs_shmBarrier(sqlite3_file *fp);
-int redisvfs_shmUnmap(sqlite3_file *fp, int deleteFlag);
-/* Methods above are valid for version 2 */
-int redisvfs_fetch(sqlite3_file *fp, sqlite3_int64 iOfst, int iAmt, void **pp);
-int redisvfs_unfetch(sqlite3_file *fp, sqlite3_int64 iOfst, void *p);
-/* Methods above are valid for version 3 */
-#endif
+/* Attaches to the wal-index on first use (see redis_shm_open) */
+int redisvfs_shmMap(sqlite3_file *fp, int iPg, int pgsz, int bExtend, void volatile **pp) {
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s region=%d size=%d extend=%d)", rf->keyprefix, iPg, pgsz, bExtend);
+    *pp = NULL;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_SHMMAP;
+    if (!rf->shm) {
+        int rc = redis_shm_open(rf);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    if (!rf->shm->node)
+        return redis_shm_remote_map(rf, iPg, pgsz, bExtend, pp);
+
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+    sqlite3_mutex_enter(mutex);
+    int rc = redis_shm_node_map(rf->shm->node, iPg, pgsz, bExtend, pp);
+    sqlite3_mutex_leave(mutex);
+    return rc;
+}
+int redisvfs_shmLock(sqlite3_file *fp, int offset, int n, int flags) {
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s offset=%d n=%d flags=%d)", rf->keyprefix, offset, n, flags);
+    if (!rf->shm)
+        return SQLITE_IOERR_SHMLOCK;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR_SHMLOCK;
+
+    int rc;
+    if (rf->shm->node) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+        sqlite3_mutex_enter(mutex);
+        rc = redis_shm_node_lock(rf->shm, offset, n, flags);
+        sqlite3_mutex_leave(mutex);
+    } else {
+        rc = redis_shm_remote_lock(rf, offset, n, flags);
+    }
+
+    // A read lock starts a WAL read transaction.  We keep a shared lock
+    // on the database the whole time, so this is where to catch up with
+    // blocks (and the length) changed by another connection's checkpoint
+    if (rc == SQLITE_OK && flags == (SQLITE_SHM_LOCK|SQLITE_SHM_SHARED) &&
+            offset >= REDISVFS_SHM_FIRST_READ_LOCK) {
+        rf->filesize = -1;
+        if (rf->cache && redis_cache_sync_invalidations(rf) != REDIS_OK) {
+            redisvfs_shmLock(fp, offset, n, SQLITE_SHM_UNLOCK|SQLITE_SHM_SHARED);
+            rc = SQLITE_IOERR_SHMLOCK;
+        }
+    }
+    return rc;
+}
+void redisvfs_shmBarrier(sqlite3_file *fp) {
+    RedisFile *rf = (RedisFile *)fp;
+    __sync_synchronize();
+    // sqlite reads the wal-index header either side of a barrier, so this
+    // is where shm=redis picks up other hosts' commits
+    if (rf->shm && !rf->shm->node && redis_readahead_drain(rf) == REDIS_OK)
+        redis_shm_pull(rf);
+}
+int redisvfs_shmUnmap(sqlite3_file *fp, int deleteFlag) {
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s delete=%d)", rf->keyprefix, deleteFlag);
+    if (!rf->shm)
+        return SQLITE_OK;
+    if (redis_readahead_drain(rf) == REDIS_ERR)
+        return SQLITE_IOERR;
+    redis_shm_close(rf, deleteFlag);
+    return SQLITE_OK;
+}
+
+/* Hand out a pointer into the file's region, loading the blocks first if
+ * need be.  *pp is left NULL (and sqlite falls back to xRead) whenever
+ * that can't be done */
+int redisvfs_fetch(sqlite3_file *fp, sqlite3_int64 iOfst, int iAmt, void **pp) {
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s offset=%lld len=%d)", rf->keyprefix, iOfst, iAmt);
+    *pp = NULL;
+    if (rf->mmapsizemax <= 0 || rf->locklevel == SQLITE_LOCK_NONE)
+        return SQLITE_OK;
+    if (redis_lock_keepalive(rf) == REDIS_ERR || redis_shm_keepalive(rf) == REDIS_ERR)
+        return SQLITE_IOERR_READ;
+
+    sqlite3_int64 filesize;
+    int rc = redisvfs_fileSize(fp, &filesize);
+    if (rc != SQLITE_OK)
+        return rc;
+    if (iOfst + iAmt > filesize || iOfst + iAmt > rf->mmapsizemax)
+        return SQLITE_OK;
+    if ((iAmt & (iAmt-1)) != 0 || iOfst % iAmt != 0)
+        return SQLITE_OK;
+    if (redis_map_ensure(rf, iOfst + iAmt, filesize, iAmt) == REDIS_ERR)
+        return SQLITE_OK;
+
+    rc = redis_map_load(rf, iOfst, iAmt, filesize);
+    if (rc != SQLITE_OK)
+        return (rc == SQLITE_IOERR_SHORT_READ) ? SQLITE_OK : rc;
+    *pp = rf->map->region + iOfst;
+    rf->map->nfetchout++;
+    return SQLITE_OK;
+}
+
+/* p is NULL when sqlite wants every mapped page dropped */
+int redisvfs_unfetch(sqlite3_file *fp, sqlite3_int64 iOfst, void *p) {
+    RedisFile *rf = (RedisFile *)fp;
+    DLOG("(%s offset=%lld p=%p)", rf->keyprefix, iOfst, p);
+    if (!rf->map)
+        return SQLITE_OK;
+    if (p) {
+        assert(rf->map->nfetchout > 0);
+        rf->map->nfetchout--;
+    } else {
+        redis_map_reset_from(rf->map, 0);
+    }
+    return SQLITE_OK;
+}
 
 /* references to file API implementation. Added to each RedisFile *
  */
 const sqlite3_io_methods redisvfs_io_methods = {
-    1,
+    3,
     redisvfs_close,
     redisvfs_read,
     redisvfs_write,
@@ -514,6 +6604,12 @@ const sqlite3_io_methods redisvfs_io_methods = {
     redisvfs_fileControl,
     redisvfs_sectorSize,
     redisvfs_deviceCharacteristics,
+    redisvfs_shmMap,
+    redisvfs_shmLock,
+    redisvfs_shmBarrier,
+    redisvfs_shmUnmap,
+    redisvfs_fetch,
+    redisvfs_unfetch,
 };
 
 
@@ -532,11 +6628,6 @@ DLOG("(zName='%s',flags=%d)", zName,flags);
     }
 #endif
 
-    //hardcode hostname and port. for now. grab from database URI later
-    const char *hostname = REDISVFS_DEFAULT_HOST;
-    int port = REDISVFS_DEFAULT_PORT;
-
-
     RedisFile *rf = (RedisFile *)f;
     memset(rf, 0, sizeof(RedisFile));
     //  pMethods must be set even if redisvfs_open fails!
@@ -548,40 +6639,221 @@ DLOG("key prefix ('filename') length too long");
         return SQLITE_CANTOPEN;
     }
     rf->keyprefix = zName;  // Guaranteed to be unchanged until after xClose(*rf)
+    memcpy(rf->keybase, zName, rf->keyprefixlen);
+    rf->keybase[rf->keyprefixlen] = ':';
+    rf->keybaselen = rf->keyprefixlen + 1;
+    memcpy(rf->metabase, rf->keybase, rf->keybaselen);
+    rf->metabaselen = rf->keybaselen;
+    rf->openflags = flags;
+    rf->filesize = -1;
+    rf->blocksize = REDISVFS_DEFAULT_BLOCKSIZE;
 DLOG("key prefix: '%s'", rf->keyprefix);
 
-    rf->redisctx = redisConnect(hostname,port);
-    if (!(rf->redisctx) || rf->redisctx->err) {
-        if (rf->redisctx)
-            fprintf(stderr, "%s: Error: %s\n", __func__, rf->redisctx->errstr);
+    // Names us in the lock table and the wal-index users
+    static unsigned int ownerseq = 0;
+    char host[32] = "";
+    gethostname(host, sizeof(host)-1);
+    snprintf(rf->owner, sizeof(rf->owner), "%s:%d:%u", host, (int)getpid(),
+            __sync_fetch_and_add(&ownerseq, 1));
+    rf->lockleasems = sqlite3_uri_int64(zName, "lock_lease", REDISVFS_DEFAULT_LOCK_LEASE_MS);
+    if (rf->lockleasems < REDISVFS_MIN_LOCK_LEASE_MS)
+        rf->lockleasems = REDISVFS_MIN_LOCK_LEASE_MS;
+
+    const char *durability = sqlite3_uri_parameter(zName, "durability");
+    if (redis_set_durability(rf, durability) == REDIS_ERR) {
+        fprintf(stderr, "%s: Error: unknown durability '%s'\n", __func__, durability);
         return SQLITE_CANTOPEN;
     }
+    rf->durabilitytimeoutms = sqlite3_uri_int64(zName, "durability_timeout", REDISVFS_DEFAULT_DURABILITY_TIMEOUT_MS);
+    if (rf->durabilitytimeoutms < 0)
+        rf->durabilitytimeoutms = 0;
 
-    // FIXME: Check if OCREATE
-#if 0
-    if (!redis_does_block_exist(rf, 0)) {
-        DLOG("does not exists. Told.");
-        return SQLITE_IOERR;
+    // backend=memory keeps files in this process rather than in redis
+    // (see memory backend)
+    const char *backend = sqlite3_uri_parameter(zName, "backend");
+    rf->backend = &redis_backend;
+    if (backend && strcmp(backend, "memory") == 0) {
+        rf->backend = &redis_mem_backend;
+    } else if (backend && strcmp(backend, "redis") != 0) {
+        fprintf(stderr, "%s: Error: unknown backend '%s'\n", __func__, backend);
+        return SQLITE_CANTOPEN;
     }
-#endif
 
+    RedisEndpoint ep;
+    if (redis_endpoint_from_uri(zName, &ep) != REDIS_OK) {
+        fprintf(stderr, "%s: Error: bad redis endpoint in URI for '%s'\n", __func__, zName);
+        return SQLITE_CANTOPEN;
+    }
+    snprintf(rf->endpoint, sizeof(rf->endpoint), "%s", ep.name);
+    // Local wal-index names go by the endpoint, and the store is per process
+    if (rf->backend == &redis_mem_backend)
+        snprintf(rf->endpoint, sizeof(rf->endpoint), "memory:%d", (int)getpid());
+
+    // Only a default for a new main database. An existing one keeps the
+    // layout it was created with (see redis_load_blocksize)
+    const char *layout = sqlite3_uri_parameter(zName, "layout");
+    if (layout && strcmp(layout, "hash") == 0) {
+        rf->hashlayout = true;
+    } else if (layout && strcmp(layout, "blockfile") == 0) {
+        // Needs the module on the server (see redis_load_blocksize)
+        if (sqlite3_uri_boolean(zName, "cluster", 0)) {
+            fprintf(stderr, "%s: Error: layout=blockfile can't be used with cluster=1\n", __func__);
+            return SQLITE_CANTOPEN;
+        }
+        rf->blockfile = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+    } else if (layout && strcmp(layout, "keys") != 0) {
+        fprintf(stderr, "%s: Error: unknown layout '%s'\n", __func__, layout);
+        return SQLITE_CANTOPEN;
+    }
+
+    // Where the wal-index lives in WAL mode. Local shared memory only
+    // works for clients on the same host
+    const char *shm = sqlite3_uri_parameter(zName, "shm");
+    if (shm && strcmp(shm, "redis") == 0) {
+        rf->shmredis = true;
+    } else if (shm && strcmp(shm, "local") != 0) {
+        fprintf(stderr, "%s: Error: unknown shm '%s'\n", __func__, shm);
+        return SQLITE_CANTOPEN;
+    }
+
+    if (rf->backend == &redis_mem_backend) {
+        // layout=hash changes how partial reads come back, and shm=redis
+        // would need a server.  Neither means anything in-process
+        rf->hashlayout = false;
+        rf->blockfile = false;
+        rf->shmredis = false;
+        if (redis_mem_open(rf) == REDIS_ERR)
+            return SQLITE_CANTOPEN;
+    } else if (sqlite3_uri_boolean(zName, "mux", 0)) {
+        // One connection for every file on the endpoint (see shared connection)
+        if (sqlite3_uri_boolean(zName, "cluster", 0)) {
+            fprintf(stderr, "%s: Error: mux=1 can't be used with cluster=1\n", __func__);
+            return SQLITE_CANTOPEN;
+        }
+        rf->pool = VFS_POOL(vfs);
+        if (redis_mux_open(rf, &ep) == REDIS_ERR)
+            return SQLITE_CANTOPEN;
+    } else {
+        rf->pool = VFS_POOL(vfs);
+        rf->redisctx = redis_pool_get(rf->pool, &ep);
+        if (!(rf->redisctx) || rf->redisctx->err) {
+            if (rf->redisctx) {
+                fprintf(stderr, "%s: Error: %s\n", __func__, rf->redisctx->errstr);
+                redisFree(rf->redisctx);
+                rf->redisctx = 0;
+            }
+            return SQLITE_CANTOPEN;
+        }
+
+        // The redis= node only tells us where everything else is
+        if (sqlite3_uri_boolean(zName, "cluster", 0)) {
+            // Braces in the name would change the hash tag
+            if (strpbrk(rf->keyprefix, "{}")) {
+                fprintf(stderr, "%s: Error: '%s' can't be used with cluster=1\n", __func__, zName);
+                return SQLITE_CANTOPEN;
+            }
+            rf->metabase[0] = '{';
+            memcpy(rf->metabase+1, zName, rf->keyprefixlen);
+            memcpy(rf->metabase+1+rf->keyprefixlen, "}:", 3);
+            rf->metabaselen = rf->keyprefixlen + 3;
+            if (!(rf->cluster = redis_cluster_create(&ep)) || redis_cluster_load(rf) == REDIS_ERR) {
+                fprintf(stderr, "%s: Error: can't load the cluster slot map for '%s' from %s\n",
+                        __func__, zName, ep.name);
+                return SQLITE_CANTOPEN;
+            }
+        }
+    }
+
+    // Slower round trips for benchmarking (see latency injection)
+    sqlite3_int64 latency = sqlite3_uri_int64(zName, "backend_latency_us", 0);
+    sqlite3_int64 jitter = sqlite3_uri_int64(zName, "backend_jitter_us", 0);
+    if ((latency > 0 || jitter > 0) && redis_delay_wrap(rf, latency, jitter) == REDIS_ERR)
+        return SQLITE_CANTOPEN;
+
+    if ((flags & SQLITE_OPEN_MAIN_DB) && rf->backend->load_blocksize(rf, zName) == REDIS_ERR)
+        return SQLITE_CANTOPEN;
+
+    // Only worth caching the main database. Journals are write mostly.
+    // Keeping a cache coherent across cluster nodes would take a round trip
+    // to every node for each lock, so a cluster has none
+    if ((flags & SQLITE_OPEN_MAIN_DB) && rf->redisctx && !rf->cluster) {
+        sqlite3_int64 cacheblocks = sqlite3_uri_int64(zName, "cache_blocks", REDISVFS_DEFAULT_CACHE_BLOCKS);
+        if (cacheblocks > 0) {
+            if (redis_enable_tracking(rf) == REDIS_OK) {
+                rf->cache = redis_cache_create(cacheblocks, rf->blocksize);
+            } else {
+                DLOG("CLIENT TRACKING unavailable. Not caching blocks");
+            }
+        }
+
+        // Prefetched blocks land in the cache, so keep the window well
+        // short of what it holds
+        sqlite3_int64 readahead = sqlite3_uri_int64(zName, "readahead", REDISVFS_DEFAULT_READAHEAD_BLOCKS);
+        if (rf->cache && readahead > cacheblocks / 2)
+            readahead = cacheblocks / 2;
+        if (rf->cache && readahead >= REDISVFS_READAHEAD_MIN_WINDOW)
+            rf->readahead = redis_readahead_create(readahead);
+    }
+
+    // Rollback journals are appended to rather than split into blocks (see
+    // journal storage), unless write-back is to hold their writes instead
+    sqlite3_int64 writebackblocks = sqlite3_uri_int64(zName, "writeback_blocks", 0);
+    if ((flags & SQLITE_OPEN_MAIN_JOURNAL) && (rf->redisctx || rf->mux) && writebackblocks <= 0)
+        rf->journal = true;
+
+    // io_conns=K deals blocks out over K connections.  Not for layout=hash
+    // or blockfile, where every block is in the same key, or a cluster,
+    // which already has a connection per node.  Falls back to the one
+    // connection
+    if (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) {
+        sqlite3_int64 ioconns = sqlite3_uri_int64(zName, "io_conns", 1);
+        if (ioconns > REDISVFS_MAX_IO_CONNS)
+            ioconns = REDISVFS_MAX_IO_CONNS;
+        if (ioconns > 1 && rf->redisctx && !rf->cluster && !rf->hashlayout && !rf->blockfile && !rf->journal &&
+                redis_lanes_open(rf, &ep, ioconns) == REDIS_ERR) {
+            DLOG("can't open %lld connections to %s. Using one", ioconns, rf->endpoint);
+            redis_lanes_close(rf);
+        }
+    }
+
+    if (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL)) {
+        if (writebackblocks > 0)
+            rf->writeback = redis_writeback_create(writebackblocks, rf->blocksize);
+    }
+
+    // One script call per xRead and xWrite (see range I/O).  Blocks dealt
+    // out over io_conns or cluster nodes can't all be reached from one
+    // script, and compressed ones can't be spliced in Lua.  layout=blockfile
+    // has range commands of its own, so needs no script
+    if (rf->blockfile) {
+        rf->rangeio = true;
+    } else if ((flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) &&
+            sqlite3_uri_boolean(zName, "range_io", 0) &&
+            (rf->redisctx || rf->mux) && !rf->cluster && !rf->codec && !rf->journal) {
+        rf->rangeio = true;
+    }
+
+    if ((rf->redisctx || rf->mux) && !rf->blockfile && !rf->journal &&
+            redis_file_scripts_load(rf, false) == REDIS_ERR)
+        return SQLITE_CANTOPEN;
+
+    // FIXME: Check if OCREATE
     return SQLITE_OK;
 }
 
 int redisvfs_delete(sqlite3_vfs *vfs, const char *zName, int syncDir) {
 DLOG("(zName='%s',syncDir=%d)",  zName, syncDir);
-    // TODO: Better implementation that actually deletes things
     RedisFile rf;
     int openflags;
 
-    if (redisvfs_open(vfs, zName, (sqlite3_file *)(&rf), 0, &openflags) != SQLITE_OK) 
-        return SQLITE_IOERR_DELETE;
-
-    if (redis_force_set_filesize(&rf, 0) == REDIS_ERR)
-        return SQLITE_IOERR_DELETE;
+    // Borrows a pooled connection, so this is normally a single round trip
+    int ret = SQLITE_OK;
+    if (redisvfs_open(vfs, zName, (sqlite3_file *)(&rf), 0, &openflags) != SQLITE_OK ||
+            rf.backend->truncate(&rf, 0, true) == REDIS_ERR)
+        ret = SQLITE_IOERR_DELETE;
 
     redisvfs_close((sqlite3_file *)(&rf));
-    return SQLITE_OK;
+    return ret;
 }
 int redisvfs_access(sqlite3_vfs *vfs, const char *zName, int flags, int *pResOut) {
 DLOG("(zName='%s', flags=%d (%s%s%s))", zName, flags,
@@ -589,10 +6861,23 @@ DLOG("(zName='%s', flags=%d (%s%s%s))", zName, flags,
      (flags &  SQLITE_ACCESS_READWRITE) == SQLITE_ACCESS_READWRITE ? "SQLITE_ACCESS_READWRITE" : "",
      (flags &  SQLITE_ACCESS_READ) == SQLITE_ACCESS_READ ? "SQLITE_ACCESS_READ" : "");
 
-//   FIXME: Can only  check redis from a file created with redisvfs_open
-    //static bool redis_does_block_exist(RedisFile *rf, int64_t offset) {
+    // Like xDelete, on a pooled connection.  sqlite finds hot journals
+    // this way, so it has to see the journal a crashed writer left
+    RedisFile rf;
+    int openflags;
+    int ret = SQLITE_OK;
     *pResOut = 0;
-    return SQLITE_OK;
+    if (redisvfs_open(vfs, zName, (sqlite3_file *)(&rf), 0, &openflags) != SQLITE_OK) {
+        ret = SQLITE_IOERR_ACCESS;
+    } else {
+        int exists = rf.backend->exists(&rf);
+        if (exists < 0)
+            ret = SQLITE_IOERR_ACCESS;
+        else
+            *pResOut = exists;
+    }
+    redisvfs_close((sqlite3_file *)(&rf));
+    return ret;
 }
 int redisvfs_fullPathname(sqlite3_vfs *vfs, const char *zName, int nOut, char *zOut) {
 DLOG("(zName='%s',nOut=%d)", zName,nOut);
@@ -646,6 +6931,7 @@ int redisvfs_currentTimeInt64(sqlite3_vfs *vfs, sqlite3_int64 *piNow) {
 }
 
 /* VFS object for sqlite3 */
+static RedisVFSData redis_vfs_data;
 sqlite3_vfs redis_vfs = {
     2, 0, REDISVFS_MAX_PREFIXLEN, 0, /* iVersion, szOzFile, mxPathname, pNext */
     "redisvfs", 0,  /* zName, pAppData */
@@ -665,6 +6951,238 @@ sqlite3_vfs redis_vfs = {
 };
 
 
+/* redisvfs_iostats table-valued function
+ *
+ *   SELECT * FROM redisvfs_iostats;            -- main database
+ *   SELECT * FROM redisvfs_iostats('aux');     -- an attached one
+ *
+ * A row per counter (see RedisIOStats) for the database file, its journal
+ * or WAL if one is open, and the VFS totals.  Latency histogram buckets
+ * come out as <op>_under_<N>us, and only those with calls in them.
+ */
+
+enum { REDISVFS_STATS_SCOPE, REDISVFS_STATS_FILE, REDISVFS_STATS_STAT,
+       REDISVFS_STATS_VALUE, REDISVFS_STATS_SCHEMA };
+
+// Rows per RedisIOStats: 5 counters, and 3 plus a histogram per method
+#define REDISVFS_STATS_ROWS (5 + 4*(3+REDISVFS_LATENCY_BUCKETS))
+
+typedef struct RedisStatsTable {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} RedisStatsTable;
+
+struct RedisStatsRow {
+    int src;
+    char stat[32];
+    sqlite3_int64 value;
+};
+
+typedef struct RedisStatsCursor {
+    sqlite3_vtab_cursor base;
+    const char *scope[3];
+    char file[3][REDISVFS_MAX_PREFIXLEN+1];
+    struct RedisStatsRow *rows;
+    int nrows;
+    int row;
+} RedisStatsCursor;
+
+static void _stats_row(RedisStatsCursor *cur, int src, const char *stat, sqlite3_int64 value) {
+    struct RedisStatsRow *row = &cur->rows[cur->nrows++];
+    row->src = src;
+    snprintf(row->stat, sizeof(row->stat), "%s", stat);
+    row->value = value;
+}
+
+static void _stats_latency_rows(RedisStatsCursor *cur, int src, const char *op, const RedisLatencyStats *lat) {
+    char stat[32];
+    snprintf(stat, sizeof(stat), "%s_calls", op);
+    _stats_row(cur, src, stat, lat->calls);
+    snprintf(stat, sizeof(stat), "%s_us", op);
+    _stats_row(cur, src, stat, lat->total_us);
+    snprintf(stat, sizeof(stat), "%s_max_us", op);
+    _stats_row(cur, src, stat, lat->max_us);
+    for (int i=0; i<REDISVFS_LATENCY_BUCKETS; ++i) {
+        if (lat->hist[i] == 0)
+            continue;
+        if (i < REDISVFS_LATENCY_BUCKETS-1)
+            snprintf(stat, sizeof(stat), "%s_under_%lldus", op, 2LL << i);
+        else
+            snprintf(stat, sizeof(stat), "%s_over_%lldus", op, 1LL << i);
+        _stats_row(cur, src, stat, lat->hist[i]);
+    }
+}
+
+static void _stats_add(RedisStatsCursor *cur, const char *scope, const char *file, const RedisIOStats *stats) {
+    int src = 0;
+    while (cur->scope[src])
+        ++src;
+    cur->scope[src] = scope;
+    if (file)
+        snprintf(cur->file[src], sizeof(cur->file[src]), "%s", file);
+    _stats_row(cur, src, "commands", stats->commands);
+    _stats_row(cur, src, "round_trips", stats->round_trips);
+    _stats_row(cur, src, "bytes_out", stats->bytes_out);
+    _stats_row(cur, src, "bytes_in", stats->bytes_in);
+    _stats_row(cur, src, "short_reads", stats->short_reads);
+    _stats_latency_rows(cur, src, "read", &stats->read);
+    _stats_latency_rows(cur, src, "write", &stats->write);
+    _stats_latency_rows(cur, src, "sync", &stats->sync);
+    _stats_latency_rows(cur, src, "filesize", &stats->filesize);
+}
+
+static int redis_stats_connect(sqlite3 *db, void *pAux, int argc, const char *const *argv,
+        sqlite3_vtab **ppVtab, char **pzErr) {
+    int rc = sqlite3_declare_vtab(db,
+            "CREATE TABLE x(scope TEXT, file TEXT, stat TEXT, value INTEGER, schema HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+    RedisStatsTable *table = sqlite3_malloc(sizeof(RedisStatsTable));
+    if (!table)
+        return SQLITE_NOMEM;
+    memset(table, 0, sizeof(RedisStatsTable));
+    table->db = db;
+    *ppVtab = &table->base;
+    return SQLITE_OK;
+}
+
+static int redis_stats_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+/* The only argument is the schema, which defaults to main */
+static int redis_stats_bestindex(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    for (int i=0; i<info->nConstraint; ++i) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (c->iColumn != REDISVFS_STATS_SCHEMA || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+            continue;
+        if (!c->usable)
+            return SQLITE_CONSTRAINT;
+        info->aConstraintUsage[i].argvIndex = 1;
+        info->aConstraintUsage[i].omit = 1;
+        info->idxNum = 1;
+    }
+    info->estimatedCost = 100;
+    return SQLITE_OK;
+}
+
+static int redis_stats_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **ppCursor) {
+    RedisStatsCursor *cur = sqlite3_malloc(sizeof(RedisStatsCursor));
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(RedisStatsCursor));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int redis_stats_close(sqlite3_vtab_cursor *cursor) {
+    RedisStatsCursor *cur = (RedisStatsCursor *)cursor;
+    sqlite3_free(cur->rows);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int redis_stats_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr,
+        int argc, sqlite3_value **argv) {
+    RedisStatsCursor *cur = (RedisStatsCursor *)cursor;
+    sqlite3 *db = ((RedisStatsTable *)cursor->pVtab)->db;
+    const char *schema = "main";
+    if (idxNum == 1 && sqlite3_value_text(argv[0]))
+        schema = (const char *)sqlite3_value_text(argv[0]);
+
+    sqlite3_free(cur->rows);
+    memset(cur->scope, 0, sizeof(cur->scope));
+    memset(cur->file, 0, sizeof(cur->file));
+    cur->nrows = cur->row = 0;
+    cur->rows = sqlite3_malloc64(3 * REDISVFS_STATS_ROWS * sizeof(struct RedisStatsRow));
+    if (!cur->rows)
+        return SQLITE_NOMEM;
+
+    // Files that aren't ours (or aren't open) are left out.  Whatever
+    // they had counted is in the VFS totals
+    RedisIOStats stats;
+    sqlite3_file *dbfile = NULL, *jfile = NULL;
+    sqlite3_file_control(db, schema, SQLITE_FCNTL_FILE_POINTER, &dbfile);
+    if (dbfile && dbfile->pMethods == &redisvfs_io_methods) {
+        redisvfs_fileControl(dbfile, REDISVFS_FCNTL_IO_STATS, &stats);
+        _stats_add(cur, "database", ((RedisFile *)dbfile)->keyprefix, &stats);
+        sqlite3_file_control(db, schema, SQLITE_FCNTL_JOURNAL_POINTER, &jfile);
+    }
+    if (jfile && jfile->pMethods == &redisvfs_io_methods) {
+        RedisFile *rf = (RedisFile *)jfile;
+        redisvfs_fileControl(jfile, REDISVFS_FCNTL_IO_STATS, &stats);
+        redis_iostats_fold(rf);
+        _stats_add(cur, (rf->openflags & SQLITE_OPEN_WAL) ? "wal" : "journal", rf->keyprefix, &stats);
+    }
+    if (dbfile && dbfile->pMethods == &redisvfs_io_methods)
+        redisvfs_fileControl(dbfile, REDISVFS_FCNTL_VFS_IO_STATS, &stats);
+    else
+        redis_get_iostats(&stats);
+    _stats_add(cur, "vfs", NULL, &stats);
+    return SQLITE_OK;
+}
+
+static int redis_stats_next(sqlite3_vtab_cursor *cursor) {
+    ((RedisStatsCursor *)cursor)->row++;
+    return SQLITE_OK;
+}
+
+static int redis_stats_eof(sqlite3_vtab_cursor *cursor) {
+    RedisStatsCursor *cur = (RedisStatsCursor *)cursor;
+    return cur->row >= cur->nrows;
+}
+
+static int redis_stats_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    RedisStatsCursor *cur = (RedisStatsCursor *)cursor;
+    struct RedisStatsRow *row = &cur->rows[cur->row];
+    switch (col) {
+    case REDISVFS_STATS_SCOPE:
+        sqlite3_result_text(ctx, cur->scope[row->src], -1, SQLITE_STATIC);
+        break;
+    case REDISVFS_STATS_FILE:
+        if (cur->file[row->src][0])
+            sqlite3_result_text(ctx, cur->file[row->src], -1, SQLITE_TRANSIENT);
+        break;
+    case REDISVFS_STATS_STAT:
+        sqlite3_result_text(ctx, row->stat, -1, SQLITE_TRANSIENT);
+        break;
+    case REDISVFS_STATS_VALUE:
+        sqlite3_result_int64(ctx, row->value);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int redis_stats_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *pRowid) {
+    *pRowid = ((RedisStatsCursor *)cursor)->row;
+    return SQLITE_OK;
+}
+
+/* Eponymous only (no xCreate), so it needs no CREATE VIRTUAL TABLE */
+static sqlite3_module redis_stats_module = {
+    0,                          /* iVersion */
+    0,                          /* xCreate */
+    redis_stats_connect,
+    redis_stats_bestindex,
+    redis_stats_disconnect,
+    0,                          /* xDestroy */
+    redis_stats_open,
+    redis_stats_close,
+    redis_stats_filter,
+    redis_stats_next,
+    redis_stats_eof,
+    redis_stats_column,
+    redis_stats_rowid,
+};
+
+/* Registers redisvfs_iostats on a connection.  Has the signature of an
+ * extension entry point so sqlite3_auto_extension can call it */
+static int redis_stats_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+    return sqlite3_create_module(db, "redisvfs_iostats", &redis_stats_module, 0);
+}
+
+
 /* Setup VFS structures and initialise */
 int redisvfs_register() {
     int ret;
@@ -686,8 +7204,13 @@ int redisvfs_register() {
         return SQLITE_NOLFS;
 
     // Use our pAppData opaque pointer to store a reference to the
-    // underlying VFS.
-    redis_vfs.pAppData = (void *)defaultVFS;
+    // underlying VFS (and the connection pool)
+    if (redis_vfs_data.pool.mutex == 0)
+        redis_vfs_data.pool.mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    if (redis_vfs_data.pool.muxmutex == 0)
+        redis_vfs_data.pool.muxmutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    redis_vfs_data.parent = defaultVFS;
+    redis_vfs.pAppData = (void *)&redis_vfs_data;
 
     // Register outselves as the new default
     ret = sqlite3_vfs_register(&redis_vfs, 1);
@@ -696,7 +7219,8 @@ int redisvfs_register() {
         return ret;
     }
 
-    return SQLITE_OK;
+    // redisvfs_iostats on every connection opened from now on
+    return sqlite3_auto_extension((void (*)(void))redis_stats_init);
 }
 
 
@@ -715,6 +7239,9 @@ int sqlite3_redisvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routin
 
     SQLITE_EXTENSION_INIT2(pApi);
     ret = redisvfs_register();
+    // The connection loading us was opened before the auto extension
+    if (ret == SQLITE_OK)
+        ret = redis_stats_init(db, pzErrMsg, pApi);
     return (ret == SQLITE_OK) ? SQLITE_OK_LOAD_PERMANENTLY : ret;
 }
 
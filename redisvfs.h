@@ -1,15 +1,81 @@
 #ifndef __redisvfs_h
 #define __redisvfs_h
 
+#include <stdbool.h>
 #include <hiredis/hiredis.h>
 
 typedef struct sqlite3_vfs RedisVFS;
 typedef struct RedisFile RedisFile;
 
+// Server used unless the database URI says otherwise with redis=host:port
+// or redis=unix:/path/to/redis.sock
 #define REDISVFS_DEFAULT_HOST "127.0.0.1"
 #define REDISVFS_DEFAULT_PORT 6379
 
-#define REDISVFS_BLOCKSIZE 1024
+// Idle redis connections kept per VFS for reuse by later file opens
+#define REDISVFS_POOL_MAX_IDLE 16
+#define REDISVFS_MAX_ENDPOINTLEN 127
+// Leaves room for ":<port>"
+#define REDISVFS_MAX_HOSTLEN (REDISVFS_MAX_ENDPOINTLEN - 6)
+
+// cluster=1 spreads blocks over the masters of a Redis Cluster
+#define REDISVFS_CLUSTER_SLOTS 16384
+#define REDISVFS_CLUSTER_MAX_NODES 64
+
+// Most connections io_conns=K can ask for to a single server.  Blocks
+// are dealt out between them so big reads and writes go out in parallel
+#define REDISVFS_MAX_IO_CONNS 16
+
+// Block size used when nothing else says otherwise.  A new database picks
+// up the page size sqlite writes page 1 with (or block_size=N from the URI)
+// and stores it in redis so every later open uses the same layout.
+// Journals and other files always use the default.
+#define REDISVFS_DEFAULT_BLOCKSIZE 4096
+#define REDISVFS_MIN_BLOCKSIZE 512
+#define REDISVFS_MAX_BLOCKSIZE 65536
+
+// Rollback journals are written front to back, so they are kept in a few
+// big keys that writes are APPENDed to rather than in blocks
+#define REDISVFS_JOURNAL_SEGMENT (1 << 20)
+// Segments measured or unlinked per round trip
+#define REDISVFS_JOURNAL_BATCH 16
+
+// zstd level used with compress=zstd.  The fast levels get most of what
+// there is to get out of sqlite pages
+#define REDISVFS_ZSTD_LEVEL 1
+
+// Default size of the per-file block cache (in blocks).  Can be set per
+// database with the cache_blocks=N URI parameter. 0 disables the cache.
+#define REDISVFS_DEFAULT_CACHE_BLOCKS 256
+#define REDISVFS_CACHE_WAYS 4
+
+// Largest read-ahead window (in blocks) for sequential reads of a cached
+// database.  Set per database with readahead=N. 0 disables read-ahead.
+// Prefetching starts after REDISVFS_READAHEAD_TRIGGER sequential reads
+// with a window of REDISVFS_READAHEAD_MIN_WINDOW blocks.
+#define REDISVFS_DEFAULT_READAHEAD_BLOCKS 64
+#define REDISVFS_READAHEAD_MIN_WINDOW 4
+#define REDISVFS_READAHEAD_TRIGGER 2
+
+// Maximum number of dirty blocks held per file in write-back mode before
+// they are flushed early.  Write-back is enabled per database with the
+// writeback_blocks=N URI parameter. 0 (the default) is write-through.
+#define REDISVFS_MAX_WRITEBACK_BLOCKS 65536
+
+// How long a lock lasts in redis without being renewed (ms), so a client
+// that dies can't hold the database forever.  Set per database with
+// lock_lease=MS.  Locks are renewed on use once half the lease has gone
+#define REDISVFS_DEFAULT_LOCK_LEASE_MS 30000
+#define REDISVFS_MIN_LOCK_LEASE_MS 1000
+
+// How long xSync waits for replicas or the AOF with durability=replicas:N
+// or aof before failing (ms).  Set with durability_timeout=MS
+#define REDISVFS_DEFAULT_DURABILITY_TIMEOUT_MS 5000
+
+// Buckets in each latency histogram of RedisIOStats.  Bucket i counts
+// calls taking from 2^i up to 2^(i+1) us (bucket 0 from 0), and the last
+// one everything from 2^(REDISVFS_LATENCY_BUCKETS-1) us (about 8s) up
+#define REDISVFS_LATENCY_BUCKETS 24
 
 // These are mostly arbitrary, but both MAX_PREFIXLEN and MAX_KEYLEN
 // must be increased/decreased by the same amount.  Given every file
@@ -20,16 +86,206 @@ typedef struct RedisFile RedisFile;
 
 #define REDISVFS_KEYBUFLEN ( REDISVFS_MAX_KEYLEN + 1 )
 
+/* Custom file control opcodes handled by redisvfs_fileControl.
+ * Kept well clear of the SQLITE_FCNTL_* range */
+#define REDISVFS_FCNTL_CACHE_STATS 1001  /* pArg is RedisBlockCacheStats * */
+#define REDISVFS_FCNTL_RECLAIM_STATS 1002  /* pArg is RedisReclaimStats *. Totals for the VFS */
+#define REDISVFS_FCNTL_RECLAIM_ORPHANS 1003  /* pArg is RedisReclaimStats * for this run, or NULL */
+#define REDISVFS_FCNTL_LOCK_STATS 1004  /* pArg is RedisLockStats * */
+#define REDISVFS_FCNTL_COMPRESS_STATS 1005  /* pArg is RedisCompressStats * */
+#define REDISVFS_FCNTL_IO_STATS 1006  /* pArg is RedisIOStats * */
+#define REDISVFS_FCNTL_VFS_IO_STATS 1007  /* pArg is RedisIOStats *. Totals for the VFS */
+
+/* Counters for sizing the block cache */
+typedef struct RedisBlockCacheStats {
+	sqlite3_int64 hits;
+	sqlite3_int64 misses;
+	sqlite3_int64 invalidations;	// blocks dropped because redis told us they changed
+	sqlite3_int64 evictions;	// blocks dropped to make room
+	sqlite3_int64 prefetched;	// blocks requested by read-ahead
+	sqlite3_int64 prefetch_hits;	// prefetched blocks that were then read
+} RedisBlockCacheStats;
+
+/* Blocks freed by xTruncate/xDelete, and stray blocks past the end of a
+ * file found (and freed) by REDISVFS_FCNTL_RECLAIM_ORPHANS */
+typedef struct RedisReclaimStats {
+	sqlite3_int64 blocks_freed;
+	sqlite3_int64 orphans_found;
+	sqlite3_int64 orphans_freed;
+} RedisReclaimStats;
+
+/* Lock contention on a database */
+typedef struct RedisLockStats {
+	sqlite3_int64 acquired;
+	sqlite3_int64 busy;	// requests refused because someone else held the lock
+	sqlite3_int64 wait_us;	// from the first refusal until the lock was got
+	sqlite3_int64 renewals;
+	sqlite3_int64 lost;	// leases that ran out before they were renewed
+} RedisLockStats;
+
+/* Block compression (compress=) and all zero blocks left out.  The
+ * compression ratio is bytes_in / bytes_out */
+typedef struct RedisCompressStats {
+	sqlite3_int64 blocks_compressed;
+	sqlite3_int64 blocks_uncompressed;	// stored as is because compressing didn't make them smaller
+	sqlite3_int64 blocks_decompressed;
+	sqlite3_int64 zero_blocks;	// deleted rather than stored
+	sqlite3_int64 bytes_in;	// whole blocks given to the compressor
+	sqlite3_int64 bytes_out;	// what was stored for them
+	sqlite3_int64 compress_us;
+	sqlite3_int64 decompress_us;
+} RedisCompressStats;
+
+/* Calls to one file method and how long they took */
+typedef struct RedisLatencyStats {
+	sqlite3_int64 calls;
+	sqlite3_int64 total_us;
+	sqlite3_int64 max_us;
+	sqlite3_int64 hist[REDISVFS_LATENCY_BUCKETS];	// see REDISVFS_LATENCY_BUCKETS
+} RedisLatencyStats;
+
+/* Traffic to redis and where the time went.  Always counted.  A file's
+ * counts are added to the VFS totals when it syncs, unlocks or closes */
+typedef struct RedisIOStats {
+	sqlite3_int64 commands;	// sent to redis
+	sqlite3_int64 round_trips;	// waits for replies to what was sent
+	sqlite3_int64 bytes_out;	// commands as sent (RESP)
+	sqlite3_int64 bytes_in;	// reply payload (strings, not RESP framing)
+	sqlite3_int64 short_reads;	// xReads that ran past the end of the file
+	RedisLatencyStats read;
+	RedisLatencyStats write;
+	RedisLatencyStats sync;
+	RedisLatencyStats filesize;
+} RedisIOStats;
+
+typedef struct RedisBlockCache RedisBlockCache;
+typedef struct RedisReadAhead RedisReadAhead;
+typedef struct RedisWriteBack RedisWriteBack;
+typedef struct RedisConnPool RedisConnPool;
+typedef struct RedisMap RedisMap;
+typedef struct RedisShm RedisShm;
+typedef struct RedisCodec RedisCodec;
+typedef struct RedisCluster RedisCluster;
+typedef struct RedisBackend RedisBackend;
+typedef struct RedisMemConn RedisMemConn;
+typedef struct RedisMuxConn RedisMuxConn;
+typedef struct RedisDelay RedisDelay;
+
 /* virtual file that we can use to keep per "file" state */
 struct RedisFile {
 	// mandatory base class
 	sqlite3_file base;
 
-	// Just have a file be the same as a redis connection for now
+	// Where the blocks are kept (see block store backends).  mem is the
+	// file in the in-process store with backend=memory, and delay the
+	// latency added with backend_latency_us=
+	const RedisBackend *backend;
+	RedisMemConn *mem;
+	RedisDelay *delay;
+
+	// Connection borrowed from the VFS connection pool for as long as
+	// the file is open.  NULL with backend=memory or mux=1
 	redisContext *redisctx;
+	RedisConnPool *pool;
+	char endpoint[REDISVFS_MAX_ENDPOINTLEN+1];
+	// mux=1: the file's use of the connection every file on the endpoint
+	// shares (see shared connection)
+	RedisMuxConn *mux;
 	
 	const char *keyprefix;
 	size_t keyprefixlen;
+	// "<keyprefix>:" that every block key starts with
+	char keybase[REDISVFS_MAX_PREFIXLEN+2];
+	size_t keybaselen;
+	// Start of the length, block size, lock and other keys of the file.
+	// "{<keyprefix>}:" in cluster mode so they share a slot, otherwise
+	// the same as keybase
+	char metabase[REDISVFS_MAX_PREFIXLEN+4];
+	size_t metabaselen;
+
+	// cluster=1: connections to every node, and which node each block
+	// command went to.  redisctx is the node with the metadata keys.
+	// io_conns=K on a single server: the K connections to it.  NULL if
+	// there is only redisctx
+	RedisCluster *cluster;
+
+	// RESP for block commands is encoded here before going to hiredis.
+	// Reused for the life of the file and only ever grows
+	char *cmdbuf;
+	size_t cmdlen;
+	size_t cmdcap;
+	bool cmdoom;	// an allocation failed since the last resp_end
+	// A reply since this was cleared was NOSCRIPT (see redis_file_scripts_load)
+	bool noscript;
+
+	// layout=hash: the file is one redis hash rather than a key per block
+	bool hashlayout;
+	// layout=blockfile: the file is one key of the blockfile module's type
+	bool blockfile;
+	// Rollback journal kept as APPENDed segments rather than blocks
+	bool journal;
+	// range_io=1: each xRead and xWrite is one script call (see range
+	// I/O)
+	bool rangeio;
+
+	// Counters for REDISVFS_FCNTL_IO_STATS, and what of them has been
+	// added to the VFS totals already
+	RedisIOStats iostats;
+	RedisIOStats iofolded;
+	bool iowaiting;	// commands sent that no reply has been read for yet
+
+	// SQLITE_OPEN_* flags the file was opened with
+	int openflags;
+
+	// Bytes per block in redis
+	int blocksize;
+	bool blocksize_unsaved;	// new database. Not stored in redis until first written
+	bool blocksize_fixed;	// set with block_size=N rather than from the page size
+
+	// Block compression.  NULL if the database isn't compressed
+	RedisCodec *codec;
+	RedisCompressStats compressstats;
+
+	// Current SQLITE_LOCK_* level held on the file, in redis under our
+	// owner name.  The lease was last renewed at lockrenewed (us, monotonic)
+	int locklevel;
+	char owner[64];
+	sqlite3_int64 lockleasems;
+	sqlite3_int64 lockrenewed;
+	sqlite3_int64 lockwaitstart;	// first SQLITE_BUSY of the current wait, or 0
+	RedisLockStats lockstats;
+
+	// What xSync waits for (see durability).  durabilityreplicas is the
+	// N of durability=replicas:N or aof:N
+	int durability;
+	int durabilityreplicas;
+	sqlite3_int64 durabilitytimeoutms;
+
+	// Length of the file as last seen in redis, or -1 if unknown.
+	// Only trusted while a lock is held (see _filesize_cacheable)
+	sqlite3_int64 filesize;
+
+	// Client side block cache kept coherent by redis CLIENT TRACKING
+	// invalidation pushes.  NULL if caching is disabled for this file.
+	RedisBlockCache *cache;
+
+	// Sequential access detection and outstanding prefetches.  Only
+	// used with the cache. NULL if read-ahead is off.
+	RedisReadAhead *readahead;
+
+	// Dirty blocks held back until xSync/xUnlock in write-back mode.
+	// NULL if writes go straight through to redis.
+	RedisWriteBack *writeback;
+
+	// Local copy of the file that xFetch hands out pointers into.
+	// Made on the first xFetch once PRAGMA mmap_size sets a limit
+	RedisMap *map;
+	sqlite3_int64 mmapsizemax;
+
+	// WAL mode wal-index.  Attached on the first xShmMap.  shm=redis
+	// keeps it in redis rather than local shared memory
+	RedisShm *shm;
+	bool shmredis;
 };
 
 /* Prototypes of all sqlite3 file op functions that can be implemented
@@ -0,0 +1,97 @@
+/* SQLengine: a simple C++ wrapper for sqlite3, shared by sqlitedis and
+ * sqlitedis-bench
+ *
+ * David Basden <davidb-sqlitedis@oztechninja.com>
+ */
+#ifndef __sqlengine_h
+#define __sqlengine_h
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "sqlite3.h"
+
+class SQLengine {
+	sqlite3 *db;
+
+	static int _row_print_callback(void *arg, int ncols, char **cols, char **colnames) {
+		for (int i=0; i<ncols; ++i) {
+			std::cout << colnames[i] << "=" << cols[i] << "  ";
+		}
+		std::cout << std::endl;
+		return 0;
+	}
+
+	public:
+
+	explicit SQLengine(const char *dbName = "database.sqlite",
+			int openFlags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI)
+	{
+
+		 if (sqlite3_open_v2(dbName, &db, openFlags, NULL)) {
+			auto err = std::string("sqlite3_open: ") + dbName +": "+ sqlite3_errmsg(db);
+			throw std::runtime_error(err);
+		 }
+	}
+	~SQLengine() {
+		sqlite3_close(db);
+	}
+
+	
+	void exec(const char *sql) {
+		char *errmsg = NULL;
+		if (sqlite3_exec(db, sql, _row_print_callback, NULL, &errmsg)) {
+			auto err = std::string(errmsg);
+			sqlite3_free(errmsg);
+			throw std::runtime_error(err);
+		};
+
+	}
+
+	void loadExtension(const char *sharedLib) {
+		char *errmsg = NULL;
+		sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+		if(sqlite3_load_extension(db, sharedLib, NULL, &errmsg)) {
+			auto err = std::string(errmsg);
+			sqlite3_free(errmsg);
+			throw std::runtime_error(err);
+		};
+	}
+
+	// For anything the methods here don't cover
+	sqlite3 *handle() {
+		return db;
+	}
+
+	std::string currentVFSname() {
+		sqlite3_vfs *vfs;
+		sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+		return std::string(vfs->zName);
+	}
+
+	static void loadPersistentExtension(const char *sharedLib) {
+		// If the know the extension is persistent, we just create a
+		// memory backed sqlite db load the extension into it, and then
+		// throw away the db
+		SQLengine tmpeng(":memory:");
+		tmpeng.loadExtension(sharedLib);
+	}
+
+	static void dumpvfslist() {
+	    std::cerr << "vfs available:";
+	    for(sqlite3_vfs *vfs=sqlite3_vfs_find(0); vfs; vfs=vfs->pNext){
+		std::cerr << " " << vfs->zName;
+	    }
+	    std::cerr << std::endl;
+	    std::cerr << "default vfs is " << SQLengine::defaultVFS() << std::endl;
+	}
+	static std::string defaultVFS() {
+	    sqlite3_vfs *vfs = sqlite3_vfs_find(0);
+	    return std::string(vfs->zName);
+	}
+
+
+};
+
+#endif // __sqlengine_h
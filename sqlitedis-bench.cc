@@ -0,0 +1,232 @@
+/* Benchmarks for redisvfs.  Runs the same workloads against any VFS, so
+ * the default unix VFS makes a baseline (see bench.sh)
+ *
+ *   sqlitedis-bench <database URI> [workload ...]
+ *
+ * Workloads are bulk_insert, point_lookup, range_scan and mixed_oltp (all
+ * of them, in that order, by default).  Each op is one transaction.  The
+ * table is filled with BENCH_ROWS rows (default 10000) first, and each
+ * workload times BENCH_OPS ops (default 1000).  Keys come from a fixed
+ * seed so every run does the same work.
+ *
+ * Prints a JSON object per workload, one per line.  The redis_* fields
+ * are from the VFS I/O counters, and null for other VFSs.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sqlite3.h"
+#include "sqlengine.h"
+
+extern "C" {
+#include "redisvfs.h"
+}
+
+
+class Statement {
+	sqlite3_stmt *stmt;
+
+	public:
+
+	Statement(SQLengine &sql, const char *zSql) {
+		if (sqlite3_prepare_v2(sql.handle(), zSql, -1, &stmt, NULL) != SQLITE_OK)
+			throw std::runtime_error(std::string("prepare: ") + sqlite3_errmsg(sql.handle()));
+	}
+	~Statement() {
+		sqlite3_finalize(stmt);
+	}
+
+	Statement &bind(int i, sqlite3_int64 v) {
+		sqlite3_bind_int64(stmt, i, v);
+		return *this;
+	}
+
+	// Step through every row, and reset for the next run
+	void run() {
+		int rc;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+			;
+		if (rc != SQLITE_DONE) {
+			auto err = std::string(sqlite3_errmsg(sqlite3_db_handle(stmt)));
+			sqlite3_reset(stmt);
+			throw std::runtime_error(err);
+		}
+		sqlite3_reset(stmt);
+	}
+};
+
+
+class Bench {
+	SQLengine &sql;
+	std::mt19937_64 rng;
+	sqlite3_int64 maxid;
+
+	Statement begin, commit, insert, lookup, scan, update, remove;
+
+	sqlite3_int64 randomid() {
+		return std::uniform_int_distribution<sqlite3_int64>(1, maxid)(rng);
+	}
+	void insertrow() {
+		insert.bind(1, ++maxid).bind(2, rng() % 1000000).run();
+	}
+
+	public:
+
+	explicit Bench(SQLengine &sql) :
+		sql(sql), rng(42), maxid(0),
+		begin(sql, "BEGIN"),
+		commit(sql, "COMMIT"),
+		insert(sql, "INSERT INTO bench VALUES (?1, ?2, randomblob(200))"),
+		lookup(sql, "SELECT k, v FROM bench WHERE id=?1"),
+		scan(sql, "SELECT sum(k), sum(length(v)) FROM bench WHERE id BETWEEN ?1 AND ?1+?2-1"),
+		update(sql, "UPDATE bench SET k=?2 WHERE id=?1"),
+		remove(sql, "DELETE FROM bench WHERE id=?1")
+	{}
+
+	void fill(sqlite3_int64 nrows) {
+		while (maxid < nrows) {
+			begin.run();
+			for (int i=0; i<1000 && maxid < nrows; ++i)
+				insertrow();
+			commit.run();
+		}
+	}
+
+	// 100 rows appended
+	void bulk_insert() {
+		begin.run();
+		for (int i=0; i<100; ++i)
+			insertrow();
+		commit.run();
+	}
+
+	void point_lookup() {
+		lookup.bind(1, randomid()).run();
+	}
+
+	// 100 rows in key order
+	void range_scan() {
+		scan.bind(1, randomid()).bind(2, 100).run();
+	}
+
+	// Something like a sysbench OLTP read/write transaction
+	void mixed_oltp() {
+		begin.run();
+		for (int i=0; i<5; ++i)
+			lookup.bind(1, randomid()).run();
+		scan.bind(1, randomid()).bind(2, 10).run();
+		update.bind(1, randomid()).bind(2, rng() % 1000000).run();
+		remove.bind(1, randomid()).run();
+		insertrow();
+		commit.run();
+	}
+};
+
+
+struct Workload {
+	const char *name;
+	void (Bench::*op)();
+};
+
+static const Workload workloads[] = {
+	{ "bulk_insert", &Bench::bulk_insert },
+	{ "point_lookup", &Bench::point_lookup },
+	{ "range_scan", &Bench::range_scan },
+	{ "mixed_oltp", &Bench::mixed_oltp },
+};
+
+static sqlite3_int64 envint(const char *name, sqlite3_int64 dflt) {
+	const char *val = getenv(name);
+	return (val && atoll(val) > 0) ? atoll(val) : dflt;
+}
+
+// Totals for the whole VFS, so journal and WAL traffic is included
+static bool vfsiostats(SQLengine &sql, RedisIOStats *stats) {
+	return sqlite3_file_control(sql.handle(), "main", REDISVFS_FCNTL_VFS_IO_STATS, stats) == SQLITE_OK;
+}
+
+static void run(SQLengine &sql, const char *uri, Bench &bench, const Workload &w, sqlite3_int64 nops) {
+	using clock = std::chrono::steady_clock;
+	std::vector<sqlite3_int64> latency_us;
+	latency_us.reserve(nops);
+
+	RedisIOStats before, after;
+	bool redis = vfsiostats(sql, &before);
+	auto start = clock::now();
+	for (sqlite3_int64 i=0; i<nops; ++i) {
+		auto opstart = clock::now();
+		(bench.*w.op)();
+		latency_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - opstart).count());
+	}
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	redis = redis && vfsiostats(sql, &after);
+
+	std::sort(latency_us.begin(), latency_us.end());
+	auto percentile = [&](int p) {
+		return latency_us[std::min<size_t>(latency_us.size()-1, latency_us.size() * p / 100)];
+	};
+	printf("{\"workload\":\"%s\",\"vfs\":\"%s\",\"uri\":\"%s\",\"ops\":%lld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+			"\"p50_us\":%lld,\"p99_us\":%lld,",
+			w.name, sql.currentVFSname().c_str(), uri, (long long)nops, seconds, nops / seconds,
+			(long long)percentile(50), (long long)percentile(99));
+	if (redis)
+		printf("\"redis_commands_per_txn\":%.2f,\"redis_round_trips_per_txn\":%.2f,"
+				"\"redis_bytes_out_per_txn\":%.0f,\"redis_bytes_in_per_txn\":%.0f}\n",
+				(double)(after.commands - before.commands) / nops,
+				(double)(after.round_trips - before.round_trips) / nops,
+				(double)(after.bytes_out - before.bytes_out) / nops,
+				(double)(after.bytes_in - before.bytes_in) / nops);
+	else
+		printf("\"redis_commands_per_txn\":null,\"redis_round_trips_per_txn\":null,"
+				"\"redis_bytes_out_per_txn\":null,\"redis_bytes_in_per_txn\":null}\n");
+	fflush(stdout);
+}
+
+int main(int argc, const char **argv) {
+	if (argc < 2) {
+		std::cerr << argv[0] << " <database URI> [workload ...]" << std::endl <<
+			std::endl << "workloads:";
+		for (const Workload &w : workloads)
+			std::cerr << " " << w.name;
+		std::cerr << std::endl << "optional environment variables: BENCH_ROWS BENCH_OPS" << std::endl;
+		return 1;
+	}
+	if (redisvfs_register() != SQLITE_OK) {
+		return 1;
+	}
+	sqlite3_int64 nrows = envint("BENCH_ROWS", 10000);
+	sqlite3_int64 nops = envint("BENCH_OPS", 1000);
+
+	try {
+		std::vector<const Workload *> torun;
+		for (int i=2; i<argc; ++i) {
+			auto w = std::find_if(std::begin(workloads), std::end(workloads),
+					[&](const Workload &w) { return w.name == std::string(argv[i]); });
+			if (w == std::end(workloads))
+				throw std::runtime_error(std::string("unknown workload ") + argv[i]);
+			torun.push_back(w);
+		}
+		if (torun.empty())
+			for (const Workload &w : workloads)
+				torun.push_back(&w);
+
+		SQLengine sql(argv[1]);
+		sql.exec("DROP TABLE IF EXISTS bench;"
+				"CREATE TABLE bench (id INTEGER PRIMARY KEY, k INTEGER, v BLOB);"
+				"CREATE INDEX bench_k ON bench (k);");
+		Bench bench(sql);
+		bench.fill(nrows);
+		for (const Workload *w : torun)
+			run(sql, argv[1], bench, *w, nops);
+	} catch (std::exception &e) {
+		std::cerr << argv[0] << ": " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
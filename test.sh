@@ -54,3 +54,204 @@ echo --- dynload sqliteredis
 	./sqlitedis 'SELECT * FROM fish'
 	./sqlitedis 'DROP TABLE fish'
 )
+
+echo
+echo --- URI options
+# The same checks with each feature's URI parameters, against redis and
+# the in-process backend, in rollback journal and WAL mode.  Files on
+# backend=memory go when the process exits, so each check is one run.  The
+# padding spreads rows over several blocks, and the VACUUM after the
+# DELETE truncates the database.  Codecs this build doesn't have are
+# skipped
+(
+	for backend in "" backend=memory; do
+	for opts in "" cache_blocks=0 cache_blocks=4 writeback_blocks=8 block_size=1024 \
+			lock_lease=1000 compress=lz4 compress=zstd durability=none durability=ack \
+			mux=1 range_io=1 io_conns=4 layout=hash shm=redis; do
+	for mode in delete wal; do
+		# A database keeps the block size and codec it was made with
+		db=optdb${opts:+-${opts//[=:]/-}}
+		export SQLITE_DB="file:$db?vfs=redisvfs&$backend&$opts"
+		if [ "${opts%=*}" = compress ] && ! ./static-sqlitedis 'SELECT 1' >/dev/null 2>&1; then
+			echo "$opts skipped"
+			continue
+		fi
+		(
+		set -x
+		./static-sqlitedis "
+		PRAGMA journal_mode=$mode;
+		DROP TABLE IF EXISTS fish;
+		CREATE TABLE fish (a,b,c);
+		INSERT INTO fish VALUES (1,2,3);
+		INSERT INTO fish VALUES (4,5,6);
+		WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM n WHERE x<200)
+			INSERT INTO fish SELECT x, zeroblob(500), randomblob(500) FROM n;
+		DELETE FROM fish WHERE b != 2 AND b != 5;
+		VACUUM;
+		SELECT * FROM fish;
+		PRAGMA integrity_check;
+		DROP TABLE fish;
+		PRAGMA journal_mode=delete;
+		VACUUM;"
+		)
+	done
+	done
+	done
+)
+
+echo
+echo --- layout=blockfile
+# The URI options checks with layout=blockfile, on a redis-server with the
+# module loaded on BLOCKFILE_PORT (default 7010).  DEBUG RELOAD saves the
+# blockfiles to an RDB and loads them back before they're checked.  Needs
+# the module built (redismodule.h found), redis-server and redis-cli on the
+# PATH
+if [ -f blockfile.so ] && command -v redis-server && command -v redis-cli; then
+(
+	port=${BLOCKFILE_PORT:-7010}
+	dir=$(mktemp -d)
+	trap 'redis-cli -p $port shutdown nosave >/dev/null 2>&1; rm -rf "$dir"' EXIT
+	# DEBUG is off unless asked for from redis 7
+	debug=
+	redis-server --version | grep 'v=[0-6]\.' >/dev/null || debug='--enable-debug-command yes'
+	set -x
+	redis-server --port $port --loadmodule "$PWD/blockfile.so" $debug \
+		--dir "$dir" --save '' --appendonly no --daemonize yes --logfile "$dir/redis.log"
+	until redis-cli -p $port ping >/dev/null 2>&1; do sleep 0.1; done
+
+	for opts in "" cache_blocks=0 writeback_blocks=8 block_size=1024 \
+			lock_lease=1000 durability=none mux=1 shm=redis; do
+	for mode in delete wal; do
+		db=blockfiledb${opts:+-${opts//[=:]/-}}
+		export SQLITE_DB="file:$db?vfs=redisvfs&redis=127.0.0.1:$port&layout=blockfile&$opts"
+		./static-sqlitedis "
+		PRAGMA journal_mode=$mode;
+		DROP TABLE IF EXISTS fish;
+		CREATE TABLE fish (a,b,c);
+		INSERT INTO fish VALUES (1,2,3);
+		INSERT INTO fish VALUES (4,5,6);
+		WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM n WHERE x<200)
+			INSERT INTO fish SELECT x, zeroblob(500), randomblob(500) FROM n;
+		DELETE FROM fish WHERE b != 2 AND b != 5;
+		VACUUM;"
+		redis-cli -p $port type $db | grep blockfile
+		redis-cli -p $port debug reload | grep OK
+		./static-sqlitedis 'SELECT * FROM fish' | grep 'a=4'
+		./static-sqlitedis "
+		PRAGMA integrity_check;
+		DROP TABLE fish;
+		PRAGMA journal_mode=delete;
+		VACUUM;" | grep 'integrity_check=ok'
+	done
+	done
+)
+else
+	echo skipped
+fi
+
+echo
+echo --- orphan reclaim
+# A layout=hash database is one key named after it, so one called
+# reclaimdb:cafe looks like a block of reclaimdb.  It has to survive
+# reclaiming reclaimdb's orphans
+(
+	export SQLITE_DB='file:reclaimdb?vfs=redisvfs'
+	set -x
+	./static-sqlitedis 'DROP TABLE IF EXISTS fish; CREATE TABLE fish (a,b,c); INSERT INTO fish VALUES (1,2,3)'
+	SQLITE_DB='file:reclaimdb:cafe?vfs=redisvfs&layout=hash' \
+		./static-sqlitedis 'DROP TABLE IF EXISTS fish; CREATE TABLE fish (a,b,c); INSERT INTO fish VALUES (4,5,6)'
+	./static-sqlitedis 'PRAGMA redisvfs_reclaim_orphans'
+	SQLITE_DB='file:reclaimdb:cafe?vfs=redisvfs' ./static-sqlitedis 'SELECT * FROM fish' | grep 'a=4'
+)
+
+echo
+echo --- hot journal
+# A writer killed mid-transaction leaves a rollback journal, and its lock
+# until the lease runs out.  The next connection has to find the journal
+# and roll the database back.  The small page cache makes the writer spill
+# changed pages to the database before it commits.  Needs sqlite3 on the
+# PATH
+if command -v sqlite3; then
+(
+	export SQLITE_DB='file:hotdb?vfs=redisvfs&lock_lease=1000'
+	set -x
+	./static-sqlitedis "
+	DROP TABLE IF EXISTS fish;
+	CREATE TABLE fish (a,b,c);
+	WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM n WHERE x<3000)
+		INSERT INTO fish SELECT x, 1, randomblob(900) FROM n;"
+	sqlite3 -bail <<-SQL || true
+	.load ./redisvfs
+	.open $SQLITE_DB
+	PRAGMA cache_size=5;
+	BEGIN;
+	UPDATE fish SET b=2, c=randomblob(950);
+	.shell kill -9 \$PPID
+	SQL
+	sleep 2
+	./static-sqlitedis 'SELECT count(*), sum(b) FROM fish' | grep 'sum(b)=3000'
+	./static-sqlitedis 'PRAGMA integrity_check' | grep 'integrity_check=ok'
+	./static-sqlitedis 'DROP TABLE fish'
+)
+else
+	echo skipped
+fi
+
+echo
+echo --- cluster redirects
+# Three masters on CLUSTER_PORT and up (default 7000).  The slot of the
+# database's first block is moved while the sqlite3 shell has it open, so
+# reads and writes have to follow an ASK and then a MOVED.  Needs
+# redis-server, redis-cli and sqlite3 on the PATH
+if command -v redis-server && command -v redis-cli && command -v sqlite3; then
+(
+	port=${CLUSTER_PORT:-7000}
+	ports="$port $((port+1)) $((port+2))"
+	dir=$(mktemp -d)
+	trap 'for p in $ports; do redis-cli -p $p shutdown nosave >/dev/null 2>&1; done; rm -rf "$dir"' EXIT
+	set -x
+	for p in $ports; do
+		redis-server --port $p --cluster-enabled yes --cluster-config-file nodes-$p.conf \
+			--dir "$dir" --save '' --appendonly no --daemonize yes --logfile "$dir/$p.log"
+	done
+	for p in $ports; do until redis-cli -p $p ping >/dev/null 2>&1; do sleep 0.1; done; done
+	redis-cli --cluster create $(for p in $ports; do echo 127.0.0.1:$p; done) --cluster-yes >/dev/null
+	for p in $ports; do until redis-cli -p $p cluster info | grep -q cluster_state:ok; do sleep 0.1; done; done
+
+	export SQLITE_DB="file:clusterdb?vfs=redisvfs&cluster=1&redis=127.0.0.1:$port"
+	./static-sqlitedis 'CREATE TABLE fish (a,b,c)'
+	./static-sqlitedis 'INSERT INTO fish VALUES (1,2,3)'
+
+	key=clusterdb:0
+	slot=$(redis-cli -p $port cluster keyslot $key)
+	for p in $ports; do redis-cli -p $p exists $key | grep -q MOVED || src=$p; done
+	for p in $ports; do [ $p = $src ] || dst=$p; done
+	srcid=$(redis-cli -p $src cluster myid)
+	dstid=$(redis-cli -p $dst cluster myid)
+	cat > "$dir/ask.sh" <<-ASK
+	redis-cli -p $dst cluster setslot $slot importing $srcid
+	redis-cli -p $src cluster setslot $slot migrating $dstid
+	redis-cli -p $src migrate 127.0.0.1 $dst "" 0 5000 keys \$(redis-cli -p $src cluster getkeysinslot $slot 1000)
+	ASK
+	cat > "$dir/moved.sh" <<-MOVED
+	for p in $ports; do redis-cli -p \$p cluster setslot $slot node $dstid; done
+	MOVED
+
+	sqlite3 -bail <<-SQL
+	.load ./redisvfs
+	.open $SQLITE_DB
+	SELECT * FROM fish;
+	.shell sh $dir/ask.sh >/dev/null
+	SELECT * FROM fish;
+	INSERT INTO fish VALUES (4,5,6);
+	.shell sh $dir/moved.sh >/dev/null
+	SELECT * FROM fish;
+	INSERT INTO fish VALUES (7,8,9);
+	PRAGMA integrity_check;
+	SQL
+	./static-sqlitedis 'SELECT * FROM fish'
+	./static-sqlitedis 'DROP TABLE fish'
+)
+else
+	echo skipped
+fi